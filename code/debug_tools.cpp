@@ -4,7 +4,7 @@
 #include "glew/GL/glew.h"
 #include "sdl/sdl.h"
 const int MAX_DEBUG_LINES = 1000000;
-const int MAX_DEBUG_TEXT_CHAR = 1024;
+const int MAX_DEBUG_TEXT_CHAR = 4096;
 
 void APIENTRY glDebugOutput(GLenum source,
                             GLenum type,
@@ -63,7 +63,6 @@ struct LineBuffer
     uint32 pointCount;
     uint32 capacity;
     LineVertex* vertices;
-    uint32 vboID;
 
     bool AddLine(vec3f pointA, vec3f pointB, vec3f color)
     {
@@ -153,24 +152,21 @@ LineBuffer CreateLineBuffer(uint32 capacity)
     buffer.vertices = (LineVertex*)SDL_malloc(sizeof(LineVertex)*capacity);
     buffer.capacity = capacity;
     buffer.pointCount = 0;
-    glGenBuffers(1, &buffer.vboID);
-    glBindBuffer(GL_ARRAY_BUFFER, buffer.vboID);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(LineVertex)*capacity, NULL, GL_DYNAMIC_DRAW);
 
     return buffer;
 }
 
-void UploadLineBuffer(const LineBuffer& lineBuffer)
+//Streams the lines through stream and draws them, in batches when there are more than fit in one of its regions
+void DrawLines(const LineBuffer& buffer, StreamBuffer& stream)
 {
-	glBindBuffer(GL_ARRAY_BUFFER, lineBuffer.vboID);
-	glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(LineVertex)*lineBuffer.pointCount, (void*)lineBuffer.vertices);
-}
-
-void DrawLines(const LineBuffer& buffer)
-{
-    glBindBuffer(GL_ARRAY_BUFFER, buffer.vboID);
-    glBindVertexBuffer(0, buffer.vboID, 0, sizeof(LineVertex));
-    glDrawArrays(GL_LINES, 0, buffer.pointCount);
+    uint32 batchCapacity = (stream.regionSize / sizeof(LineVertex)) & ~1u;
+    for (uint32 first = 0; first < buffer.pointCount; first += batchCapacity)
+    {
+        uint32 count = glm::min(batchCapacity, buffer.pointCount - first);
+        uint32 offset = WriteStreamBuffer(stream, buffer.vertices + first, sizeof(LineVertex)*count);
+        glBindVertexBuffer(0, stream.glID, offset, sizeof(LineVertex));
+        glDrawArrays(GL_LINES, 0, count);
+    }
 }
 
 struct Timer
@@ -203,6 +199,7 @@ struct DebugMemory
     bool DebugColliders;
     bool DebugPlayerCollision;
     bool DebugShadowmap;
+    bool DebugMemoryStats;
 
     void Initialize()
     {
@@ -225,3 +222,68 @@ struct DebugMemory
     		"resources/shaders/BasicText.glsl");
     }
 };
+
+void AddMemoryStatsText(GameMemory& memory, DebugMemory& debug, vec2f startPosition, float32 aspectRatio)
+{
+    MemoryBlockStats stats[MEMORY_BLOCK_COUNT];
+    uint32 count = memory.GatherStats(stats);
+
+    const float32 scale = 0.04f;
+    vec2f position = startPosition;
+    char* text = memory.scratch.Printf("Committed: %.2f MB of %.2f MB reserved",
+        memory.CommittedBytes()/(1024.0*1024.0), memory.totalAllocation/(1024.0*1024.0));
+    AddTextToQuadBuffer(text, position, scale, debug.FontAtlas, aspectRatio, &debug.TextBuffer);
+
+    for (uint32 i = 0; i < count; i++)
+    {
+        const MemoryBlockStats& block = stats[i];
+        position.y -= scale;
+        text = memory.scratch.Printf("%s: %u/%u peak %u (%.1f%%) requests %u failed %u",
+            block.name, block.used, block.capacity, block.peak,
+            block.capacity > 0 ? 100.0*block.peak/block.capacity : 0.0,
+            block.requestCount, block.failedRequestCount);
+        AddTextToQuadBuffer(text, position, scale, debug.FontAtlas, aspectRatio, &debug.TextBuffer);
+    }
+}
+
+bool WriteMemoryReport(GameMemory& memory, const char* filepath, const char* levelFilepath)
+{
+    MemoryBlockStats stats[MEMORY_BLOCK_COUNT];
+    uint32 count = memory.GatherStats(stats);
+
+    //written at exit too, so use the regular heap backed json rather than the loaders' arena one
+    nlohmann::json report;
+    report["level"] = levelFilepath;
+    report["reservedBytes"] = memory.totalAllocation;
+    report["committedBytes"] = memory.CommittedBytes();
+
+    nlohmann::json& blocks = report["blocks"];
+    for (uint32 i = 0; i < count; i++)
+    {
+        const MemoryBlockStats& block = stats[i];
+        nlohmann::json entry;
+        entry["name"] = block.name;
+        entry["itemSize"] = block.itemSize;
+        entry["capacity"] = block.capacity;
+        entry["used"] = block.used;
+        entry["peak"] = block.peak;
+        entry["peakBytes"] = (uint64)block.peak*block.itemSize;
+        entry["requests"] = block.requestCount;
+        entry["failedRequests"] = block.failedRequestCount;
+        entry["committedBytes"] = block.committedBytes;
+        blocks.push_back(entry);
+    }
+
+    std::string text = report.dump(4);
+    SDL_RWops* file = SDL_RWFromFile(filepath, "w");
+    if (file == NULL)
+    {
+        LOG_ERROR("Could not write memory report to %s: %s\n", filepath, SDL_GetError());
+        return false;
+    }
+
+    SDL_RWwrite(file, text.c_str(), 1, text.size());
+    SDL_RWclose(file);
+    LOG_INFO("Wrote memory report to %s\n", filepath);
+    return true;
+}
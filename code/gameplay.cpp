@@ -156,10 +156,9 @@ void UpdateGame(GameState& gameState, const GameInput& gameInput, GameMemory& me
 						 	}
 
 					 	}
-							 std::string text = hit.hit ? ("Intersection: " + std::to_string(hit.fraction)) : "none";
-							 std::string text2 = "Normal: " + std::to_string(hit.normal.x) +
-							  								"," + std::to_string(hit.normal.y) +
-															"," + std::to_string(hit.normal.z);
+							 const char* text = hit.hit ? memory.scratch.Printf("Intersection: %f", hit.fraction) : "none";
+							 const char* text2 = memory.scratch.Printf("Normal: %f,%f,%f",
+							  								hit.normal.x, hit.normal.y, hit.normal.z);
 					 		AddTextToQuadBuffer(text, vec2f(-.9f,.6f), 0.05f, Debug.FontAtlas,
 					                 gameState.application.aspectRatio, &Debug.TextBuffer);
 							 AddTextToQuadBuffer(text2, vec2f(-.9f,.55f), 0.05f, Debug.FontAtlas,
@@ -0,0 +1,294 @@
+#include "memory.h"
+#include "log.h"
+
+const uint32 MAX_WORKER_THREADS = 32;
+const uint32 WORKER_SCRATCH_ARENA_SIZE = 64u*1024u*1024u;
+const uint32 MAX_JOB_SLOTS = 16;
+
+//jobIndex runs from 0 to count-1, jobs of one ParallelFor can run in any order and on any thread
+typedef void (*JobFunction)(void* data, uint32 jobIndex);
+//same for staged jobs, slot is the staging slot the job builds its result into
+typedef void (*StagedJobFunction)(void* data, uint32 jobIndex, uint32 slot);
+
+struct JobBatch
+{
+    JobFunction function;
+    void* data;
+    uint32 count;
+    std::atomic<uint32> nextJob;
+};
+
+struct JobSystem;
+struct WorkerContext
+{
+    JobSystem* jobs;
+    uint32 workerIndex;
+};
+
+//Fixed pool of SDL worker threads that only ever work on one batch at a time. ParallelFor is called from the
+//main thread, which pitches in on the batch and returns once every job has finished. Each worker gets its own
+//scratch arena so loaders running on them don't trample the main thread's one.
+struct JobSystem
+{
+    SDL_Thread* threads[MAX_WORKER_THREADS];
+    WorkerContext contexts[MAX_WORKER_THREADS];
+    ScratchArena scratch[MAX_WORKER_THREADS];
+    uint32 workerCount;
+
+    SDL_sem* workAvailable;
+    SDL_sem* workerFinished;
+    SDL_sem* slotFree;  //staged jobs, counts the slots nobody is building into
+    SDL_sem* slotReady; //and the slots holding a finished job the main thread hasn't taken yet
+    JobBatch* batch;
+    std::atomic<bool> running;
+};
+
+//Jobs that each build into one of a few staging slots (ie a set of staging meshes) and hand it back to the main
+//thread through NextStagedJob. Workers keep building into whatever slots are free while the main thread works
+//through the finished ones, so the main thread's part (ie uploading) overlaps the building instead of waiting for
+//a whole round of jobs. Finished jobs come back in whatever order they finish in
+struct StagedJobBatch
+{
+    JobBatch batch;
+    JobSystem* jobs;
+    StagedJobFunction function;
+    void* data;
+    uint32 wakeCount;
+    uint32 handedBack;
+    uint32 currentSlot; //handed to the main thread, freed on the next NextStagedJob
+
+    SDL_SpinLock slotLock;
+    uint32 freeSlots[MAX_JOB_SLOTS];
+    uint32 freeCount;
+    uint32 readySlots[MAX_JOB_SLOTS];
+    uint32 readyJobs[MAX_JOB_SLOTS];
+    uint32 readyCount;
+};
+
+inline void RunJobs(JobBatch* batch)
+{
+    for (;;)
+    {
+        uint32 jobIndex = batch->nextJob.fetch_add(1);
+        if (jobIndex >= batch->count) break;
+        batch->function(batch->data, jobIndex);
+    }
+}
+
+int WorkerThreadProc(void* data)
+{
+    WorkerContext* context = (WorkerContext*)data;
+    JobSystem* jobs = context->jobs;
+    ThreadScratchArena = &jobs->scratch[context->workerIndex];
+
+    for (;;)
+    {
+        SDL_SemWait(jobs->workAvailable);
+        if (!jobs->running) break;
+
+        RunJobs(jobs->batch);
+        ThreadScratchArena->Reset();
+        SDL_SemPost(jobs->workerFinished);
+    }
+
+    return 0;
+}
+
+//workerCount of 0 uses one worker per core besides the main thread
+void StartJobSystem(JobSystem& jobs, uint32 workerCount = 0)
+{
+    if (workerCount == 0)
+        workerCount = (uint32)glm::max(SDL_GetCPUCount() - 1, 0);
+    workerCount = glm::min(workerCount, MAX_WORKER_THREADS);
+
+    jobs.workerCount = 0;
+    jobs.batch = NULL;
+    jobs.running = true;
+    jobs.workAvailable = SDL_CreateSemaphore(0);
+    jobs.workerFinished = SDL_CreateSemaphore(0);
+    jobs.slotFree = SDL_CreateSemaphore(0);
+    jobs.slotReady = SDL_CreateSemaphore(0);
+    if (jobs.workAvailable == NULL || jobs.workerFinished == NULL || jobs.slotFree == NULL || jobs.slotReady == NULL)
+    {
+        LOG_ERROR("Failed to create job semaphores: %s\n", SDL_GetError());
+        return;
+    }
+
+    for (uint32 i = 0; i < workerCount; i++)
+    {
+        jobs.scratch[i].memory.Reserve(WORKER_SCRATCH_ARENA_SIZE);
+        jobs.contexts[i].jobs = &jobs;
+        jobs.contexts[i].workerIndex = i;
+        jobs.threads[i] = SDL_CreateThread(WorkerThreadProc, "Worker", &jobs.contexts[i]);
+        if (jobs.threads[i] == NULL)
+        {
+            LOG_WARN("Failed to create worker thread %u: %s\n", i, SDL_GetError());
+            break;
+        }
+        jobs.workerCount++;
+    }
+
+    LOG_INFO("Job system started with %u worker threads\n", jobs.workerCount);
+}
+
+void StopJobSystem(JobSystem& jobs)
+{
+    jobs.running = false;
+    for (uint32 i = 0; i < jobs.workerCount; i++)
+        SDL_SemPost(jobs.workAvailable);
+    for (uint32 i = 0; i < jobs.workerCount; i++)
+        SDL_WaitThread(jobs.threads[i], NULL);
+
+    if (jobs.workAvailable) SDL_DestroySemaphore(jobs.workAvailable);
+    if (jobs.workerFinished) SDL_DestroySemaphore(jobs.workerFinished);
+    if (jobs.slotFree) SDL_DestroySemaphore(jobs.slotFree);
+    if (jobs.slotReady) SDL_DestroySemaphore(jobs.slotReady);
+    jobs.workerCount = 0;
+}
+
+void ParallelFor(JobSystem& jobs, uint32 count, JobFunction function, void* data)
+{
+    JobBatch batch;
+    batch.function = function;
+    batch.data = data;
+    batch.count = count;
+    batch.nextJob = 0;
+
+    //NOTE: not worth waking anyone for a single job
+    uint32 wakeCount = count > 1 ? glm::min(jobs.workerCount, count-1) : 0;
+    jobs.batch = &batch;
+    for (uint32 i = 0; i < wakeCount; i++)
+        SDL_SemPost(jobs.workAvailable);
+
+    RunJobs(&batch);
+
+    //the batch lives on this stack frame, so wait for every woken worker to let go of it
+    for (uint32 i = 0; i < wakeCount; i++)
+        SDL_SemWait(jobs.workerFinished);
+    jobs.batch = NULL;
+}
+
+//What the workers run for a staged batch, the main thread takes its jobs in NextStagedJob instead
+void RunStagedJob(void* data, uint32 jobIndex)
+{
+    StagedJobBatch* staged = (StagedJobBatch*)data;
+    JobSystem* jobs = staged->jobs;
+    SDL_SemWait(jobs->slotFree);
+    SDL_AtomicLock(&staged->slotLock);
+    uint32 slot = staged->freeSlots[--staged->freeCount];
+    SDL_AtomicUnlock(&staged->slotLock);
+
+    staged->function(staged->data, jobIndex, slot);
+
+    SDL_AtomicLock(&staged->slotLock);
+    staged->readySlots[staged->readyCount] = slot;
+    staged->readyJobs[staged->readyCount] = jobIndex;
+    staged->readyCount++;
+    SDL_AtomicUnlock(&staged->slotLock);
+    SDL_SemPost(jobs->slotReady);
+}
+
+//Starts count jobs on the workers with slotCount staging slots between them, then call NextStagedJob until it
+//returns false. staged has to stay put until then
+void BeginStagedJobs(JobSystem& jobs, StagedJobBatch& staged, uint32 count, uint32 slotCount,
+    StagedJobFunction function, void* data)
+{
+    ASSERT((slotCount > 0 && slotCount <= MAX_JOB_SLOTS), __FILE__, __LINE__);
+    staged.function = function;
+    staged.data = data;
+    staged.handedBack = 0;
+    staged.currentSlot = MAX_JOB_SLOTS;
+    staged.slotLock = 0;
+    staged.readyCount = 0;
+    staged.freeCount = 0;
+    for (uint32 s = 0; s < slotCount; s++)
+        staged.freeSlots[staged.freeCount++] = slotCount-1 - s;
+
+    staged.jobs = &jobs;
+    staged.batch.function = RunStagedJob;
+    staged.batch.data = &staged;
+    staged.batch.count = count;
+    staged.batch.nextJob = 0;
+
+    //slots only ever go round through the semaphores when there's a worker to share them with
+    staged.wakeCount = glm::min(jobs.workerCount, count);
+    if (staged.wakeCount == 0) return;
+
+    for (uint32 s = 0; s < slotCount; s++)
+        SDL_SemPost(jobs.slotFree);
+    jobs.batch = &staged.batch;
+    for (uint32 i = 0; i < staged.wakeCount; i++)
+        SDL_SemPost(jobs.workAvailable);
+}
+
+inline uint32 TakeReadySlot(StagedJobBatch& staged, uint32* jobIndex)
+{
+    SDL_AtomicLock(&staged.slotLock);
+    staged.readyCount--;
+    uint32 slot = staged.readySlots[staged.readyCount];
+    *jobIndex = staged.readyJobs[staged.readyCount];
+    SDL_AtomicUnlock(&staged.slotLock);
+    return slot;
+}
+
+//Hands back the next finished job and the slot holding it, the slot stays the main thread's until the next call.
+//While nothing is finished the main thread builds a job itself if there's a slot free. Returns false once every
+//job has been handed back, by then the workers are done with the batch
+bool NextStagedJob(JobSystem& jobs, StagedJobBatch& staged, uint32* jobIndex, uint32* slot)
+{
+    if (staged.wakeCount == 0)
+    {
+        //nobody to share with, so every job just goes through slot 0 here
+        *jobIndex = staged.batch.nextJob++;
+        *slot = 0;
+        if (*jobIndex >= staged.batch.count) return false;
+        staged.function(staged.data, *jobIndex, 0);
+        return true;
+    }
+
+    if (staged.currentSlot < MAX_JOB_SLOTS)
+    {
+        SDL_AtomicLock(&staged.slotLock);
+        staged.freeSlots[staged.freeCount++] = staged.currentSlot;
+        SDL_AtomicUnlock(&staged.slotLock);
+        SDL_SemPost(jobs.slotFree);
+        staged.currentSlot = MAX_JOB_SLOTS;
+    }
+
+    if (staged.handedBack == staged.batch.count)
+    {
+        //the batch lives on the caller's stack, so wait for every woken worker to let go of it
+        for (uint32 i = 0; i < staged.wakeCount; i++)
+            SDL_SemWait(jobs.workerFinished);
+        while (SDL_SemTryWait(jobs.slotFree) == 0) {}
+        jobs.batch = NULL;
+        return false;
+    }
+
+    staged.handedBack++;
+    if (SDL_SemTryWait(jobs.slotReady) != 0)
+    {
+        //nothing finished yet, rather than wait build one here if there's still a job and a slot for it
+        if (SDL_SemTryWait(jobs.slotFree) == 0)
+        {
+            uint32 job = staged.batch.nextJob.fetch_add(1);
+            if (job < staged.batch.count)
+            {
+                SDL_AtomicLock(&staged.slotLock);
+                staged.currentSlot = staged.freeSlots[--staged.freeCount];
+                SDL_AtomicUnlock(&staged.slotLock);
+                staged.function(staged.data, job, staged.currentSlot);
+                *jobIndex = job;
+                *slot = staged.currentSlot;
+                return true;
+            }
+            SDL_SemPost(jobs.slotFree);
+        }
+        SDL_SemWait(jobs.slotReady);
+    }
+
+    staged.currentSlot = TakeReadySlot(staged, jobIndex);
+    *slot = staged.currentSlot;
+    return true;
+}
+
@@ -1,15 +1,13 @@
 #include "resources.h"
 #include "log.h"
 #include "glm/glm.hpp"
+#include "math.h"
+#include <emmintrin.h>
+#include <cstring>
 
 
 #include "level.h"
 
-inline uint32 LinearIndex(uint32 x, uint32 y, uint32 z, uint32 width)
-{
-	return (x*width) + (y*width*width) + z;
-}
-
 inline int32 LevelCellIndexFromThreeDIndex(vec3i threeD, uint32 levelWidth, uint32 levelHeight)
 {
 	int32 index = -1;
@@ -40,213 +38,437 @@ inline int32 LevelCellIndexFromPosition(vec3f worldPosition, uint32 levelWidth,
 	return LevelCellIndexFromThreeDIndex(worldPosition,levelWidth, levelHeight);
 }
 
-Level GenerateLevelCells(const LevelData& levelData, GameMemory& memory)
+inline constexpr uint32 PackShapes(byte s0, byte s1, byte s2, byte s3)
+{
+    return (uint32)s0 | ((uint32)s1 << 8) | ((uint32)s2 << 16) | ((uint32)s3 << 24);
+}
+
+//Br, Cr, and Dr represent relative difference between the A node (back left corner of quadrant)
+//So 0 is the same as A, 1 is the first unique type from A, 2 the second unique, and 3 the third unique.
+//Br is packed into bits 0-1, Cr into bits 2-3, and Dr into bits 4-5, the 15 ways four corners can
+//match up are the only keys that come out of that, everything else stays 0
+//Shape Key:  0 = Nothing, 1 = Full, 2 = Side, 3 = Inner, 4 = Outer, 5 = Corner
+inline constexpr uint32 ShapesForKey(uint32 key)
+{
+    switch (key)
+    {
+        case 0:  return PackShapes(1, 0, 0, 0); //0000
+        case 1:  return PackShapes(0, 4, 0, 3); //0100
+        case 4:  return PackShapes(3, 0, 4, 0); //0010
+        case 16: return PackShapes(0, 3, 0, 4); //0001
+        case 5:  return PackShapes(0, 2, 0, 2); //0110
+        case 20: return PackShapes(2, 0, 2, 0); //0011
+        case 9:  return PackShapes(0, 5, 5, 2); //0120
+        case 36: return PackShapes(2, 0, 5, 5); //0012
+        case 37: return PackShapes(5, 2, 0, 5); //0112
+        case 41: return PackShapes(5, 5, 2, 0); //0122
+        case 21: return PackShapes(4, 0, 3, 0); //0111
+        case 25: return PackShapes(5, 5, 5, 5); //0121
+        case 17: return PackShapes(5, 5, 5, 5); //0101
+        case 33: return PackShapes(5, 5, 5, 5); //0102
+        case 57: return PackShapes(5, 5, 5, 5); //0123
+    }
+    return 0;
+}
+
+//All four shape bytes for a cell in one word, shapes[0] in the low byte
+struct CellShapeTable
+{
+    uint32 entries[64];
+
+    constexpr CellShapeTable() : entries()
+    {
+        for (uint32 key = 0; key < 64; key++)
+            entries[key] = ShapesForKey(key);
+    }
+};
+
+constexpr CellShapeTable CELL_SHAPE_TABLE;
+
+inline uint32 CellShapeKey(byte A, byte B, byte C, byte D)
+{
+    uint32 Br = B != A;
+    uint32 Cr = C == A ? 0 : C == B ? Br : Br+1;
+    uint32 Dr = D == A ? 0 : D == B ? Br : D == C ? Cr : Cr+1;
+    return Br | (Cr << 2) | (Dr << 4);
+}
+
+//Slopes get the top bits of each quadrant byte, anything past CELL_SLOPE_MAX is clamped
+inline uint32 PackCellSlopes(byte SA, byte SB, byte SC, byte SD)
+{
+    return PackShapes(glm::min(SA, CELL_SLOPE_MAX) << CELL_SLOPE_SHIFT, glm::min(SB, CELL_SLOPE_MAX) << CELL_SLOPE_SHIFT,
+        glm::min(SC, CELL_SLOPE_MAX) << CELL_SLOPE_SHIFT, glm::min(SD, CELL_SLOPE_MAX) << CELL_SLOPE_SHIFT);
+}
+
+//Pass 1: works out the types/slopes of the four nodes around the cell and the shape each quadrant takes
+inline void ClassifyLevelCell(NodeCell* cell, const LevelData& levelData, uint32 x, uint32 y, uint32 z,
+	uint32 levelCellWidth, int* typeCount)
 {
     uint32 levelWidth = levelData.width;
-	uint32 levelCellWidth = levelWidth+1;
-	uint32 levelCellHeight = levelData.height;
-    uint32 cellCount = levelCellWidth*levelCellWidth*levelCellHeight;
+    byte  A, B, C, D, SA, SB, SC, SD;
+    uint32 index = LinearIndex(x-1, y, z-1, levelWidth);
+    bool xZero = x == 0;
+    bool zZero = z == 0;
+    bool xEdge = x == levelCellWidth-1;
+    bool zEdge = z == levelCellWidth-1;
+    A = (xZero||zZero) ? 0 : levelData.nodes[index].type;
+    B = (xZero||zEdge) ? 0 : levelData.nodes[index+1].type;
+    C = (zEdge||xEdge) ? 0 : levelData.nodes[index+levelWidth+1].type;
+    D = (xEdge||zZero) ? 0 : levelData.nodes[index+levelWidth].type;
+	SA = (xZero||zZero) ? 0 : levelData.nodes[index].slope;
+    SB = (xZero||zEdge) ? 0 : levelData.nodes[index+1].slope;
+    SC = (zEdge||xEdge) ? 0 : levelData.nodes[index+levelWidth+1].slope;
+    SD = (xEdge||zZero) ? 0 : levelData.nodes[index+levelWidth].slope;
 
-    int typeCount[MAX_NODE_TYPES];
-    for (int i = 0; i < MAX_NODE_TYPES; i++)
-        typeCount[i] = 0;
+    if (A>0) typeCount[A-1]++;
 
-	Level level;
-	ASSERT((memory.levelCellBlock.CanFit(cellCount)), __FILE__, __LINE__);
-	NodeCell* cells = memory.levelCellBlock.block;
-	level.cells = cells;
-    level.width = levelCellWidth;
-    level.height = levelCellHeight;
+    cell->types[0] = A;
+    cell->types[1] = B;
+    cell->types[2] = C;
+    cell->types[3] = D;
 
-	GeometryNode* node = &levelData.nodes[0];
-    byte  A, B, C, D, Br, Cr, Dr, SA, SB, SC, SD;
-    uint32 index;
-	for (uint32 y = 0; y < levelCellHeight; y++)
-	for (uint32 x = 0; x < levelCellWidth; x++)
-	for (uint32 z = 0; z < levelCellWidth; z++)
-	{
-        index = LinearIndex(x-1, y, z-1, levelWidth);
-        bool xZero = x == 0;
-        bool zZero = z == 0;
-        bool xEdge = x == levelCellWidth-1;
-        bool zEdge = z == levelCellWidth-1;
-        A = (xZero||zZero) ? 0 : levelData.nodes[index].type;
-        B = (xZero||zEdge) ? 0 : levelData.nodes[index+1].type;
-        C = (zEdge||xEdge) ? 0 : levelData.nodes[index+levelWidth+1].type;
-        D = (xEdge||zZero) ? 0 : levelData.nodes[index+levelWidth].type;
-		SA = (xZero||zZero) ? 0 : levelData.nodes[index].slope;
-        SB = (xZero||zEdge) ? 0 : levelData.nodes[index+1].slope;
-        SC = (zEdge||xEdge) ? 0 : levelData.nodes[index+levelWidth+1].slope;
-        SD = (xEdge||zZero) ? 0 : levelData.nodes[index+levelWidth].slope;
-
-        if (A>0) typeCount[A-1]++;
-
-        cells->types[0] = A;
-        cells->types[1] = B;
-        cells->types[2] = C;
-        cells->types[3] = D;
-		cells->slopes[0] = SA;
-        cells->slopes[1] = SB;
-        cells->slopes[2] = SC;
-        cells->slopes[3] = SD;
-
-        //Br, Cr, and Dr represent relative difference between the A node (back left corner of quadrant)
-        //So 0 is the same as A, 1 is the first unique type from A, 2 the second unique, and 3 the third unique
-        if (B == A)
-            Br = 0;
-        else Br = 1;
-        if (C == A)
-            Cr = 0;
-        else Cr = C == B ? Br : Br+1;
-        if (D == A)
-            Dr = 0;
-        else Dr = D == B ? Br : D == C ? Cr : Cr+1;
-
-
-        //Br is packed into bytes 1-2, Cr into bytes 3-4, and Dr into bytes 5-6 for all unique numbers
-        //This is an extremely wierd way of doing it but is waaaaaaay faster than ridiculous branching alternative
-        byte value = 0;
-        value |= Br << 0;
-        value |= Cr << 2;
-        value |= Dr << 4;
-
-        //Shape Key:  0 = Nothing, 1 = Full, 2 = Side, 3 = Inner, 4 = Outer, 5 = Corner
-        switch (value)
-        {
-            case 0: //0000
-                cells->shapes[0] = 1;
-                cells->shapes[1] = 0;
-                cells->shapes[2] = 0;
-                cells->shapes[3] = 0;
-                break;
-            case 1: //0100
-                cells->shapes[0] = 0;
-                cells->shapes[1] = 4;
-                cells->shapes[2] = 0;
-                cells->shapes[3] = 3;
-                break;
-            case 4: //0010
-                cells->shapes[0] = 3;
-                cells->shapes[1] = 0;
-                cells->shapes[2] = 4;
-                cells->shapes[3] = 0;
-                break;
-            case 16://0001
-                cells->shapes[0] = 0;
-                cells->shapes[1] = 3;
-                cells->shapes[2] = 0;
-                cells->shapes[3] = 4;
-                break;
-            case 5://0110
-                cells->shapes[0] = 0;
-                cells->shapes[1] = 2;
-                cells->shapes[2] = 0;
-                cells->shapes[3] = 2;
-                break;
-            case 20://0011
-                cells->shapes[0] = 2;
-                cells->shapes[1] = 0;
-                cells->shapes[2] = 2;
-                cells->shapes[3] = 0;
-                break;
-            case 9://0120
-                cells->shapes[0] = 0;
-                cells->shapes[1] = 5;
-                cells->shapes[2] = 5;
-                cells->shapes[3] = 2;
-                break;
-            case 36://0012
-                cells->shapes[0] = 2;
-                cells->shapes[1] = 0;
-                cells->shapes[2] = 5;
-                cells->shapes[3] = 5;
-                break;
-            case 37://0112
-                cells->shapes[0] = 5;
-                cells->shapes[1] = 2;
-                cells->shapes[2] = 0;
-                cells->shapes[3] = 5;
-                break;
-            case 41://0122
-                cells->shapes[0] = 5;
-                cells->shapes[1] = 5;
-                cells->shapes[2] = 2;
-                cells->shapes[3] = 0;
-                break;
-            case 21://0111
-                cells->shapes[0] = 4;
-                cells->shapes[1] = 0;
-                cells->shapes[2] = 3;
-                cells->shapes[3] = 0;
-                break;
-            case 25://0121
-                cells->shapes[0] = 5;
-                cells->shapes[1] = 5;
-                cells->shapes[2] = 5;
-                cells->shapes[3] = 5;
-                break;
-            case 17://0101
-                cells->shapes[0] = 5;
-                cells->shapes[1] = 5;
-                cells->shapes[2] = 5;
-                cells->shapes[3] = 5;
-                break;
-            case 33://0102
-                cells->shapes[0] = 5;
-                cells->shapes[1] = 5;
-                cells->shapes[2] = 5;
-                cells->shapes[3] = 5;
-                break;
-            case 57://0123
-                cells->shapes[0] = 5;
-                cells->shapes[1] = 5;
-                cells->shapes[2] = 5;
-                cells->shapes[3] = 5;
-                break;
-        }
+    //layers are left at 0 for pass 2
+    uint32 quadrants = CELL_SHAPE_TABLE.entries[CellShapeKey(A, B, C, D)] | PackCellSlopes(SA, SB, SC, SD);
+    memcpy(cell->quadrants, &quadrants, sizeof(uint32));
+}
 
-		cells->position = vec3f(CELL_SIZE*x,CELL_SIZE*y,CELL_SIZE*z);
-		cells++;
-	}
+const uint32 LEVEL_CELLS_PER_SIMD_ROW = 16;
 
-    uint32 uniqueCount = 0;
-    for (int i = 0; i < MAX_NODE_TYPES; i++)
+inline __m128i SelectBytes(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+//Same as ClassifyLevelCell for 16 cells in a row along z. Only for cells away from the level edges,
+//so every neighbour node exists: 1 <= x < levelCellWidth-1 and 1 <= z, z+15 < levelCellWidth-1
+inline void ClassifyLevelCellRow(NodeCell* cell, const LevelData& levelData, uint32 x, uint32 y, uint32 z,
+	uint32 levelCellWidth, int* typeCount)
+{
+    ASSERT((x >= 1 && x+1 < levelCellWidth && z >= 1 && z + LEVEL_CELLS_PER_SIMD_ROW < levelCellWidth), __FILE__, __LINE__);
+    uint32 levelWidth = levelData.width;
+    const byte* row0 = (const byte*)(levelData.nodes + LinearIndex(x-1, y, z-1, levelWidth));
+    const byte* row1 = row0 + levelWidth*sizeof(GeometryNode);
+
+    //nodes are type/slope pairs, so 16 of them are two loads which get split into a types and a slopes vector
+    const __m128i lowBytes = _mm_set1_epi16(0x00FF);
+    const __m128i slopeMax = _mm_set1_epi8(CELL_SLOPE_MAX);
+    const __m128i slopeBits = _mm_set1_epi8((char)(CELL_SLOPE_MAX << CELL_SLOPE_SHIFT));
+    __m128i types[4], slopes[4];
+    const byte* starts[4] = { row0, row0 + sizeof(GeometryNode), row1 + sizeof(GeometryNode), row1 };
+    for (uint32 i = 0; i < 4; i++)
     {
-        level.nodeTypeGeometyBufferMap[i] = typeCount[i] > 0 ? uniqueCount : -1;
-        uniqueCount += typeCount[i] > 0;
+        __m128i lo = _mm_loadu_si128((const __m128i*)starts[i]);
+        __m128i hi = _mm_loadu_si128((const __m128i*)(starts[i] + 16));
+        types[i]  = _mm_packus_epi16(_mm_and_si128(lo, lowBytes), _mm_and_si128(hi, lowBytes));
+        slopes[i] = _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+        //same as PackCellSlopes, the mask drops whatever the 16 bit shift carried in from the byte below
+        slopes[i] = _mm_and_si128(_mm_slli_epi16(_mm_min_epu8(slopes[i], slopeMax), CELL_SLOPE_SHIFT), slopeBits);
     }
+    __m128i A = types[0], B = types[1], C = types[2], D = types[3];
+
+    //branch free version of CellShapeKey
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i Br = _mm_andnot_si128(_mm_cmpeq_epi8(B, A), one);
+    __m128i BrNext = _mm_add_epi8(Br, one);
+    __m128i Cr = _mm_andnot_si128(_mm_cmpeq_epi8(C, A), SelectBytes(_mm_cmpeq_epi8(C, B), Br, BrNext));
+    __m128i Dr = SelectBytes(_mm_cmpeq_epi8(D, C), Cr, _mm_add_epi8(Cr, one));
+    Dr = _mm_andnot_si128(_mm_cmpeq_epi8(D, A), SelectBytes(_mm_cmpeq_epi8(D, B), Br, Dr));
+    //the relative values are at most 3, so shifting 16 bit lanes can't spill into the next byte
+    __m128i key = _mm_or_si128(Br, _mm_or_si128(_mm_slli_epi16(Cr, 2), _mm_slli_epi16(Dr, 4)));
+
+    byte keys[LEVEL_CELLS_PER_SIMD_ROW];
+    _mm_storeu_si128((__m128i*)keys, key);
 
-    level.numUniqueNodeTypes = uniqueCount;
+    for (uint32 t = 0; t < MAX_NODE_TYPES; t++)
+        typeCount[t] += CountBits(_mm_movemask_epi8(_mm_cmpeq_epi8(A, _mm_set1_epi8((char)(t+1)))));
 
-    cells = level.cells;
+    //interleave to A,B,C,D per cell so each cell's types and quadrants are a word each, then pair those words up
+    //so the cells go out as whole vectors
+    const uint32* shapes = CELL_SHAPE_TABLE.entries;
+    for (uint32 half = 0; half < 2; half++)
+    {
+        __m128i ab = half ? _mm_unpackhi_epi8(A, B) : _mm_unpacklo_epi8(A, B);
+        __m128i cd = half ? _mm_unpackhi_epi8(C, D) : _mm_unpacklo_epi8(C, D);
+        __m128i slopeAB = half ? _mm_unpackhi_epi8(slopes[0], slopes[1]) : _mm_unpacklo_epi8(slopes[0], slopes[1]);
+        __m128i slopeCD = half ? _mm_unpackhi_epi8(slopes[2], slopes[3]) : _mm_unpacklo_epi8(slopes[2], slopes[3]);
+        for (uint32 quarter = 0; quarter < 2; quarter++, cell += 4)
+        {
+            const byte* k = keys + half*8 + quarter*4;
+            __m128i typeWords = quarter ? _mm_unpackhi_epi16(ab, cd) : _mm_unpacklo_epi16(ab, cd);
+            __m128i slopeWords = quarter ? _mm_unpackhi_epi16(slopeAB, slopeCD) : _mm_unpacklo_epi16(slopeAB, slopeCD);
+            __m128i quadrants = _mm_or_si128(slopeWords,
+                _mm_set_epi32(shapes[k[3]], shapes[k[2]], shapes[k[1]], shapes[k[0]]));
+            _mm_storeu_si128((__m128i*)cell, _mm_unpacklo_epi32(typeWords, quadrants));
+            _mm_storeu_si128((__m128i*)(cell + 2), _mm_unpackhi_epi32(typeWords, quadrants));
+        }
+    }
+}
+
+//Pass 2: layers only look at the cells directly above and below, below/above are NULL at the bottom/top
+//of the level
+inline void AssignLevelCellLayers(NodeCell* cell, const NodeCell* below, const NodeCell* above)
+{
     byte otherShape, otherType;
-    uint32  layerSize = levelCellWidth*levelCellWidth;
     byte layer;
 
-    for (uint32 y = 0; y < levelCellHeight; y++)
-	for (uint32 x = 0; x < levelCellWidth;  x++)
-	for (uint32 z = 0; z < levelCellWidth;  z++)
-	{
-        for (uint32 i = 0; i < 4; i++)
-        {
-            layer = 0;
+    for (uint32 i = 0; i < 4; i++)
+    {
+        layer = 0;
+        byte shape = CellShape(*cell, i);
+        byte type  = CellType(*cell, i);
+
+        otherShape = below == NULL ? 0 : CellShape(*below, i);
+        otherType  = below == NULL ? 0 : CellType (*below, i);
+        layer = (shape == otherShape && type == otherType);
+
+        otherShape = above == NULL ? 0 : CellShape(*above, i);
+        otherType  = above == NULL ? 0 : CellType (*above, i);
+        layer = (shape == otherShape && type == otherType) ? layer : 2;
+
+		if (layer != 1 && shape > 1 && CellSlope(*cell, i))
+			layer = 3;
+
+        SetCellLayer(*cell, i, layer);
+    }
+}
+
+//Chunks on the far edges of the level hang over it, only the first xCount x zCount cells are real. Cell 0,0 is
+//the first cell in every order
+template<typename CellOrder>
+inline bool LevelChunkCellsAreUniform(const NodeCell* cells, uint32 xCount, uint32 zCount)
+{
+    for (uint32 x = 0; x < xCount; x++)
+    for (uint32 z = 0; z < zCount; z++)
+    {
+        if (memcmp(&cells[LevelChunkLocalIndex<CellOrder>(x, z)], cells, sizeof(NodeCell)) != 0)
+            return false;
+    }
+    return true;
+}
+
+inline void LevelChunkCellCounts(const Level& level, uint32 chunkX, uint32 chunkZ, uint32* xCount, uint32* zCount)
+{
+    *xCount = glm::min(LEVEL_CHUNK_WIDTH, level.width - chunkX*LEVEL_CHUNK_WIDTH);
+    *zCount = glm::min(LEVEL_CHUNK_WIDTH, level.width - chunkZ*LEVEL_CHUNK_WIDTH);
+}
+
+//Only the first xCount x zCount cells get bits, the rest hang over the edge of the level. cells are in linear order
+inline void LevelChunkOccupancy(LevelChunk& chunk, const NodeCell* cells, uint32 xCount, uint32 zCount)
+{
+    for (uint32 x = 0; x < LEVEL_CHUNK_WIDTH; x++)
+    {
+        uint32 row = 0;
+        for (uint32 z = 0; x < xCount && z < zCount; z++)
+            row |= (uint32)!LevelCellIsEmpty(cells[LevelChunkLocalIndex<LinearCellOrder>(x, z)]) << z;
+        chunk.occupied[x] = (uint16)row;
+    }
+}
+
+//Keeps just the one cell if they are all the same, otherwise the chunk gets a copy of them from the pool. cells
+//come in linear order and get put in LevelCellOrder on the way
+void StoreLevelChunk(LevelChunk& chunk, const NodeCell* cells, uint32 xCount, uint32 zCount, GameMemory& memory)
+{
+    chunk.cells = NULL;
+    chunk.cellSlot = 0;
+    chunk.uniformCell = cells[0];
+    LevelChunkOccupancy(chunk, cells, xCount, zCount);
+    if (LevelChunkCellsAreUniform<LinearCellOrder>(cells, xCount, zCount)) return;
+
+    auto request = memory.levelChunkCellPool.RequestFromBlock(1);
+    ASSERT(request.valid, __FILE__, __LINE__);
+    if (!request.valid) return;
 
-            otherShape = y == 0 ? 0 : (cells-layerSize)->shapes[i];
-            otherType  = y == 0 ? 0 : (cells-layerSize)->types [i];
-            layer = (cells->shapes[i] == otherShape && cells->types[i] == otherType);
+    for (uint32 x = 0; x < LEVEL_CHUNK_WIDTH; x++)
+    for (uint32 z = 0; z < LEVEL_CHUNK_WIDTH; z++)
+        request.memory->cells[LevelChunkLocalIndex(x, z)] = cells[LevelChunkLocalIndex<LinearCellOrder>(x, z)];
+    chunk.cells = request.memory->cells;
+    chunk.cellSlot = request.index;
+}
 
-            otherShape = y == levelCellHeight-1 ? 0 : (cells+layerSize)->shapes[i];
-            otherType  = y == levelCellHeight-1 ? 0 : (cells+layerSize)->types [i];
-            layer = (cells->shapes[i] == otherShape && cells->types[i] == otherType) ? layer : 2;
+//Generates one column of chunks through every layer. Layers need the cells above and below, so the whole column
+//is classified on the stack first, in linear order so whole rows can go through ClassifyLevelCellRow. Then each
+//layer is stored as a chunk, layer y going to column[y*columnStride]. Only ever reads the level data and writes
+//its own chunks, so columns don't depend on each other at all
+void GenerateLevelChunkColumn(const LevelData& levelData, GameMemory& memory, uint32 chunkX, uint32 chunkZ,
+    LevelChunk* column, uint32 columnStride, int* typeCount)
+{
+    uint32 width = levelData.width+1;
+    uint32 height = levelData.height;
+    uint32 xStart = chunkX * LEVEL_CHUNK_WIDTH;
+    uint32 zStart = chunkZ * LEVEL_CHUNK_WIDTH;
+    uint32 xCount = glm::min(LEVEL_CHUNK_WIDTH, width - xStart);
+    uint32 zCount = glm::min(LEVEL_CHUNK_WIDTH, width - zStart);
 
-			if (layer != 1 && cells->shapes[i] > 1 && cells->slopes[i])
-				layer = 3;
+    NodeCell cells[MAX_LEVEL_HEIGHT][LEVEL_CHUNK_CELLS];
+    SDL_memset(cells, 0, sizeof(cells));
 
-            cells->layers[i] = layer;
+    //cells on the level edges are missing neighbours so they go through the scalar path
+    bool simdRows = zStart > 0 && zStart + LEVEL_CHUNK_WIDTH <= width-1;
+    for (uint32 y = 0; y < height; y++)
+    for (uint32 lx = 0; lx < xCount; lx++)
+    {
+        uint32 x = xStart + lx;
+        NodeCell* row = cells[y] + LevelChunkLocalIndex<LinearCellOrder>(lx, 0);
+        if (simdRows && x > 0 && x < width-1)
+        {
+            ClassifyLevelCellRow(row, levelData, x, y, zStart, width, typeCount);
+            continue;
         }
+        for (uint32 lz = 0; lz < zCount; lz++)
+            ClassifyLevelCell(row + lz, levelData, x, y, zStart + lz, width, typeCount);
+    }
 
-        cells++;
+    for (uint32 y = 0; y < height; y++)
+    for (uint32 lx = 0; lx < xCount; lx++)
+    for (uint32 lz = 0; lz < zCount; lz++)
+    {
+        uint32 local = LevelChunkLocalIndex<LinearCellOrder>(lx, lz);
+        AssignLevelCellLayers(&cells[y][local], y > 0 ? &cells[y-1][local] : NULL,
+            y < height-1 ? &cells[y+1][local] : NULL);
     }
 
+    for (uint32 y = 0; y < height; y++)
+        StoreLevelChunk(column[y*columnStride], cells[y], xCount, zCount, memory);
+}
+
+//Sets up the chunk directory with every chunk empty and every node type mapped, cells get filled in later a column
+//at a time, see LoadLevelColumn
+Level CreateLevel(const LevelData& levelData, GameMemory& memory)
+{
+	uint32 levelCellWidth = levelData.width+1;
+	uint32 levelCellHeight = levelData.height;
+    uint32 chunksPerRow = (levelCellWidth + LEVEL_CHUNK_WIDTH-1) / LEVEL_CHUNK_WIDTH;
+    uint32 chunkCount = chunksPerRow*chunksPerRow*levelCellHeight;
+
+	Level level = {};
+	ASSERT((levelCellHeight <= MAX_LEVEL_HEIGHT), __FILE__, __LINE__);
+	ASSERT((memory.levelChunkBlock.CanFit(chunkCount)), __FILE__, __LINE__);
+	auto chunkRequest = memory.levelChunkBlock.RequestFromBlock(chunkCount);
+	level.chunks = chunkRequest.memory;
+	SDL_memset(level.chunks, 0, chunkCount*sizeof(LevelChunk));
+	level.chunksPerRow = chunksPerRow;
+    level.width = levelCellWidth;
+    level.height = levelCellHeight;
+
+    for (uint32 i = 0; i < MAX_NODE_TYPES; i++)
+        level.nodeTypeGeometyBufferMap[i] = i;
+    level.numUniqueNodeTypes = MAX_NODE_TYPES;
+
 	return level;
 }
+
+//Hands back the pooled cells of a whole column and leaves every layer of it empty
+void ReleaseLevelChunkColumn(Level& level, GameMemory& memory, uint32 chunkX, uint32 chunkZ)
+{
+	for (uint32 y = 0; y < level.height; y++)
+	{
+		LevelChunk& chunk = level.chunks[LevelChunkIndex(chunkX, y, chunkZ, level.chunksPerRow)];
+		if (chunk.cells != NULL)
+			memory.levelChunkCellPool.Release(memory.levelChunkCellPool.HandleAt(chunk.cellSlot));
+		chunk = {};
+		UpdateLevelChunkSummary(level, chunkX, y, chunkZ);
+	}
+}
+
+//Writes a single cell, a uniform chunk only gets its cells out of the pool if the value is actually different
+void SetLevelCell(Level& level, GameMemory& memory, uint32 x, uint32 y, uint32 z, const NodeCell& value)
+{
+	LevelChunk& chunk = level.chunks[LevelChunkIndex(x / LEVEL_CHUNK_WIDTH, y, z / LEVEL_CHUNK_WIDTH, level.chunksPerRow)];
+	if (chunk.cells == NULL)
+	{
+		if (memcmp(&chunk.uniformCell, &value, sizeof(NodeCell)) == 0) return;
+
+		auto request = memory.levelChunkCellPool.RequestFromBlock(1);
+		ASSERT(request.valid, __FILE__, __LINE__);
+		if (!request.valid) return;
+
+		for (uint32 i = 0; i < LEVEL_CHUNK_CELLS; i++)
+			request.memory->cells[i] = chunk.uniformCell;
+		chunk.cells = request.memory->cells;
+		chunk.cellSlot = request.index;
+	}
+
+	chunk.cells[LevelChunkLocalIndex(x, z)] = value;
+
+	uint16 bit = (uint16)(1u << (z % LEVEL_CHUNK_WIDTH));
+	uint16& row = chunk.occupied[x % LEVEL_CHUNK_WIDTH];
+	bool wasEmpty = LevelChunkIsEmpty(chunk);
+	row = LevelCellIsEmpty(value) ? row & ~bit : row | bit;
+	if (wasEmpty != LevelChunkIsEmpty(chunk))
+		UpdateLevelChunkSummary(level, x / LEVEL_CHUNK_WIDTH, y, z / LEVEL_CHUNK_WIDTH);
+}
+
+//Hands a chunk's cells back to the pool if an edit left them all the same again
+void CollapseLevelChunk(Level& level, GameMemory& memory, uint32 chunkX, uint32 y, uint32 chunkZ)
+{
+	LevelChunk& chunk = level.chunks[LevelChunkIndex(chunkX, y, chunkZ, level.chunksPerRow)];
+	if (chunk.cells == NULL) return;
+
+	uint32 xCount, zCount;
+	LevelChunkCellCounts(level, chunkX, chunkZ, &xCount, &zCount);
+	if (!LevelChunkCellsAreUniform<LevelCellOrder>(chunk.cells, xCount, zCount)) return;
+
+	chunk.uniformCell = chunk.cells[0];
+	memory.levelChunkCellPool.Release(memory.levelChunkCellPool.HandleAt(chunk.cellSlot));
+	chunk.cells = NULL;
+	chunk.cellSlot = 0;
+}
+
+//Changes a single node and patches up only what depends on it: the 2x2 cells that have the node as a corner
+//get reclassified, then their layers and the layers of the cells above and below them get redone. The chunks
+//those cells sit in are marked dirty so UpdateDirtyGeometryChunks only re-meshes those.
+bool SetLevelNode(Level& level, LevelData& levelData, GameMemory& memory, uint32 x, uint32 y, uint32 z,
+	GeometryNode value, GeometryBuffer& geometryBuffer)
+{
+	ASSERT((x < levelData.width && z < levelData.width && y < levelData.height), __FILE__, __LINE__);
+	if (x >= levelData.width || z >= levelData.width || y >= levelData.height) return false;
+
+	levelData.nodes[LinearIndex(x, y, z, levelData.width)] = value;
+
+	if (value.type > 0 && value.type <= MAX_NODE_TYPES && level.nodeTypeGeometyBufferMap[value.type-1] < 0)
+		level.nodeTypeGeometyBufferMap[value.type-1] = level.numUniqueNodeTypes++;
+
+	//node x,z is corner C of cell x,z, D of x,z+1, B of x+1,z and A of x+1,z+1
+	int typeCount[MAX_NODE_TYPES] = {};
+	for (uint32 cx = x; cx <= x+1; cx++)
+	for (uint32 cz = z; cz <= z+1; cz++)
+	{
+		NodeCell cell = GetLevelCell(level, cx, y, cz);
+		ClassifyLevelCell(&cell, levelData, cx, y, cz, level.width, typeCount);
+		SetLevelCell(level, memory, cx, y, cz, cell);
+		MarkGeometryDirty(geometryBuffer, cx, cz);
+	}
+
+	uint32 yStart = y > 0 ? y-1 : 0;
+	uint32 yEnd = glm::min(y+1, level.height-1);
+	for (uint32 cy = yStart; cy <= yEnd; cy++)
+	for (uint32 cx = x; cx <= x+1; cx++)
+	for (uint32 cz = z; cz <= z+1; cz++)
+	{
+		NodeCell cell = GetLevelCell(level, cx, cy, cz);
+		AssignLevelCellLayers(&cell, cy > 0 ? &GetLevelCell(level, cx, cy-1, cz) : NULL,
+			cy < level.height-1 ? &GetLevelCell(level, cx, cy+1, cz) : NULL);
+		SetLevelCell(level, memory, cx, cy, cz, cell);
+	}
+
+	for (uint32 cy = yStart; cy <= yEnd; cy++)
+	for (uint32 chunkX = x / LEVEL_CHUNK_WIDTH; chunkX <= (x+1) / LEVEL_CHUNK_WIDTH; chunkX++)
+	for (uint32 chunkZ = z / LEVEL_CHUNK_WIDTH; chunkZ <= (z+1) / LEVEL_CHUNK_WIDTH; chunkZ++)
+		CollapseLevelChunk(level, memory, chunkX, cy, chunkZ);
+
+	return true;
+}
+
+//Levels own the level node and cell blocks and the mapped level file outright, so unloading just hands all of it back
+void UnloadLevel(Level& level, GameMemory& memory)
+{
+	memory.levelNodeBlock.Reset();
+	PlatformUnmapFile(memory.levelFile);
+	memory.levelChunkBlock.Reset();
+	memory.levelChunkCellPool.Reset();
+
+	level.chunks = NULL;
+	level.chunksPerRow = 0;
+	level.width = 0;
+	level.height = 0;
+}
@@ -1,6 +1,9 @@
 #pragma once
 
 #include "glm/glm.hpp"
+#ifdef WINDOWS
+#include <intrin.h>
+#endif
 
 
 /*
@@ -14,7 +17,8 @@
 struct Level
 {
 	//glm::vec3 origin;
-	NodeCell* cells;
+	LevelChunk* chunks; //chunksPerRow*chunksPerRow per layer, see LevelChunkIndex
+	uint32 chunksPerRow;
 	uint32 width;
 	uint32 height;
 	uint32 numUniqueNodeTypes;
@@ -22,4 +26,154 @@ struct Level
 
 	TransformHierarchy* objects;
 	uint32 objectCount;
+
+	//Coarse levels over LevelChunk::occupied so scans can jump straight to the chunks that have something in them.
+	//Bit chunkZ of occupiedChunks[y][chunkX] is set if that chunk has any occupied cell, occupiedColumns is the
+	//same through every layer. Kept up to date by everything that writes chunks, see UpdateLevelChunkSummary
+	uint64 occupiedChunks[MAX_LEVEL_HEIGHT][MAX_LEVEL_CHUNKS_PER_ROW];
+	uint64 occupiedColumns[MAX_LEVEL_CHUNKS_PER_ROW];
 };
+
+static_assert(MAX_LEVEL_CHUNKS_PER_ROW <= 64, "a row of chunks has to fit in the occupancy summary bits");
+
+//bits != 0. Ends up as bsf, or tzcnt where the target has BMI1
+inline uint32 CountTrailingZeros(uint64 bits)
+{
+#ifdef WINDOWS
+	unsigned long index;
+	_BitScanForward64(&index, bits);
+	return (uint32)index;
+#else
+	return (uint32)__builtin_ctzll(bits);
+#endif
+}
+
+//Bits start through end, end < 64
+inline uint64 BitRange(uint32 start, uint32 end)
+{
+	return (~0ull >> (63 - end)) & (~0ull << start);
+}
+
+inline uint32 LinearIndex(uint32 x, uint32 y, uint32 z, uint32 width)
+{
+	return (x*width) + (y*width*width) + z;
+}
+
+inline uint32 LevelChunkIndex(uint32 chunkX, uint32 y, uint32 chunkZ, uint32 chunksPerRow)
+{
+	return (y*chunksPerRow + chunkX)*chunksPerRow + chunkZ;
+}
+
+//Cell orders, where cell localX,localZ of a chunk sits in LevelChunkCells. Linear is rows of z, which is what
+//generation works in. Tiled and Morton keep small boxes of cells (the collision and neighbour lookups) on fewer
+//cache lines: a 4x4 tile is 128 bytes either way, Morton also keeps neighbouring tiles next to each other
+struct LinearCellOrder
+{
+	static inline uint32 Index(uint32 localX, uint32 localZ)
+	{
+		return localX*LEVEL_CHUNK_WIDTH + localZ;
+	}
+};
+
+struct TiledCellOrder
+{
+	static inline uint32 Index(uint32 localX, uint32 localZ)
+	{
+		return ((localX >> 2)*(LEVEL_CHUNK_WIDTH/4) + (localZ >> 2))*16 + (localX & 3)*4 + (localZ & 3);
+	}
+};
+
+struct MortonCellOrder
+{
+	//0bdcba -> 0b0d0c0b0a
+	static inline uint32 SpreadBits(uint32 v)
+	{
+		v = (v | (v << 2)) & 0x33;
+		return (v | (v << 1)) & 0x55;
+	}
+
+	static inline uint32 Index(uint32 localX, uint32 localZ)
+	{
+		return (SpreadBits(localX) << 1) | SpreadBits(localZ);
+	}
+};
+
+static_assert(LEVEL_CHUNK_WIDTH == 16, "TiledCellOrder and MortonCellOrder are written for 16x16 chunks");
+
+//The order chunks store their cells in, build with /D"LEVEL_CELL_ORDER_MORTON" or /D"LEVEL_CELL_ORDER_TILED"
+//to switch. Nothing outside LevelChunkLocalIndex should work out a cell's position in a chunk itself
+#if defined(LEVEL_CELL_ORDER_MORTON)
+typedef MortonCellOrder LevelCellOrder;
+#elif defined(LEVEL_CELL_ORDER_TILED)
+typedef TiledCellOrder LevelCellOrder;
+#else
+typedef LinearCellOrder LevelCellOrder;
+#endif
+
+//x,z can be level or chunk local cell indices
+template<typename CellOrder = LevelCellOrder>
+inline uint32 LevelChunkLocalIndex(uint32 x, uint32 z)
+{
+	return CellOrder::Index(x % LEVEL_CHUNK_WIDTH, z % LEVEL_CHUNK_WIDTH);
+}
+
+inline const LevelChunk& GetLevelChunk(const Level& level, uint32 x, uint32 y, uint32 z)
+{
+	return level.chunks[LevelChunkIndex(x / LEVEL_CHUNK_WIDTH, y, z / LEVEL_CHUNK_WIDTH, level.chunksPerRow)];
+}
+
+inline const NodeCell& GetLevelChunkCell(const LevelChunk& chunk, uint32 x, uint32 z)
+{
+	return chunk.cells ? chunk.cells[LevelChunkLocalIndex(x, z)] : chunk.uniformCell;
+}
+
+//x,y,z is a cell index, so x and z go up to level.width-1 and y to level.height-1
+inline const NodeCell& GetLevelCell(const Level& level, uint32 x, uint32 y, uint32 z)
+{
+	return GetLevelChunkCell(GetLevelChunk(level, x, y, z), x, z);
+}
+
+//High bit of every byte that isn't 0
+inline uint32 NonZeroBytes(uint32 word)
+{
+	return (((word & 0x7F7F7F7F) + 0x7F7F7F7F) | word) & 0x80808080;
+}
+
+//Nothing to draw or collide with in any of the quadrants, a quadrant needs both a type and a shape. All four
+//quadrants are checked at once on the packed bytes
+inline bool LevelCellIsEmpty(const NodeCell& cell)
+{
+	uint32 types, quadrants;
+	memcpy(&types, cell.types, sizeof(uint32));
+	memcpy(&quadrants, cell.quadrants, sizeof(uint32));
+	return (NonZeroBytes(types) & NonZeroBytes(quadrants & (CELL_SHAPE_MASK*0x01010101u))) == 0;
+}
+
+//All four corners have a type, so the cell is filled through its whole volume
+inline bool LevelCellIsSolid(const NodeCell& cell)
+{
+	uint32 types;
+	memcpy(&types, cell.types, sizeof(uint32));
+	return NonZeroBytes(types) == 0x80808080;
+}
+
+inline bool LevelChunkIsEmpty(const LevelChunk& chunk)
+{
+	uint16 occupied = 0;
+	for (uint32 x = 0; x < LEVEL_CHUNK_WIDTH; x++)
+		occupied |= chunk.occupied[x];
+	return occupied == 0;
+}
+
+//Sets the chunk's bits in the occupancy summary from its rows, call after anything changes a chunk's cells
+inline void UpdateLevelChunkSummary(Level& level, uint32 chunkX, uint32 y, uint32 chunkZ)
+{
+	uint64 bit = 1ull << chunkZ;
+	bool occupied = !LevelChunkIsEmpty(level.chunks[LevelChunkIndex(chunkX, y, chunkZ, level.chunksPerRow)]);
+	level.occupiedChunks[y][chunkX] = occupied ? level.occupiedChunks[y][chunkX] | bit : level.occupiedChunks[y][chunkX] & ~bit;
+
+	uint64 column = 0;
+	for (uint32 layer = 0; layer < level.height; layer++)
+		column |= level.occupiedChunks[layer][chunkX] & bit;
+	level.occupiedColumns[chunkX] = (level.occupiedColumns[chunkX] & ~bit) | column;
+}
@@ -0,0 +1,425 @@
+#include "memory.h"
+#include "log.h"
+#include "level.h"
+#include <cstdio>
+
+//The cells and meshes of every column that has been built, kept from one launch to the next in a file next to the
+//level, see LevelCacheHeader. Columns come back out of the old file while the level loads and anything that has to
+//be built goes into <filepath>.tmp, which replaces the old file once CloseLevelCache has written it out.
+//Only one thread ever writes columns: the streaming thread, or the main thread as the load jobs hand columns back.
+//stale is set by the main thread and read by whichever thread is building columns, see MarkLevelCacheStale
+struct LevelCache
+{
+	MappedFile file; //the cache from last time
+	const LevelCacheColumn* columns; //NULL unless the file matches the level being loaded
+	LevelCacheColumn* written; //columns built this session, NULL while the cache isn't open
+	uint32 writtenCount;
+	SDL_RWops* pending;
+	uint64 pendingSize;
+	bool writable;
+
+	uint64 key;
+	uint32 chunksPerRow;
+	uint32 height;
+	std::atomic<byte> stale[MAX_GEOMETRY_CHUNKS];
+	char filepath[LEVEL_CACHE_PATH_LENGTH];
+	char pendingFilepath[LEVEL_CACHE_PATH_LENGTH];
+};
+
+//Column checksums are built up a piece at a time since a column is never in one buffer while it's written
+inline uint64 ChainLevelCacheChecksum(uint64 checksum, const void* data, uint64 size)
+{
+	return (checksum ^ LevelChecksum(data, size)) * 0x9E3779B97F4A7C15ull;
+}
+
+//Everything cell generation and meshing read besides the code itself, which LEVEL_CACHE_VERSION stands in for.
+//Binary levels already keep a checksum of each record in the record list so only that gets hashed, older levels
+//have all their nodes hashed. The node sets go in after PrepareNodeSetOcclusion, piece by piece as the mesher sees them
+template <uint32 N>
+uint64 LevelCacheKey(const LevelData& levelData, const NodeSetPalette<N>& nodeSets, bool packVertices)
+{
+	const uint32 rotationCount = sizeof(ROTATION_TABLE)/sizeof(ROTATION_TABLE[0]);
+	uint32 settings[] = { LEVEL_CACHE_VERSION, (uint32)sizeof(Vertex), (uint32)packVertices, levelData.width,
+		levelData.height, nodeSets.count };
+	uint64 key = ChainLevelCacheChecksum(0, settings, sizeof(settings));
+
+	uint32 cellOrder[LEVEL_CHUNK_CELLS];
+	for (uint32 x = 0; x < LEVEL_CHUNK_WIDTH; x++)
+	for (uint32 z = 0; z < LEVEL_CHUNK_WIDTH; z++)
+		cellOrder[x*LEVEL_CHUNK_WIDTH + z] = LevelChunkLocalIndex(x, z);
+	key = ChainLevelCacheChecksum(key, cellOrder, sizeof(cellOrder));
+
+	if (levelData.records != NULL)
+		key = ChainLevelCacheChecksum(key, levelData.records,
+			(uint64)levelData.recordsPerRow*levelData.recordsPerRow*sizeof(LevelChunkRecord));
+	else
+		key = ChainLevelCacheChecksum(key, levelData.nodes, (uint64)levelData.totalSize*sizeof(GeometryNode));
+
+	for (uint32 s = 0; s < nodeSets.count; s++)
+	{
+		const NodeSet& nodeSet = nodeSets.sets[s];
+		float top[] = { (float)nodeSet.mergeableTop, nodeSet.topUVPerX.x, nodeSet.topUVPerX.y, nodeSet.topUVPerZ.x,
+			nodeSet.topUVPerZ.y };
+		key = ChainLevelCacheChecksum(key, top, sizeof(top));
+
+		for (uint32 shape = 0; shape < 5; shape++)
+		for (uint32 layer = 0; layer < 4; layer++)
+		{
+			const NodeShape& piece = nodeSet.shapeStacks[shape].layers[layer];
+			uint32 counts[] = { piece.mesh.vertexCount, piece.mesh.indexCount };
+			key = ChainLevelCacheChecksum(key, counts, sizeof(counts));
+			key = ChainLevelCacheChecksum(key, piece.sharedOcclusion, sizeof(piece.sharedOcclusion));
+			key = ChainLevelCacheChecksum(key, piece.mesh.indices, piece.mesh.indexCount*sizeof(uint16));
+			if (piece.occlusion != NULL)
+				key = ChainLevelCacheChecksum(key, piece.occlusion, (piece.mesh.indexCount/3)*rotationCount*sizeof(uint32));
+			for (uint32 r = 0; r < rotationCount && piece.mesh.vertexCount > 0; r++)
+				key = ChainLevelCacheChecksum(key, piece.mesh.vertices + r*nodeSet.rotationStride,
+					piece.mesh.vertexCount*sizeof(Vertex));
+		}
+	}
+	return key;
+}
+
+//Maps the cache from last time if it was built from the same inputs, otherwise every column gets built and the
+//file is replaced once the cache is closed. A NULL filepath leaves the cache closed, it never has anything then
+void OpenLevelCache(LevelCache& cache, const char* filepath, uint64 key, uint32 chunksPerRow, uint32 height)
+{
+	ASSERT(cache.written == NULL, __FILE__, __LINE__);
+	if (filepath == NULL) return;
+
+	uint32 columnCount = chunksPerRow*chunksPerRow;
+	cache.file = {};
+	cache.columns = NULL;
+	cache.writtenCount = 0;
+	cache.pending = NULL;
+	cache.pendingSize = 0;
+	cache.writable = true;
+	cache.key = key;
+	cache.chunksPerRow = chunksPerRow;
+	cache.height = height;
+	cache.written = (LevelCacheColumn*)SDL_calloc(columnCount ? columnCount : 1, sizeof(LevelCacheColumn));
+	for (uint32 c = 0; c < MAX_GEOMETRY_CHUNKS; c++)
+		cache.stale[c].store(0, std::memory_order_relaxed);
+	SDL_strlcpy(cache.filepath, filepath, LEVEL_CACHE_PATH_LENGTH);
+	SDL_snprintf(cache.pendingFilepath, LEVEL_CACHE_PATH_LENGTH, "%s.tmp", filepath);
+
+	if (!PlatformMapFile(filepath, &cache.file))
+	{
+		LOG_INFO("No level cache at %s yet, it fills in as the level loads\n", filepath);
+		return;
+	}
+
+	const LevelCacheHeader* header = (const LevelCacheHeader*)cache.file.data;
+	uint64 fileSize = cache.file.size;
+	uint64 tableSize = (uint64)columnCount*sizeof(LevelCacheColumn);
+	bool valid = fileSize >= sizeof(LevelCacheHeader) && header->magic == LEVEL_CACHE_MAGIC &&
+		header->version == LEVEL_CACHE_VERSION && header->key == key && header->chunksPerRow == chunksPerRow &&
+		header->height == height && header->columnOffset <= fileSize && tableSize <= fileSize - header->columnOffset;
+	const LevelCacheColumn* columns = valid ? (const LevelCacheColumn*)((const byte*)cache.file.data + header->columnOffset) : NULL;
+	if (!valid || LevelChecksum(columns, tableSize) != header->checksum)
+	{
+		LOG_INFO("Level cache %s is out of date, it gets rebuilt as the level loads\n", filepath);
+		PlatformUnmapFile(cache.file);
+		return;
+	}
+
+	cache.columns = columns;
+	uint32 cachedCount = 0;
+	for (uint32 c = 0; c < columnCount; c++)
+		cachedCount += columns[c].offset != 0;
+	LOG_INFO("Level cache %s has %u of %u columns\n", filepath, cachedCount, columnCount);
+}
+
+//Steps over one piece of a cached column, NULL if it runs past the end
+inline const byte* NextLevelCachePiece(const byte** cursor, const byte* end, uint64 size, uint64* checksum)
+{
+	const byte* piece = *cursor;
+	if (AlignUp(size, LEVEL_CACHE_ALIGNMENT) > (uint64)(end - piece)) return NULL;
+	*checksum = ChainLevelCacheChecksum(*checksum, piece, size);
+	*cursor = piece + AlignUp(size, LEVEL_CACHE_ALIGNMENT);
+	return piece;
+}
+
+//Puts a column back the way it was built: chunks with cells of their own get them copied into the pool and the
+//meshes are copied into the staging meshes, so they go up with UploadGeometryChunk like a freshly built column.
+//The whole column is checked before anything is copied, a column is small enough to still be in the cache for the
+//copy. Only reads the cache, so it can run on any thread. Returns false if the column isn't there or doesn't check out
+bool ReadLevelCacheColumn(const LevelCache& cache, GameMemory& memory, uint32 chunkX, uint32 chunkZ,
+	LevelChunk* column, uint32 columnStride, GeometryMesh* meshes, uint32* typeMask)
+{
+	if (cache.columns == NULL) return false;
+	uint32 index = chunkX*cache.chunksPerRow + chunkZ;
+	const LevelCacheColumn& entry = cache.columns[index];
+	if (entry.offset == 0 || cache.stale[index].load(std::memory_order_relaxed)) return false;
+	if (entry.offset > cache.file.size || entry.size > cache.file.size - entry.offset) return false;
+
+	const byte* cursor = (const byte*)cache.file.data + entry.offset;
+	const byte* end = cursor + entry.size;
+	uint64 checksum = 0;
+	const LevelCacheChunk* chunks = (const LevelCacheChunk*)NextLevelCachePiece(&cursor, end,
+		cache.height*sizeof(LevelCacheChunk), &checksum);
+	const LevelCacheMesh* meshTable = (const LevelCacheMesh*)NextLevelCachePiece(&cursor, end,
+		MAX_NODE_TYPES*sizeof(LevelCacheMesh), &checksum);
+	if (chunks == NULL || meshTable == NULL) return false;
+
+	const byte* cells[MAX_LEVEL_HEIGHT];
+	const byte* vertices[MAX_NODE_TYPES];
+	const byte* indices[MAX_NODE_TYPES];
+	bool valid = true;
+	for (uint32 y = 0; y < cache.height && valid; y++)
+	{
+		cells[y] = chunks[y].dense ? NextLevelCachePiece(&cursor, end, sizeof(LevelChunkCells), &checksum) : NULL;
+		valid = !chunks[y].dense || cells[y] != NULL;
+	}
+	for (uint32 t = 0; t < MAX_NODE_TYPES && valid; t++)
+	{
+		const LevelCacheMesh& mesh = meshTable[t];
+		uint32 indexSize = mesh.indexType == GL_UNSIGNED_INT ? sizeof(uint32) : sizeof(uint16);
+		valid = mesh.vertexCount <= GEO_MESH_MAX_VERTS && mesh.indexCount <= GEO_MESH_MAX_INDEX &&
+			mesh.coarseIndexStart <= mesh.indexCount && mesh.vertexSize <= sizeof(Vertex);
+		vertices[t] = valid ? NextLevelCachePiece(&cursor, end, (uint64)mesh.vertexCount*mesh.vertexSize, &checksum) : NULL;
+		indices[t] = valid ? NextLevelCachePiece(&cursor, end, (uint64)mesh.indexCount*indexSize, &checksum) : NULL;
+		valid = vertices[t] != NULL && indices[t] != NULL;
+	}
+	if (!valid || checksum != entry.checksum)
+	{
+		LOG_WARN("Level cache column %u,%u corrupted, building it instead\n", chunkX, chunkZ);
+		return false;
+	}
+	for (uint32 t = 0; t < MAX_NODE_TYPES; t++)
+	{
+		meshes[t].vertexCount = 0;
+		meshes[t].indexCount = 0;
+		if (!GrowGeometryMesh(meshes[t], meshTable[t].vertexCount, meshTable[t].indexCount)) return false;
+	}
+
+	for (uint32 y = 0; y < cache.height; y++)
+	{
+		LevelChunk& chunk = column[y*columnStride];
+		chunk.cells = NULL;
+		chunk.cellSlot = 0;
+		chunk.uniformCell = chunks[y].uniformCell;
+		SDL_memcpy(chunk.occupied, chunks[y].occupied, sizeof(chunk.occupied));
+		if (cells[y] == NULL) continue;
+
+		auto request = memory.levelChunkCellPool.RequestFromBlock(1);
+		ASSERT(request.valid, __FILE__, __LINE__);
+		if (!request.valid) continue;
+		SDL_memcpy(request.memory, cells[y], sizeof(LevelChunkCells));
+		chunk.cells = request.memory->cells;
+		chunk.cellSlot = request.index;
+	}
+
+	for (uint32 t = 0; t < MAX_NODE_TYPES; t++)
+	{
+		const LevelCacheMesh& mesh = meshTable[t];
+		uint32 indexSize = mesh.indexType == GL_UNSIGNED_INT ? sizeof(uint32) : sizeof(uint16);
+		meshes[t].vertexCount = mesh.vertexCount;
+		meshes[t].indexCount = mesh.indexCount;
+		meshes[t].indexType = mesh.indexType;
+		meshes[t].vertexSize = mesh.vertexSize;
+		meshes[t].coarseIndexStart = mesh.coarseIndexStart;
+		SDL_memcpy(meshes[t].vertices, vertices[t], (uint64)mesh.vertexCount*mesh.vertexSize);
+		SDL_memcpy(meshes[t].indices, indices[t], (uint64)mesh.indexCount*indexSize);
+	}
+	*typeMask = entry.typeMask;
+	return true;
+}
+
+//Writes one piece of a column and pads it out to LEVEL_CACHE_ALIGNMENT
+inline bool AppendLevelCachePiece(LevelCache& cache, const void* data, uint64 size, uint64* checksum)
+{
+	static const byte padding[LEVEL_CACHE_ALIGNMENT] = {};
+	uint64 paddingSize = AlignUp(size, LEVEL_CACHE_ALIGNMENT) - size;
+	*checksum = ChainLevelCacheChecksum(*checksum, data, size);
+	bool written = (size == 0 || SDL_RWwrite(cache.pending, data, (size_t)size, 1) == 1) &&
+		(paddingSize == 0 || SDL_RWwrite(cache.pending, padding, (size_t)paddingSize, 1) == 1);
+	cache.pendingSize += size + paddingSize;
+	return written;
+}
+
+//Stops writing for the rest of the session, the old cache stays as it is
+void AbandonLevelCacheWrites(LevelCache& cache)
+{
+	LOG_WARN("Failed to write the level cache %s, it won't be updated\n", cache.pendingFilepath);
+	if (cache.pending != NULL)
+	{
+		SDL_RWclose(cache.pending);
+		remove(cache.pendingFilepath);
+	}
+	cache.pending = NULL;
+	cache.writable = false;
+}
+
+//Adds a column that was just built from the level data, see LoadLevelColumn. Columns built after an edit went
+//into them don't match the level file anymore and are left out
+void WriteLevelCacheColumn(LevelCache& cache, const LevelChunk* column, uint32 columnStride, const GeometryMesh* meshes,
+	uint32 chunkX, uint32 chunkZ, uint32 typeMask)
+{
+	if (cache.written == NULL || !cache.writable) return;
+	uint32 index = chunkX*cache.chunksPerRow + chunkZ;
+	if (cache.stale[index].load(std::memory_order_relaxed) || cache.written[index].offset != 0) return;
+
+	//the header is only filled in once the cache is closed
+	if (cache.pending == NULL)
+	{
+		LevelCacheHeader header = {};
+		cache.pending = SDL_RWFromFile(cache.pendingFilepath, "wb");
+		cache.pendingSize = 0;
+		uint64 checksum = 0;
+		if (cache.pending == NULL || !AppendLevelCachePiece(cache, &header, sizeof(header), &checksum))
+		{
+			AbandonLevelCacheWrites(cache);
+			return;
+		}
+	}
+
+	LevelCacheChunk chunks[MAX_LEVEL_HEIGHT] = {};
+	LevelCacheMesh meshTable[MAX_NODE_TYPES] = {};
+	for (uint32 y = 0; y < cache.height; y++)
+	{
+		const LevelChunk& chunk = column[y*columnStride];
+		chunks[y].uniformCell = chunk.uniformCell;
+		SDL_memcpy(chunks[y].occupied, chunk.occupied, sizeof(chunk.occupied));
+		chunks[y].dense = chunk.cells != NULL;
+	}
+	for (uint32 t = 0; t < MAX_NODE_TYPES; t++)
+	{
+		meshTable[t].vertexCount = meshes[t].vertexCount;
+		meshTable[t].indexCount = meshes[t].indexCount;
+		meshTable[t].indexType = meshes[t].indexType;
+		meshTable[t].vertexSize = meshes[t].vertexSize;
+		meshTable[t].coarseIndexStart = meshes[t].coarseIndexStart;
+	}
+
+	LevelCacheColumn entry = {};
+	entry.offset = cache.pendingSize;
+	entry.typeMask = typeMask;
+	bool written = AppendLevelCachePiece(cache, chunks, cache.height*sizeof(LevelCacheChunk), &entry.checksum) &&
+		AppendLevelCachePiece(cache, meshTable, sizeof(meshTable), &entry.checksum);
+	for (uint32 y = 0; y < cache.height && written; y++)
+	{
+		const LevelChunk& chunk = column[y*columnStride];
+		if (chunk.cells != NULL)
+			written = AppendLevelCachePiece(cache, chunk.cells, sizeof(LevelChunkCells), &entry.checksum);
+	}
+	for (uint32 t = 0; t < MAX_NODE_TYPES && written; t++)
+	{
+		uint32 indexSize = meshes[t].indexType == GL_UNSIGNED_INT ? sizeof(uint32) : sizeof(uint16);
+		written = AppendLevelCachePiece(cache, meshes[t].vertices, (uint64)meshes[t].vertexCount*meshes[t].vertexSize,
+			&entry.checksum) &&
+			AppendLevelCachePiece(cache, meshes[t].indices, (uint64)meshes[t].indexCount*indexSize, &entry.checksum);
+	}
+	if (!written)
+	{
+		AbandonLevelCacheWrites(cache);
+		return;
+	}
+
+	entry.size = (uint32)(cache.pendingSize - entry.offset);
+	cache.written[index] = entry;
+	cache.writtenCount++;
+}
+
+//Call from the main thread before re-meshing after an edit. Every dirty geometry chunk has cells that don't come
+//from the level file anymore, so those columns are never read from or written to the cache for the rest of the session.
+//The streaming thread can be building one of them right now, but then the edit never made it into its cells (they
+//weren't resident yet), so whatever it reads or writes before it sees the flag is still what the level file has
+void MarkLevelCacheStale(LevelCache& cache, const GeometryBuffer& geometryBuffer)
+{
+	if (cache.written == NULL) return;
+	for (uint32 c = 0; c < geometryBuffer.chunkCount; c++)
+	{
+		if (geometryBuffer.chunks[c].dirty)
+			cache.stale[c].store(1, std::memory_order_relaxed);
+	}
+}
+
+//Finishes the new cache if anything was built this session: the columns the old cache had that weren't built again
+//are copied over as they are, then the column list and the header go in and the new file replaces the old one.
+//The old file has to be unmapped before it can be replaced, so this is also where the cache lets go of it
+void CloseLevelCache(LevelCache& cache)
+{
+	if (cache.written == NULL) return;
+
+	uint32 columnCount = cache.chunksPerRow*cache.chunksPerRow;
+	if (cache.pending != NULL && cache.writtenCount > 0)
+	{
+		uint32 keptCount = 0;
+		bool written = true;
+		for (uint32 c = 0; c < columnCount && written && cache.columns != NULL; c++)
+		{
+			LevelCacheColumn entry = cache.columns[c];
+			if (entry.offset == 0 || cache.written[c].offset != 0) continue;
+			if (entry.offset > cache.file.size || entry.size > cache.file.size - entry.offset) continue;
+
+			//the padding at the end of the last piece is part of the size, so the copy stays aligned
+			uint64 unused = 0;
+			uint64 offset = cache.pendingSize;
+			written = AppendLevelCachePiece(cache, (const byte*)cache.file.data + entry.offset, entry.size, &unused);
+			entry.offset = offset;
+			cache.written[c] = entry;
+			keptCount++;
+		}
+
+		LevelCacheHeader header = {};
+		header.magic = LEVEL_CACHE_MAGIC;
+		header.version = LEVEL_CACHE_VERSION;
+		header.key = cache.key;
+		header.chunksPerRow = cache.chunksPerRow;
+		header.height = cache.height;
+		header.columnOffset = cache.pendingSize;
+		header.checksum = LevelChecksum(cache.written, (uint64)columnCount*sizeof(LevelCacheColumn));
+		written = written &&
+			SDL_RWwrite(cache.pending, cache.written, sizeof(LevelCacheColumn), columnCount) == columnCount &&
+			SDL_RWseek(cache.pending, 0, RW_SEEK_SET) == 0 &&
+			SDL_RWwrite(cache.pending, &header, sizeof(header), 1) == 1;
+		written = SDL_RWclose(cache.pending) == 0 && written;
+		cache.pending = NULL;
+
+		PlatformUnmapFile(cache.file);
+		if (written)
+		{
+			remove(cache.filepath);
+			written = rename(cache.pendingFilepath, cache.filepath) == 0;
+		}
+		if (written)
+			LOG_INFO("Level cache %s written, %u new columns and %u kept\n", cache.filepath, cache.writtenCount, keptCount);
+		else
+		{
+			LOG_WARN("Failed to write the level cache %s\n", cache.filepath);
+			remove(cache.pendingFilepath);
+		}
+	}
+	else if (cache.pending != NULL)
+	{
+		SDL_RWclose(cache.pending);
+		remove(cache.pendingFilepath);
+	}
+
+	PlatformUnmapFile(cache.file);
+	SDL_free(cache.written);
+	cache.written = NULL;
+	cache.columns = NULL;
+	cache.pending = NULL;
+}
+
+//Fills in one column of chunks and its meshes, out of the cache if it has the column and otherwise generated and
+//meshed from the level data, which is then up to the caller to pass on to WriteLevelCacheColumn. typeMask gets bit t
+//set if node type t+1 is in the column. Returns true if the column came out of the cache
+template <uint32 N>
+bool LoadLevelColumn(const LevelCache& cache, const LevelData& levelData, const Level& level, NodeSetPalette<N>& nodeSets,
+	GameMemory& memory, uint32 chunkX, uint32 chunkZ, LevelChunk* column, uint32 columnStride, GeometryMesh* meshes,
+	bool packVertices, uint32* typeMask)
+{
+	if (ReadLevelCacheColumn(cache, memory, chunkX, chunkZ, column, columnStride, meshes, typeMask))
+		return true;
+
+	int typeCount[MAX_NODE_TYPES] = {};
+	GenerateLevelChunkColumn(levelData, memory, chunkX, chunkZ, column, columnStride, typeCount);
+	BuildGeometryChunk(level, column, columnStride, nodeSets, meshes, chunkX, chunkZ, packVertices);
+	*typeMask = 0;
+	for (uint32 t = 0; t < MAX_NODE_TYPES; t++)
+		*typeMask |= (uint32)(typeCount[t] > 0) << t;
+	return false;
+}
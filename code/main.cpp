@@ -19,17 +19,22 @@
 #include "log.h"
 #include "types.h"
 #include "transform.cpp"
+#include "jobs.cpp"
 #include "rendering.cpp"
 #include "resources.cpp"
 #include "input.cpp"
 #include "level.cpp"
 #include "debug_tools.cpp"
+#include "level_cache.cpp"
+#include "streaming.cpp"
 #include "physics.cpp"
 #include "gameplay.cpp"
 
 
 
 const int FPS_FRAME_AVG = 4;
+const uint32 FRAME_STREAM_REGION_SIZE = 4*1024*1024;
+const char* MEMORY_REPORT_FILEPATH = "memory_report.json";
 
 //NOTE: Im currently setting both of these to force laptops that have both intel gfx and dedicated gfx.
 // Im not entirely sure if setting them on unsupported devices causes any problems, would have to test on
@@ -52,10 +57,10 @@ void ChangeWindowFocus(bool lock)
 int main(int argc, char* argv[])
 {
 	GameState gameState = {0};
-    gameState.entityManager = EntityManager();
     gameState.timeScale = 1.0f;
 	GameMemory Memory;
 	Memory.Allocate();
+    gameState.entityManager.Init(Memory);
 
 
 	Timer timer;
@@ -79,6 +84,72 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
+	//-workers N overrides the worker thread count, 0 (the default) means one per extra core
+	uint32 workerCount = 0;
+	for (int i = 1; i+1 < argc; i++)
+	{
+		if (SDL_strcmp(argv[i], "-workers") == 0)
+			workerCount = (uint32)SDL_atoi(argv[i+1]);
+	}
+
+	//-streamradius N keeps N chunks of the level resident around the camera
+	uint32 streamRadius = LEVEL_STREAM_DEFAULT_RADIUS;
+	for (int i = 1; i+1 < argc; i++)
+	{
+		if (SDL_strcmp(argv[i], "-streamradius") == 0)
+			streamRadius = (uint32)SDL_atoi(argv[i+1]);
+	}
+
+	//-packedvertices uploads the level geometry as PackedVertex, 20 bytes a vertex instead of 48
+	bool packedVertices = false;
+	for (int i = 1; i < argc; i++)
+	{
+		if (SDL_strcmp(argv[i], "-packedvertices") == 0)
+			packedVertices = true;
+	}
+
+	//-lodpixels N draws level chunks that come out less than N pixels across with their coarse meshes, 0 never does
+	float lodPixels = GEO_LOD_DEFAULT_PIXELS;
+	for (int i = 1; i+1 < argc; i++)
+	{
+		if (SDL_strcmp(argv[i], "-lodpixels") == 0)
+			lodPixels = (float)SDL_atoi(argv[i+1]);
+	}
+
+	//-levelcache keeps the built level in <level>.cache and loads it from there next time instead of generating and
+	//meshing it. Off by default, the cache holds every mesh so it's about as big as the level's geometry
+	bool levelCache = false;
+	for (int i = 1; i < argc; i++)
+	{
+		if (SDL_strcmp(argv[i], "-levelcache") == 0)
+			levelCache = true;
+	}
+
+	//-nostreaming loads the whole level up front on the worker threads, run it with different -workers counts
+	//to see how the level load scales with cores
+	bool streaming = true;
+	for (int i = 1; i < argc; i++)
+	{
+		if (SDL_strcmp(argv[i], "-nostreaming") == 0)
+			streaming = false;
+	}
+
+	//-convertlevel in.level out.levelb writes out the binary version of a json level and quits
+	for (int i = 1; i+2 < argc; i++)
+	{
+		if (SDL_strcmp(argv[i], "-convertlevel") == 0)
+		{
+			bool converted = ConvertLevelToBinary(argv[i+1], argv[i+2], Memory);
+			SDL_Quit();
+			return converted ? 0 : 1;
+		}
+	}
+
+	JobSystem Jobs;
+	StartJobSystem(Jobs, workerCount);
+	LevelStreamer Streamer;
+	StartLevelStreamer(Streamer, streaming);
+
 	Uint32 windowFlags = SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE;
 	//Uint32 windowFlags = SDL_WINDOW_OPENGL | SDL_WINDOW_FULLSCREEN_DESKTOP;
 
@@ -145,23 +216,25 @@ int main(int argc, char* argv[])
 	glEnable(GL_CULL_FACE);
 	glFrontFace(GL_CW);
 
-	UnicodeGlyphAtlas DefaultFontAtlas = LoadFont("BalooBhaijaan2-Regular");
+	UnicodeGlyphAtlas DefaultFontAtlas = LoadFont("BalooBhaijaan2-Regular", Memory);
 
 	//Testing meshes
 	Mesh axis = LoadModel("resources/models/axis.gltf", Memory);
 	Mesh sphere = LoadModel("resources/models/Sphere.gltf", Memory);
-    uint32 axisBuffer = UploadMeshToGPU(axis, Memory);
-    uint32 sphereBuffer = UploadMeshToGPU(sphere, Memory);
+    PoolHandle axisBuffer = UploadMeshToGPU(axis, Memory);
+    PoolHandle sphereBuffer = UploadMeshToGPU(sphere, Memory);
+    //nothing reads these back once they're on the GPU, the node sets get compacted down over them below
+    ReleaseMesh(axis, Memory);
+    ReleaseMesh(sphere, Memory);
     uint32 mat = LoadMaterial("resources/materials/player mat.mat", Memory);
 
     auto playerTransform = Memory.transforms.RequestFromBlock(1);
     playerTransform.memory->position = vec3f(10.0f, 1.0f, 10.0f);
     playerTransform.memory->rotation = quaternion(1.0f, 0.0f, 0.0f, 0.0f);
     playerTransform.memory->scale    = vec3f(1.0f);
-    uint32 testPlayer = sphereBuffer;//UploadMeshToGPU(playerModel.meshes[1].mesh, Memory);
+    uint32 testPlayer = sphereBuffer.index;//UploadMeshToGPU(playerModel.meshes[1].mesh, Memory);
     gameState.entityManager.playerEntity = playerTransform.index;
 
-    //RenderEntity* playerRenderMesh = gameState.entityManager.CreateRenderEntity(request.index, testPlayer,mat);
 	gameState.entityManager.CreateRenderEntity(playerTransform.index, testPlayer,mat);
 
     auto cameraRequest = Memory.transforms.RequestFromBlock(1);
@@ -202,20 +275,39 @@ int main(int argc, char* argv[])
 			asset.fragmentShaderFilePath.c_str());
 	}
 
+	//the same shaders again with the vertex shader decoding PackedVertex
+	char packedVertexDefines[128];
+	SDL_snprintf(packedVertexDefines, sizeof(packedVertexDefines), "#define PACKED_VERTEX\n#define PACKED_POSITION_SCALE %f\n",
+		PACKED_POSITION_SCALE);
+	for (int i = 0; i < ShaderType::Count; i++)
+	{
+		ShaderAsset& asset = ShaderTable.shaderAssetFilePaths[i];
+		ShaderTable.compiledPackedShaders[i] = !packedVertices ? 0 : LoadShader(
+			asset.vertexShaderFilePath.c_str(),
+			asset.fragmentShaderFilePath.c_str(), packedVertexDefines);
+	}
+
 	NodeSetPalette<MAX_NODE_TYPES> NodePalette;
 	for (int i = 0; i < MAX_NODE_TYPES; i++)
 	{
 		NodePalette.sets[i] = LoadNodeSet(NodeAssets.nodeSetFilePaths[i].c_str(), Memory);
 		NodePalette.materials[i] = LoadMaterial(NodeAssets.materialFilePaths[i].c_str(), Memory);
 	}
+	PrepareNodeSetOcclusion(NodePalette, Memory);
+	CompactMeshMemory(NodePalette, Memory);
 
-	LevelData levelData =  LoadLevelData("resources/levels/level_0.level", Memory);
+	const char* levelFilepath = "resources/levels/level_0.levelb";
+	char levelCacheFilepath[LEVEL_CACHE_PATH_LENGTH];
+	SDL_snprintf(levelCacheFilepath, LEVEL_CACHE_PATH_LENGTH, "%s.cache", levelFilepath);
+	Timer levelTimer;
+	levelTimer.Mark();
+	LevelData levelData =  LoadLevelData(levelFilepath, Memory);
+	LOG_INFO("Level data loaded in %f s\n", levelTimer.ElapsedTime().count());
 
 	Texture2D texture = LoadTexture("resources/textures/stone.png");
 	
 
 	gameState.state = GameStateGameplay;
-	gameState.level = GenerateLevelCells(levelData, Memory);
 
 
 	GameInput gameInput = {0};
@@ -230,6 +322,7 @@ int main(int argc, char* argv[])
     Debug.DebugShadowmap = false;
     Debug.DebugPlayerCollision = false;
     Debug.DebugColliders = false;
+    Debug.DebugMemoryStats = false;
     Debug.FontAtlas = DefaultFontAtlas;
 
 	//---Shader Debugging-----------------
@@ -250,7 +343,7 @@ int main(int argc, char* argv[])
 	screenQuad.indexCount = 6;
 	screenQuad.vertices = verts;
 	screenQuad.indices = indices;
-	uint32 screenQuadBuffer = UploadMeshToGPU(screenQuad, Memory);
+	PoolHandle screenQuadBuffer = UploadMeshToGPU(screenQuad, Memory);
 
 	//-------------------------------------
 #endif
@@ -264,39 +357,28 @@ int main(int argc, char* argv[])
 	ApplyVertexAttribute(2, offsetof(Vertex, uv0)     , 2);
 	ApplyVertexAttribute(3, offsetof(Vertex, color)   , 4);
 
-	uint32 CameraBuffer      = CreateUniformBuffer(sizeof(CameraData), 0);
-	uint32 ObjectBuffer      = CreateUniformBuffer(sizeof(ObjectData), 1);
-	uint32 EnvironmentBuffer = CreateUniformBuffer(sizeof(EnvironmentData), 2);
-	uint32 MainLightBuffer   = CreateUniformBuffer(sizeof(Light), 3);
-	uint32 PointLightBuffer  = CreateUniformBuffer(sizeof(Light)*MAX_POINT_LIGHTS, 4);
+	GLuint packedMeshVAO;
+	glGenVertexArrays(1, &packedMeshVAO);
+	glBindVertexArray(packedMeshVAO);
+	ApplyPackedVertexAttributes();
+	glBindVertexArray(meshVAO);
 
-	GeometryBuffer GeometryRenderBuffer;
-	for (int i = 0; i < MAX_NODE_TYPES; i++)
-	{
-		int blockIndex = gameState.level.nodeTypeGeometyBufferMap[i];
-		if (blockIndex < 0)
-		{
-			GeometryRenderBuffer.meshes[i].vertices = NULL;
-			GeometryRenderBuffer.meshes[i].indices  = NULL;
-			GeometryRenderBuffer.meshes[i].vertexCount = 0;
-			GeometryRenderBuffer.meshes[i].indexCount  = 0;
+	uint32 MainLightBuffer   = CreateUniformBuffer(sizeof(Light), MAIN_LIGHT_BUFFER_BINDING);
+	uint32 PointLightBuffer  = CreateUniformBuffer(sizeof(Light)*MAX_POINT_LIGHTS, POINT_LIGHT_BUFFER_BINDING);
 
-		}
-		else
-		{
-			GeometryRenderBuffer.meshes[i].vertices = Memory.geometryMeshVertexBlock.block+(blockIndex*GEO_MESH_MAX_VERTS);
-			GeometryRenderBuffer.meshes[i].indices  = Memory.geometryMeshIndexBlock.block +(blockIndex*GEO_MESH_MAX_INDEX);
-			GeometryRenderBuffer.meshes[i].vertexCount = 0;
-			GeometryRenderBuffer.meshes[i].indexCount  = 0;
-		}
-	}
-
-	for (int i = 0; i < MAX_NODE_TYPES; i++)
-	{
-		GeometryRenderBuffer.handles[i] = CreateEmptyMeshBuffer();
-	}
+	//camera, environment and object uniforms plus debug text and lines, everything rewritten every frame
+	GLint uniformAlignment;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniformAlignment);
+	StreamBuffer FrameStream = CreateStreamBuffer(FRAME_STREAM_REGION_SIZE, (uint32)uniformAlignment);
 
-	UpdateGeometryBuffer(gameState.level, NodePalette, GeometryRenderBuffer);
+	GeometryBuffer GeometryRenderBuffer = {};
+	GeometryRenderBuffer.packedVertices = packedVertices;
+	GeometryRenderBuffer.lodPixels = lodPixels;
+	levelTimer.Mark();
+	SetupLevel(Streamer, gameState.level, levelData, NodePalette, GeometryRenderBuffer, Memory, Jobs,
+		Memory.transforms.block[gameState.entityManager.playerEntity].position, streamRadius,
+		levelCache ? levelCacheFilepath : NULL);
+	LOG_INFO("Level ready to play in %f s\n", levelTimer.ElapsedTime().count());
 
 	CameraData cameraData;
 	EnvironmentData environmentData;
@@ -366,6 +448,18 @@ int main(int argc, char* argv[])
 	glReadBuffer(GL_NONE);
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
+	uint32 shadowPassPackedShader = 0;
+	int packedLightVPShaderLocation = -1;
+	if (packedVertices)
+	{
+		shadowPassPackedShader = LoadShader
+			("resources/shaders/ShadowPass_Vertex.glsl",
+			"resources/shaders/ShadowPass_Fragment.glsl", packedVertexDefines);
+		glUseProgram(shadowPassPackedShader);
+		packedLightVPShaderLocation = glGetUniformLocation(shadowPassPackedShader, "LightVP");
+		ASSERT((packedLightVPShaderLocation >= 0), __FILE__, __LINE__);
+	}
+
 	uint32 shadowPassShader = LoadShader
 		("resources/shaders/ShadowPass_Vertex.glsl",
 		"resources/shaders/ShadowPass_Fragment.glsl");
@@ -378,6 +472,8 @@ int main(int argc, char* argv[])
 	//------------------------------------
 
 	LOG_INFO("Load time: %f s\n", timer.ElapsedTime().count());
+	LOG_INFO("Game memory: %llu MB reserved, %llu MB committed\n",
+		Memory.totalAllocation/(1024*1024), Memory.CommittedBytes()/(1024*1024));
 
 	InputMap inputMap;
 	inputMap.keys[GameActionTypeMoveUp]     = SDL_SCANCODE_W;
@@ -397,6 +493,7 @@ int main(int argc, char* argv[])
 	bool Running = true;
 	while (Running)
 	{
+		Memory.scratch.Reset();
 #ifdef DEBUG
 		Debug.TextBuffer.Clear();
 		Debug.LineBuffer.Clear();
@@ -480,6 +577,46 @@ int main(int argc, char* argv[])
                         case SDL_SCANCODE_K:
                             Debug.DebugPlayerCollision = !Debug.DebugPlayerCollision;
                             break;
+                        case SDL_SCANCODE_M:
+                            Debug.DebugMemoryStats = !Debug.DebugMemoryStats;
+                            break;
+                        case SDL_SCANCODE_N:
+                            WriteMemoryReport(Memory, MEMORY_REPORT_FILEPATH, levelFilepath);
+                            break;
+                        case SDL_SCANCODE_L:
+                        {
+                            //reloading over and over should leave the memory usage flat
+                            EndLevelStreaming(Streamer);
+                            UnloadLevel(gameState.level, Memory);
+                            levelData = LoadLevelData(levelFilepath, Memory);
+                            SetupLevel(Streamer, gameState.level, levelData, NodePalette, GeometryRenderBuffer, Memory, Jobs,
+                                Memory.transforms.block[gameState.entityManager.playerEntity].position, streamRadius,
+                                levelCache ? levelCacheFilepath : NULL);
+                            break;
+                        }
+                        case SDL_SCANCODE_E:
+                        {
+                            //flips the node under the player between empty and the first node type
+                            vec3f playerPos = Memory.transforms.block[gameState.entityManager.playerEntity].position;
+                            vec3i node = LevelCellThreeDIndexFromPosition(playerPos - vec3f(0.0f, CELL_SIZE, 0.0f));
+                            if (node.x < 0 || node.y < 0 || node.z < 0) break;
+                            if (!LevelStreamingCanEdit(Streamer, gameState.level, node.x, node.z)) break;
+
+                            Timer editTimer;
+                            editTimer.Mark();
+                            GeometryNode value = {0};
+                            if ((uint32)node.x < levelData.width && (uint32)node.y < levelData.height &&
+                                (uint32)node.z < levelData.width)
+                                value.type = levelData.nodes[LinearIndex(node.x, node.y, node.z, levelData.width)].type ? 0 : 1;
+                            if (SetLevelNode(gameState.level, levelData, Memory, node.x, node.y, node.z, value, GeometryRenderBuffer))
+                            {
+                                MarkLevelCacheStale(Streamer.cache, GeometryRenderBuffer);
+                                uint32 chunkCount = UpdateDirtyGeometryChunks(gameState.level, NodePalette, GeometryRenderBuffer, Jobs);
+                                LOG_INFO("Node edit took %f ms (%u chunks re-meshed)\n",
+                                    editTimer.ElapsedTime().count()*1000.0, chunkCount);
+                            }
+                            break;
+                        }
                         case SDL_SCANCODE_LEFTBRACKET:
                             gameState.timeScale *= 0.5f;
                             break;
@@ -559,6 +696,10 @@ int main(int argc, char* argv[])
         mat4f cameraTransform = glm::identity<mat4f>();
         TRS(cameraTransform, transforms[gameState.entityManager.cameraEntity]);
 
+        UpdateLevelStreaming(Streamer, gameState.level, GeometryRenderBuffer, Memory, vec3f(cameraTransform[3]));
+        UpdateGeometryLevelOfDetail(GeometryRenderBuffer, gameState.level, vec3f(cameraTransform[3]),
+            cameraProjection[1][1]*gameState.application.windowHeight*0.5f);
+
         //hacky way to move light matrix to fit screen
         //TODO: find better way to fit light matrix to scene
 		directionalLightTransform[3] = -cameraTransform[3]+mainLightToCameraOffset;
@@ -566,14 +707,15 @@ int main(int argc, char* argv[])
         //Setup camera matrices
 		cameraData.cameraViewProjection = cameraProjection * glm::inverse(cameraTransform);
 		cameraData.mainLightViewProjection = directionalLightProjection * directionalLightTransform;
-		SetUniformBufferData(CameraBuffer, sizeof(CameraData), (const void*)(&cameraData));
+		SetStreamUniformData(FrameStream, CAMERA_BUFFER_BINDING, (const void*)(&cameraData), sizeof(CameraData));
 
 		environmentData.viewPosition = cameraTransform[3];
-		SetUniformBufferData(EnvironmentBuffer, sizeof(EnvironmentData), (const void*)(&environmentData));
+		SetStreamUniformData(FrameStream, ENVIRONMENT_BUFFER_BINDING, (const void*)(&environmentData),
+			sizeof(EnvironmentData));
 
-        RenderEntity* renderEntities = &gameState.entityManager.renderEntities[0];
+        EntityStorage<RenderEntityChunk>& renderEntities = gameState.entityManager.renderEntities;
+        uint32 renderChunkCount = renderEntities.ChunksInUse();
         mat4f finalTransform;
-        uint32 count = gameState.entityManager.renderEntityCount;
 
         //-------------SHADOW PASS-------------------------
 		glBindVertexArray(meshVAO);
@@ -587,19 +729,37 @@ int main(int argc, char* argv[])
 		glUniformMatrix4fv(lightVPShaderLocation, 1, GL_FALSE,
 			 glm::value_ptr(cameraData.mainLightViewProjection));
 
-		SetShaderModelMatrix(ObjectBuffer, glm::identity<mat4f>());
+		SetShaderModelMatrix(FrameStream, glm::identity<mat4f>());
+		if (GeometryRenderBuffer.packedVertices)
+		{
+			glBindVertexArray(packedMeshVAO);
+			glUseProgram(shadowPassPackedShader);
+			glUniformMatrix4fv(packedLightVPShaderLocation, 1, GL_FALSE,
+				 glm::value_ptr(cameraData.mainLightViewProjection));
+		}
 		for (int i = 0; i < MAX_NODE_TYPES; i++)
 		{
 			if (gameState.level.nodeTypeGeometyBufferMap[i] < 0) continue;
-			DrawCall(GeometryRenderBuffer.handles[i]);
+			DrawGeometryType(GeometryRenderBuffer, i);
+		}
+		if (GeometryRenderBuffer.packedVertices)
+		{
+			glBindVertexArray(meshVAO);
+			glUseProgram(shadowPassShader);
 		}
 
-        for (uint32 i = 0; i < count; i++)
+        for (uint32 c = 0; c < renderChunkCount; c++)
         {
-            finalTransform = glm::identity<mat4f>();
-            TRS(finalTransform, transforms[renderEntities[i].transformIndex]);
-    		SetShaderModelMatrix(ObjectBuffer, finalTransform);
-    		DrawCall(meshBuffers[renderEntities[i].meshBufferIndex]);
+            const uint32* transformIndex = renderEntities.chunks[c].transformIndex;
+            const uint32* meshBufferIndex = renderEntities.chunks[c].meshBufferIndex;
+            uint32 count = renderEntities.CountInChunk(c);
+            for (uint32 i = 0; i < count; i++)
+            {
+                finalTransform = glm::identity<mat4f>();
+                TRS(finalTransform, transforms[transformIndex[i]]);
+        		SetShaderModelMatrix(FrameStream, finalTransform);
+        		DrawCall(meshBuffers[meshBufferIndex[i]]);
+            }
         }
 
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -611,27 +771,37 @@ int main(int argc, char* argv[])
 		//------------END SHADOW PASS------------------
 
 		//---------------MAIN PASS----------------------
-		SetShaderModelMatrix(ObjectBuffer, glm::identity<mat4f>());
+		SetShaderModelMatrix(FrameStream, glm::identity<mat4f>());
+		if (GeometryRenderBuffer.packedVertices)
+			glBindVertexArray(packedMeshVAO);
 		for (int i = 0; i < MAX_NODE_TYPES; i++)
 		{
 			if (gameState.level.nodeTypeGeometyBufferMap[i] < 0) continue;
 
-			SetShader(materials[NodePalette.materials[i]], ShaderTable);
-			DrawCall(GeometryRenderBuffer.handles[i]);
+			SetShader(materials[NodePalette.materials[i]], ShaderTable, GeometryRenderBuffer.packedVertices);
+			DrawGeometryType(GeometryRenderBuffer, i);
 		}
+		glBindVertexArray(meshVAO);
 
 
-        for (uint32 i = 0; i < count; i++)
+        for (uint32 c = 0; c < renderChunkCount; c++)
         {
-            SetShader(materials[renderEntities[i].materialIndex], ShaderTable);
-            finalTransform = glm::identity<mat4f>();
-            TRS(finalTransform, transforms[renderEntities[i].transformIndex]);
-    		SetShaderModelMatrix(ObjectBuffer, finalTransform);
-    		DrawCall(meshBuffers[renderEntities[i].meshBufferIndex]);
+            const uint32* transformIndex = renderEntities.chunks[c].transformIndex;
+            const uint32* meshBufferIndex = renderEntities.chunks[c].meshBufferIndex;
+            const uint32* materialIndex = renderEntities.chunks[c].materialIndex;
+            uint32 count = renderEntities.CountInChunk(c);
+            for (uint32 i = 0; i < count; i++)
+            {
+                SetShader(materials[materialIndex[i]], ShaderTable);
+                finalTransform = glm::identity<mat4f>();
+                TRS(finalTransform, transforms[transformIndex[i]]);
+        		SetShaderModelMatrix(FrameStream, finalTransform);
+        		DrawCall(meshBuffers[meshBufferIndex[i]]);
+            }
         }
 
 		// SetShader(materials[playerRenderMesh->materialIndex], ShaderTable);
-		// SetShaderModelMatrix(ObjectBuffer, gameState.playerState.transform);
+		// SetShaderModelMatrix(FrameStream, gameState.playerState.transform);
 		// DrawCall(meshBuffers[playerRenderMesh->meshBufferIndex]);
 		//------------END MAIN PASS---------------
 
@@ -639,49 +809,62 @@ int main(int argc, char* argv[])
 		if (Debug.DebugShadowmap)
 		{
 			glUseProgram(debugShader);
-			DrawCall(meshBuffers[screenQuadBuffer]);
+			DrawCall(meshBuffers[screenQuadBuffer.index]);
 		}
 
-		std::string text = "FPS: " + std::to_string(fps);
+		char* text = Memory.scratch.Printf("FPS: %f", fps);
 		AddTextToQuadBuffer(text, vec2f(-.9f,.8f), 0.1f,Debug.FontAtlas,
                 gameState.application.aspectRatio, &Debug.TextBuffer);
 
-        text = "Time Scale: " + std::to_string(gameState.timeScale);
+        text = Memory.scratch.Printf("Time Scale: %f", gameState.timeScale);
 		AddTextToQuadBuffer(text, vec2f(-.9f,.7f), 0.1f,Debug.FontAtlas,
                 gameState.application.aspectRatio, &Debug.TextBuffer);
 
+		if (Debug.DebugMemoryStats)
+		{
+			AddMemoryStatsText(Memory, Debug, vec2f(-.9f,.5f), gameState.application.aspectRatio);
+		}
+
 		if (Debug.TextBuffer.count > 0)
 		{
 			glEnable(GL_BLEND);
 			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-			UploadQuadBuffer(Debug.TextBuffer);
+			UploadQuadBuffer(Debug.TextBuffer, FrameStream);
 			glUseProgram(Debug.TextShader);
 			BindTexture(Debug.FontAtlas.atlasTexture, 2);
-			DrawCall(Debug.TextBuffer.handle);
+			DrawQuadBuffer(Debug.TextBuffer);
 		}
 
         if (Debug.DebugColliders)
         {
     		vec3f colliderDebugColor = { 0,1,0 };
-    		for (uint32 indexX=0; indexX < gameState.level.width;  indexX++)
-    		for (uint32 indexY=1; indexY < gameState.level.height; indexY++)
-    		for (uint32 indexZ=0; indexZ < gameState.level.width;  indexZ++)
+    		const Level& level = gameState.level;
+    		//only chunks and cells with something in them, see Level::occupiedChunks
+    		for (uint32 indexY=1; indexY < level.height; indexY++)
+    		for (uint32 chunkX=0; chunkX < level.chunksPerRow; chunkX++)
+    		for (uint64 chunks = level.occupiedChunks[indexY][chunkX]; chunks != 0; chunks &= chunks-1)
     		{
-    			vec3f pos = vec3f(indexX,indexY,indexZ)*CELL_SIZE;
-    			NodeCell cell = gameState.level.cells[LinearIndex(
-                            indexX,indexY,indexZ,gameState.level.width)];
-
-    			for (byte q = 0; q < 4; q++)
+    			uint32 chunkZ = CountTrailingZeros(chunks);
+    			const LevelChunk& chunk = level.chunks[LevelChunkIndex(chunkX, indexY, chunkZ, level.chunksPerRow)];
+    			for (uint32 localX=0; localX < LEVEL_CHUNK_WIDTH; localX++)
+    			for (uint32 row = chunk.occupied[localX]; row != 0; row &= row-1)
     			{
-    				if (cell.types[q] != 0 && cell.shapes[q] != 0)
-                    {
-                        uint32 colIndex = GetColliderTableIndex(cell.shapes[q],q);
-                        Debug.LineBuffer.AddBox(COLLIDER_BOX_TABLE[colIndex],pos,
-                            COLLIDER_ROTATION_TABLE[colIndex],colliderDebugColor);
-                    }
+    				uint32 indexX = chunkX*LEVEL_CHUNK_WIDTH + localX;
+    				uint32 indexZ = chunkZ*LEVEL_CHUNK_WIDTH + CountTrailingZeros(row);
+    				vec3f pos = vec3f(indexX,indexY,indexZ)*CELL_SIZE;
+    				const NodeCell& cell = GetLevelCell(level, indexX, indexY, indexZ);
+
+    				for (byte q = 0; q < 4; q++)
+    				{
+    					if (CellType(cell, q) != 0 && CellShape(cell, q) != 0)
+                        {
+                            uint32 colIndex = GetColliderTableIndex(CellShape(cell, q),q);
+                            Debug.LineBuffer.AddBox(COLLIDER_BOX_TABLE[colIndex],pos,
+                                COLLIDER_ROTATION_TABLE[colIndex],colliderDebugColor);
+                        }
+    				}
     			}
-
     		}
         }
 
@@ -695,14 +878,13 @@ int main(int argc, char* argv[])
             glClear(GL_DEPTH_BUFFER_BIT);
 			glBindVertexArray(Debug.LineVAO);
 
-			UploadLineBuffer(Debug.LineBuffer);
-
 			glUseProgram(Debug.LineShader);
-			DrawLines(Debug.LineBuffer);
+			DrawLines(Debug.LineBuffer, FrameStream);
 		}
 #endif
 
 		SDL_GL_SwapWindow(gameState.application.window);
+		EndStreamBufferFrame(FrameStream);
 		gameState.deltaTime = (float32)timer.ElapsedTime().count();
 
 #ifdef DEBUG
@@ -718,10 +900,22 @@ int main(int argc, char* argv[])
 #endif
 	}
 
+	WriteMemoryReport(Memory, MEMORY_REPORT_FILEPATH, levelFilepath);
+
+	//the GL buffers have to go while the context is still around
+	ReleaseGeometryBuffer(GeometryRenderBuffer);
+	ReleaseMeshBuffer(axisBuffer, Memory);
+	ReleaseMeshBuffer(sphereBuffer, Memory);
+#ifdef DEBUG
+	ReleaseMeshBuffer(screenQuadBuffer, Memory);
+#endif
+
 	// Close and destroy the window
 	SDL_DestroyWindow(gameState.application.window);
 
 	// Clean up
+	StopLevelStreamer(Streamer);
+	StopJobSystem(Jobs);
 	SDL_Quit();
 
 	return 0;
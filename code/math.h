@@ -11,3 +11,11 @@ Rect operator+=(const Rect& A, const Rect& B)
     rect.right = A.right+B.right;
     return rect;
 }
+
+//Plain bit twiddling rather than POPCNT, which the x64 baseline the game is built for doesn't have
+inline uint32 CountBits(uint64 value)
+{
+    value = value - ((value >> 1) & 0x5555555555555555ull);
+    value = (value & 0x3333333333333333ull) + ((value >> 2) & 0x3333333333333333ull);
+    return (uint32)((((value + (value >> 4)) & 0x0F0F0F0F0F0F0F0Full) * 0x0101010101010101ull) >> 56);
+}
@@ -2,32 +2,198 @@
 
 #include "types.h"
 #include "log.h"
+#include <cstdarg>
+#include <vector>
+#include <atomic>
 
 const uint32 MAX_TRIS_PER_VERTEX = 10;
 const uint32 MESH_BLOCK_MAX_VERTS = 10000000u;
 const uint32 MESH_BLOCK_MAX_INDEX = MESH_BLOCK_MAX_VERTS*MAX_TRIS_PER_VERTEX*3;
-const uint32 GEO_MESH_MAX_VERTS = 65535;
-const uint32 GEO_MESH_MAX_INDEX = GEO_MESH_MAX_VERTS*MAX_TRIS_PER_VERTEX*3;
-const uint32 GEO_BLOCK_MAX_VERTS = GEO_MESH_MAX_VERTS*MAX_NODE_TYPES;
-const uint32 GEO_BLOCK_MAX_INDEX = GEO_MESH_MAX_INDEX*MAX_NODE_TYPES;
+//the biggest node set piece there's room for, LoadNodeSet leaves out anything bigger
+const uint32 NODE_PIECE_MAX_VERTS = 512;
+const uint32 NODE_PIECE_MAX_INDEX = 2048;
+//per node type per geometry chunk, enough for every quadrant of every cell in the column to be the biggest piece
+//plus the coarse mesh, which is a top and four sides per column of cells. That is only reserved, each staging mesh
+//has blocks of its own and commits pages as it fills (see GrowGeometryMesh). Past 65535 vertices the chunk's
+//indices go 32 bit
+const uint32 GEO_MESH_MAX_VERTS = (MAX_LEVEL_HEIGHT*4 + 1)*LEVEL_CHUNK_CELLS*NODE_PIECE_MAX_VERTS + LEVEL_CHUNK_CELLS*16;
+const uint32 GEO_MESH_MAX_INDEX = (MAX_LEVEL_HEIGHT*4 + 1)*LEVEL_CHUNK_CELLS*NODE_PIECE_MAX_INDEX + LEVEL_CHUNK_CELLS*24;
+//columns being streamed in at once, each one gets its own staging meshes next to the geometry buffer's
+const uint32 LEVEL_STREAM_SLOTS = 2;
+const uint32 GEO_STAGING_MESHES = MAX_NODE_TYPES*(GEO_MESH_STAGING_SETS + LEVEL_STREAM_SLOTS);
+//a uint32 per node set triangle per rotation, see NodeShape::occlusion
+const uint32 MAX_NODE_OCCLUSION_MASKS = 1u << 20;
 const uint32 MAX_SKINNED_VERTS = 1000000u;
 const uint32 MAX_SKINNED_INDEX = MAX_SKINNED_VERTS*MAX_TRIS_PER_VERTEX;
 
 const uint32 MAX_LEVEL_NODES = MAX_LEVEL_WIDTH*MAX_LEVEL_WIDTH*MAX_LEVEL_HEIGHT;
-const uint32 MAX_LEVEL_CELLS = MAX_LEVEL_NODES;
-const uint32 MAX_TRANSFORMS = 1000;
+//cells sit on the corners between nodes, so there is one more of them along x and z
+const uint32 MAX_LEVEL_CHUNKS_PER_ROW = (MAX_LEVEL_WIDTH+1 + LEVEL_CHUNK_WIDTH-1)/LEVEL_CHUNK_WIDTH;
+const uint32 MAX_GEOMETRY_CHUNKS = MAX_LEVEL_CHUNKS_PER_ROW*MAX_LEVEL_CHUNKS_PER_ROW;
+const uint32 MAX_LEVEL_CHUNKS = MAX_GEOMETRY_CHUNKS*MAX_LEVEL_HEIGHT;
+//render entities come in chunks of ENTITY_CHUNK_SIZE, see EntityStorage
+const uint32 ENTITY_CHUNK_SIZE = 1024;
+const uint32 MAX_ENTITY_CHUNKS = 1024;
+const uint32 MAX_ENTITIES = ENTITY_CHUNK_SIZE*MAX_ENTITY_CHUNKS;
 const uint32 MAX_TRANSFORM_HIERARCHY_NODES = 1000;
+//one for every render entity and every node of a transform hierarchy
+const uint32 MAX_TRANSFORMS = MAX_ENTITIES + MAX_TRANSFORM_HIERARCHY_NODES;
 const uint32 MAX_SOURCE_MESHES = 1000;
 const uint32 MAX_MATERIALS = 100;
+const uint32 SCRATCH_ARENA_SIZE = 1024u*1024u*1024u;
 
 
-//NOTE! this is a really crude way to allocate all necessary memory for the app but nothing will resize and so if the user decides to request
-// memory that can't fit into the block, invalid is sent back and the user has to account for that. Also this scheme is not very flexible
-// for adding new types that need to be heap allocated, since you have to set maximums for that and add it to the Allocate() function.
-// I'm thinking of converting all of these to std::vectors so that they can be contiguous as well as resizable. I also can make the allocate
-// function some sort of templated thing with variable types but need to research a good way to do that while keeping the structure pretty similar 
+const uint64 MEMORY_HUGE_PAGE_SIZE = 2*1024*1024;
+//NOTE: huge pages cut down on TLB misses when streaming through the big vertex/index blocks but they
+// round every commit up to 2MB, so they are off by default
+const bool MESH_BLOCKS_USE_HUGE_PAGES = false;
 
 
+//NOTE: every block gets its own reserved range of address space sized to its maximum, but pages are only committed
+// as RequestFromBlock advances through the block, so the commit charge and RSS follow what the game actually uses
+// instead of the worst case. Nothing will resize, so if the user requests memory that can't fit into the block,
+// invalid is sent back and the user has to account for that. There is an uncommitted guard page after every block
+// so running off the end of one faults immediately instead of silently stomping the next block.
+//
+//Blocks have a single owner and do no synchronisation of their own, the bump is just an add. The only records that
+// get requested and released from several threads at once are the level cells (streaming thread, loader jobs and
+// the main thread), those live in a ConcurrentMemoryPool that puts a spin lock around the pool.
+
+//Read only file mapped copy on write, so the data can be edited in place without the file ever changing
+struct MappedFile
+{
+    void* data;
+    uint64 size;
+#ifdef WINDOWS
+    HANDLE file;
+    HANDLE mapping;
+#endif
+};
+
+#ifdef WINDOWS
+inline uint64 PlatformPageSize()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+}
+
+inline void* PlatformReserveMemory(uint64 size, bool hugePages)
+{
+    //NOTE: real large pages on windows need SeLockMemoryPrivilege and have to be committed up front,
+    // so huge page mode here only means committing in huge page sized steps
+    return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+inline bool PlatformCommitMemory(void* address, uint64 size)
+{
+    return VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+}
+
+inline void PlatformDecommitMemory(void* address, uint64 size)
+{
+    VirtualFree(address, size, MEM_DECOMMIT);
+}
+
+inline bool PlatformMapFile(const char* filepath, MappedFile* mapped)
+{
+    *mapped = {};
+    mapped->file = CreateFileA(filepath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mapped->file == INVALID_HANDLE_VALUE)
+    {
+        mapped->file = NULL;
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(mapped->file, &size) && size.QuadPart > 0)
+    {
+        mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+        if (mapped->mapping != NULL)
+            mapped->data = MapViewOfFile(mapped->mapping, FILE_MAP_COPY, 0, 0, 0);
+    }
+
+    if (mapped->data == NULL)
+    {
+        if (mapped->mapping != NULL) CloseHandle(mapped->mapping);
+        CloseHandle(mapped->file);
+        *mapped = {};
+        return false;
+    }
+    mapped->size = (uint64)size.QuadPart;
+    return true;
+}
+
+inline void PlatformUnmapFile(MappedFile& mapped)
+{
+    if (mapped.data != NULL) UnmapViewOfFile(mapped.data);
+    if (mapped.mapping != NULL) CloseHandle(mapped.mapping);
+    if (mapped.file != NULL) CloseHandle(mapped.file);
+    mapped = {};
+}
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+inline uint64 PlatformPageSize()
+{
+    return (uint64)sysconf(_SC_PAGESIZE);
+}
+
+inline void* PlatformReserveMemory(uint64 size, bool hugePages)
+{
+    void* memory = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+    if (hugePages) madvise(memory, size, MADV_HUGEPAGE);
+#endif
+    return memory;
+}
+
+inline bool PlatformCommitMemory(void* address, uint64 size)
+{
+    return mprotect(address, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+inline void PlatformDecommitMemory(void* address, uint64 size)
+{
+    madvise(address, size, MADV_DONTNEED);
+    mprotect(address, size, PROT_NONE);
+}
+
+inline bool PlatformMapFile(const char* filepath, MappedFile* mapped)
+{
+    *mapped = {};
+    int file = open(filepath, O_RDONLY);
+    if (file < 0) return false;
+
+    //the mapping keeps its own reference to the file so it can be closed straight away
+    struct stat info;
+    void* data = MAP_FAILED;
+    if (fstat(file, &info) == 0 && info.st_size > 0)
+        data = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+    close(file);
+    if (data == MAP_FAILED) return false;
+
+    mapped->data = data;
+    mapped->size = (uint64)info.st_size;
+    return true;
+}
+
+inline void PlatformUnmapFile(MappedFile& mapped)
+{
+    if (mapped.data != NULL) munmap(mapped.data, (size_t)mapped.size);
+    mapped = {};
+}
+#endif
+
+inline uint64 AlignUp(uint64 value, uint64 alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
 
 template<typename T>
 struct MemoryRequest
@@ -35,6 +201,27 @@ struct MemoryRequest
     bool valid;
     T* memory;
     uint32 index;
+    uint32 generation;
+};
+
+struct PoolHandle
+{
+    uint32 index;
+    uint32 generation;
+};
+
+//Snapshot of how a block is being used, shown in the debug overlay and written out by WriteMemoryReport
+//so the MAX_* sizes above can be tuned per level
+struct MemoryBlockStats
+{
+    const char* name;
+    uint32 itemSize;
+    uint32 capacity;
+    uint32 used;
+    uint32 peak;
+    uint32 requestCount;
+    uint32 failedRequestCount;
+    uint64 committedBytes;
 };
 
 template<typename T>
@@ -43,133 +230,869 @@ struct MemoryBlock
     T* block;
     uint32 itemCapacity;
     uint32 itemIndexIntoBlock;
+    uint64 reservedBytes;
+    uint64 committedBytes;
+    uint64 commitGranularity;
+
+    uint32 peakItemIndex;
+    uint32 requestCount;
+    uint32 failedRequestCount;
+
+    //Returns the amount of address space reserved, including the guard page
+    uint64 Reserve(uint32 capacity, bool hugePages = false)
+    {
+        uint64 pageSize = PlatformPageSize();
+        commitGranularity = hugePages ? MEMORY_HUGE_PAGE_SIZE : pageSize;
+
+        itemCapacity = capacity;
+        itemIndexIntoBlock = 0;
+        committedBytes = 0;
+        peakItemIndex = 0;
+        requestCount = 0;
+        failedRequestCount = 0;
+        reservedBytes = AlignUp((uint64)capacity * sizeof(T), commitGranularity);
+
+        block = (T*)PlatformReserveMemory(reservedBytes + pageSize, hugePages);
+        ASSERT((block != NULL), __FILE__, __LINE__);
+        if (block == NULL)
+        {
+            LOG_ERROR("Failed to reserve %llu bytes of address space!\n", reservedBytes);
+            itemCapacity = 0;
+            reservedBytes = 0;
+            return 0;
+        }
+
+        return reservedBytes + pageSize;
+    }
+
+    //Makes sure the pages backing the first itemCount items are committed
+    bool Commit(uint32 itemCount)
+    {
+        uint64 requiredBytes = (uint64)itemCount * sizeof(T);
+        if (requiredBytes <= committedBytes) return true;
+
+        uint64 newCommittedBytes = AlignUp(requiredBytes, commitGranularity);
+        if (newCommittedBytes > reservedBytes) newCommittedBytes = reservedBytes;
+
+        if (!PlatformCommitMemory((byte*)block + committedBytes, newCommittedBytes - committedBytes))
+        {
+            LOG_ERROR("Failed to commit memory! (%llu bytes)\n", newCommittedBytes - committedBytes);
+            return false;
+        }
+        committedBytes = newCommittedBytes;
+        return true;
+    }
 
     bool CanFit(uint32 amountOfItems)
     {
-        return itemIndexIntoBlock + amountOfItems < itemCapacity;
+        return (uint64)itemIndexIntoBlock + amountOfItems <= itemCapacity;
     }
 
     MemoryRequest<T> RequestFromBlock(uint32 amountOfItems)
     {
         MemoryRequest<T> request;
-        request.valid = CanFit(amountOfItems);
-        
+        request.generation = 0;
+        request.valid = CanFit(amountOfItems) && Commit(itemIndexIntoBlock + amountOfItems);
+
         request.memory = block+itemIndexIntoBlock;
         request.index = itemIndexIntoBlock;
 
-        if (request.valid) 
+        requestCount++;
+        if (request.valid)
             itemIndexIntoBlock += amountOfItems;
-    
+        else
+            failedRequestCount++;
+
         return request;
     }
+
+    MemoryBlockStats Stats(const char* name)
+    {
+        MemoryBlockStats stats;
+        stats.name = name;
+        stats.itemSize = sizeof(T);
+        stats.capacity = itemCapacity;
+        stats.used = itemIndexIntoBlock;
+        stats.peak = glm::max(peakItemIndex, glm::min(stats.used, itemCapacity));
+        stats.requestCount = requestCount;
+        stats.failedRequestCount = failedRequestCount;
+        stats.committedBytes = committedBytes;
+        return stats;
+    }
+
+    //The peak is only recorded when the end is about to move back, that keeps it off the request path
+    void RecordPeak()
+    {
+        peakItemIndex = glm::max(peakItemIndex, glm::min(itemIndexIntoBlock, itemCapacity));
+    }
+
+    //Hands the pages past the end of the used items back to the OS
+    void Trim()
+    {
+        uint64 usedBytes = AlignUp((uint64)itemIndexIntoBlock * sizeof(T), commitGranularity);
+        if (usedBytes < committedBytes)
+        {
+            PlatformDecommitMemory((byte*)block + usedBytes, committedBytes - usedBytes);
+            committedBytes = usedBytes;
+        }
+    }
+
+    //Everything handed out is invalid afterwards
+    void Reset()
+    {
+        RecordPeak();
+        itemIndexIntoBlock = 0;
+        Trim();
+    }
+};
+
+//Fixed size records that can be released and reused in O(1). Every slot has a generation that gets bumped
+//when it is released so stale handles can be caught. Requests for more than one record still come off the
+//end of the block so they stay contiguous (ie transform hierarchies) and can be released record by record.
+template<typename T>
+struct MemoryPool : MemoryBlock<T>
+{
+    MemoryBlock<uint32> generations;
+    MemoryBlock<uint32> freeSlots;
+
+    uint64 Reserve(uint32 capacity)
+    {
+        uint64 reserved = MemoryBlock<T>::Reserve(capacity);
+        reserved += generations.Reserve(capacity);
+        reserved += freeSlots.Reserve(capacity);
+        return reserved;
+    }
+
+    bool CanFit(uint32 amountOfItems)
+    {
+        return (amountOfItems == 1 && freeSlots.itemIndexIntoBlock > 0) ||
+            MemoryBlock<T>::CanFit(amountOfItems);
+    }
+
+    MemoryRequest<T> RequestFromBlock(uint32 amountOfItems)
+    {
+        MemoryRequest<T> request;
+        if (amountOfItems == 1 && freeSlots.itemIndexIntoBlock > 0)
+        {
+            uint32 slot = freeSlots.block[--freeSlots.itemIndexIntoBlock];
+            request.valid = true;
+            request.index = slot;
+            request.generation = generations.block[slot];
+            request.memory = this->block + slot;
+            *request.memory = T();
+            this->requestCount++;
+            return request;
+        }
+
+        request = MemoryBlock<T>::RequestFromBlock(amountOfItems);
+        //NOTE: generations are indexed the same as the items, so just commit up to the same point.
+        // freshly committed pages come back zeroed so new slots start at generation 0, slots handed out again
+        // after a Reset carry on from the generation Reset left them at
+        if (request.valid && !generations.Commit(request.index + amountOfItems))
+            request.valid = false;
+        if (request.valid)
+            request.generation = generations.block[request.index];
+        return request;
+    }
+
+    PoolHandle HandleAt(uint32 index)
+    {
+        PoolHandle handle = { index, generations.block[index] };
+        return handle;
+    }
+
+    bool IsValid(PoolHandle handle)
+    {
+        return handle.index < this->itemIndexIntoBlock &&
+            handle.index < this->itemCapacity && generations.block[handle.index] == handle.generation;
+    }
+
+    T* Get(PoolHandle handle)
+    {
+        return IsValid(handle) ? this->block + handle.index : NULL;
+    }
+
+    void Release(PoolHandle handle)
+    {
+        bool valid = IsValid(handle);
+        ASSERT(valid, __FILE__, __LINE__);
+        if (!valid) return;
+
+        generations.block[handle.index]++;
+        auto request = freeSlots.RequestFromBlock(1);
+        *request.memory = handle.index;
+    }
+
+    //The free list goes too since every slot is handed back at once. Every slot that was in use gets its generation
+    //bumped as if it was released, so no handle from before the Reset is valid after it
+    void Reset()
+    {
+        for (uint32 i = 0; i < this->itemIndexIntoBlock; i++)
+            generations.block[i]++;
+        MemoryBlock<T>::Reset();
+        freeSlots.Reset();
+    }
+
+    uint32 LiveCount()
+    {
+        return this->itemIndexIntoBlock - freeSlots.itemIndexIntoBlock;
+    }
+
+    MemoryBlockStats Stats(const char* name)
+    {
+        MemoryBlockStats stats = MemoryBlock<T>::Stats(name);
+        stats.used = LiveCount();
+        stats.committedBytes += generations.committedBytes + freeSlots.committedBytes;
+        return stats;
+    }
+};
+
+//Adds up blocks that are used the same way (ie one per staging mesh) so they show up as one
+template<typename T>
+MemoryBlockStats CombinedStats(MemoryBlock<T>* blocks, uint32 count, const char* name)
+{
+    MemoryBlockStats stats = blocks[0].Stats(name);
+    for (uint32 i = 1; i < count; i++)
+    {
+        MemoryBlockStats block = blocks[i].Stats(name);
+        stats.capacity += block.capacity;
+        stats.used += block.used;
+        stats.peak += block.peak;
+        stats.requestCount += block.requestCount;
+        stats.failedRequestCount += block.failedRequestCount;
+        stats.committedBytes += block.committedBytes;
+    }
+    return stats;
+}
+
+//MemoryPool with every call behind one spin lock, for records that are requested and released from
+//several threads at once. Requests are rare and short so the lock is uncontended nearly all the time.
+template<typename T>
+struct ConcurrentMemoryPool
+{
+    MemoryPool<T> pool;
+    SDL_SpinLock lock;
+
+    uint64 Reserve(uint32 capacity)
+    {
+        lock = 0;
+        return pool.Reserve(capacity);
+    }
+
+    MemoryRequest<T> RequestFromBlock(uint32 amountOfItems)
+    {
+        SDL_AtomicLock(&lock);
+        MemoryRequest<T> request = pool.RequestFromBlock(amountOfItems);
+        SDL_AtomicUnlock(&lock);
+        return request;
+    }
+
+    PoolHandle HandleAt(uint32 index)
+    {
+        SDL_AtomicLock(&lock);
+        PoolHandle handle = pool.HandleAt(index);
+        SDL_AtomicUnlock(&lock);
+        return handle;
+    }
+
+    T* Get(PoolHandle handle)
+    {
+        SDL_AtomicLock(&lock);
+        T* item = pool.Get(handle);
+        SDL_AtomicUnlock(&lock);
+        return item;
+    }
+
+    void Release(PoolHandle handle)
+    {
+        SDL_AtomicLock(&lock);
+        pool.Release(handle);
+        SDL_AtomicUnlock(&lock);
+    }
+
+    void Reset()
+    {
+        SDL_AtomicLock(&lock);
+        pool.Reset();
+        SDL_AtomicUnlock(&lock);
+    }
+
+    MemoryBlockStats Stats(const char* name)
+    {
+        SDL_AtomicLock(&lock);
+        MemoryBlockStats stats = pool.Stats(name);
+        SDL_AtomicUnlock(&lock);
+        return stats;
+    }
+};
+
+struct MemoryRange
+{
+    uint32 start;
+    uint32 count;
+};
+
+//Describes live items that Compact() slid down from oldStart to newStart
+struct MemoryRangeMove
+{
+    uint32 oldStart;
+    uint32 newStart;
+    uint32 count;
+};
+
+template<typename T>
+inline void RelocatePointer(T*& pointer, T* block, const MemoryRangeMove* moves, uint32 moveCount)
+{
+    if (pointer == NULL) return;
+    uint32 index = (uint32)(pointer - block);
+    for (uint32 i = 0; i < moveCount; i++)
+    {
+        if (index >= moves[i].oldStart && index < moves[i].oldStart + moves[i].count)
+        {
+            pointer = block + moves[i].newStart + (index - moves[i].oldStart);
+            return;
+        }
+    }
+}
+
+const uint32 MAX_FREE_RANGES = 1024;
+
+//Variable sized ranges (mesh vertices and indices) that can be released. Released ranges are kept sorted
+//and coalesced with their neighbours and get reused first fit, a range that ends up touching the end
+//of the block just pulls the end back. Compact() slides everything down to close the holes.
+template<typename T>
+struct MemoryRangeBlock : MemoryBlock<T>
+{
+    MemoryRange freeRanges[MAX_FREE_RANGES];
+    uint32 freeRangeCount;
+
+    uint64 Reserve(uint32 capacity, bool hugePages = false)
+    {
+        freeRangeCount = 0;
+        return MemoryBlock<T>::Reserve(capacity, hugePages);
+    }
+
+    bool CanFit(uint32 amountOfItems)
+    {
+        for (uint32 i = 0; i < freeRangeCount; i++)
+            if (freeRanges[i].count >= amountOfItems) return true;
+
+        return MemoryBlock<T>::CanFit(amountOfItems);
+    }
+
+    MemoryRequest<T> RequestFromBlock(uint32 amountOfItems)
+    {
+        for (uint32 i = 0; i < freeRangeCount; i++)
+        {
+            MemoryRange& range = freeRanges[i];
+            if (range.count < amountOfItems) continue;
+
+            MemoryRequest<T> request;
+            request.valid = true;
+            request.index = range.start;
+            request.memory = this->block + range.start;
+            request.generation = 0;
+            this->requestCount++;
+
+            range.start += amountOfItems;
+            range.count -= amountOfItems;
+            if (range.count == 0)
+            {
+                freeRangeCount--;
+                SDL_memmove(&freeRanges[i], &freeRanges[i+1], (freeRangeCount-i)*sizeof(MemoryRange));
+            }
+            return request;
+        }
+
+        return MemoryBlock<T>::RequestFromBlock(amountOfItems);
+    }
+
+    void Release(uint32 index, uint32 amountOfItems)
+    {
+        if (amountOfItems == 0) return;
+        ASSERT((index + amountOfItems <= this->itemIndexIntoBlock), __FILE__, __LINE__);
+
+        uint32 insert = 0;
+        while (insert < freeRangeCount && freeRanges[insert].start < index) insert++;
+
+        bool mergePrev = insert > 0 && freeRanges[insert-1].start + freeRanges[insert-1].count == index;
+        bool mergeNext = insert < freeRangeCount && index + amountOfItems == freeRanges[insert].start;
+
+        if (mergePrev && mergeNext)
+        {
+            freeRanges[insert-1].count += amountOfItems + freeRanges[insert].count;
+            freeRangeCount--;
+            SDL_memmove(&freeRanges[insert], &freeRanges[insert+1], (freeRangeCount-insert)*sizeof(MemoryRange));
+            insert--;
+        }
+        else if (mergePrev)
+        {
+            freeRanges[insert-1].count += amountOfItems;
+            insert--;
+        }
+        else if (mergeNext)
+        {
+            freeRanges[insert].start = index;
+            freeRanges[insert].count += amountOfItems;
+        }
+        else
+        {
+            ASSERT((freeRangeCount < MAX_FREE_RANGES), __FILE__, __LINE__);
+            if (freeRangeCount >= MAX_FREE_RANGES)
+            {
+                LOG_WARN("Out of free ranges, leaking %u items until the next Compact()\n", amountOfItems);
+                return;
+            }
+            SDL_memmove(&freeRanges[insert+1], &freeRanges[insert], (freeRangeCount-insert)*sizeof(MemoryRange));
+            freeRanges[insert].start = index;
+            freeRanges[insert].count = amountOfItems;
+            freeRangeCount++;
+        }
+
+        //a free range at the very end just gives the space back to the bump allocator
+        MemoryRange& range = freeRanges[insert];
+        if (range.start + range.count == this->itemIndexIntoBlock)
+        {
+            this->RecordPeak();
+            this->itemIndexIntoBlock = range.start;
+            freeRangeCount--;
+        }
+    }
+
+    //Slides every live range down over the holes. moves needs room for freeRangeCount entries,
+    //owners of pointers into the block have to patch them up with RelocatePointer afterwards.
+    uint32 Compact(MemoryRangeMove* moves)
+    {
+        uint32 moveCount = 0;
+        uint32 writeIndex = freeRangeCount > 0 ? freeRanges[0].start : this->itemIndexIntoBlock;
+        for (uint32 i = 0; i < freeRangeCount; i++)
+        {
+            uint32 liveStart = freeRanges[i].start + freeRanges[i].count;
+            uint32 liveEnd = i+1 < freeRangeCount ? freeRanges[i+1].start : this->itemIndexIntoBlock;
+            uint32 liveCount = liveEnd - liveStart;
+            if (liveCount == 0) continue;
+
+            SDL_memmove(this->block + writeIndex, this->block + liveStart, liveCount*sizeof(T));
+            moves[moveCount].oldStart = liveStart;
+            moves[moveCount].newStart = writeIndex;
+            moves[moveCount].count = liveCount;
+            moveCount++;
+            writeIndex += liveCount;
+        }
+
+        this->RecordPeak();
+        this->itemIndexIntoBlock = writeIndex;
+        freeRangeCount = 0;
+        this->Trim();
+        return moveCount;
+    }
+
+    MemoryBlockStats Stats(const char* name)
+    {
+        MemoryBlockStats stats = MemoryBlock<T>::Stats(name);
+        for (uint32 i = 0; i < freeRangeCount; i++)
+            stats.used -= freeRanges[i].count;
+        return stats;
+    }
 };
 
+typedef uint32 ScratchMarker;
+
+//Linear allocator for anything that only has to live for a frame or for the duration of a load.
+//Grab a marker before pushing and pop back to it when done, the whole arena is reset at the top of every frame.
+struct ScratchArena
+{
+    MemoryBlock<byte> memory;
+
+    void* Push(uint64 size, uint64 alignment = 16)
+    {
+        uint32 start = (uint32)AlignUp(memory.itemIndexIntoBlock, alignment);
+        uint32 padding = start - memory.itemIndexIntoBlock;
+        auto request = memory.RequestFromBlock(padding + (uint32)size);
+        ASSERT(request.valid, __FILE__, __LINE__);
+        if (!request.valid) return NULL;
+
+        return request.memory + padding;
+    }
+
+    template<typename T>
+    T* PushArray(uint32 count)
+    {
+        return (T*)Push(count*sizeof(T), alignof(T));
+    }
+
+    //Formats into the arena so debug text doesn't need a std::string every frame
+    char* Printf(const char* format, ...)
+    {
+        va_list args;
+        va_start(args, format);
+        int length = SDL_vsnprintf(NULL, 0, format, args);
+        va_end(args);
+
+        char* text = (char*)Push(length+1, 1);
+        if (text == NULL) return NULL;
+
+        va_start(args, format);
+        SDL_vsnprintf(text, length+1, format, args);
+        va_end(args);
+        return text;
+    }
+
+    ScratchMarker GetMarker()
+    {
+        return memory.itemIndexIntoBlock;
+    }
+
+    void PopToMarker(ScratchMarker marker)
+    {
+        ASSERT((marker <= memory.itemIndexIntoBlock), __FILE__, __LINE__);
+        memory.RecordPeak();
+        memory.itemIndexIntoBlock = marker;
+    }
+
+    void Reset()
+    {
+        memory.RecordPeak();
+        memory.itemIndexIntoBlock = 0;
+    }
+};
+
+//Lets std containers live in a ScratchArena, deallocate does nothing since the memory
+//goes away when the arena is popped or reset
+template<typename T>
+struct ScratchAllocator
+{
+    typedef T value_type;
+    ScratchArena* arena;
+
+    ScratchAllocator(ScratchArena* arena) : arena(arena) {}
+
+    template<typename U>
+    ScratchAllocator(const ScratchAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t count)
+    {
+        return (T*)arena->Push(count*sizeof(T), alignof(T));
+    }
+
+    void deallocate(T* memory, size_t count) {}
+};
+
+template<typename T, typename U>
+bool operator==(const ScratchAllocator<T>& a, const ScratchAllocator<U>& b) { return a.arena == b.arena; }
+template<typename T, typename U>
+bool operator!=(const ScratchAllocator<T>& a, const ScratchAllocator<U>& b) { return a.arena != b.arena; }
+
+template<typename T>
+using ScratchVector = std::vector<T, ScratchAllocator<T>>;
+
+//Worker threads point this at an arena of their own, loaders running on them then won't share
+//the main thread's scratch (see GameMemory::ThreadScratch)
+thread_local ScratchArena* ThreadScratchArena = NULL;
+
+typedef uint32 EntityId;
+const uint32 ENTITY_ID_FREE = 0x80000000u;
+
+//Render entities are stored structure of arrays in fixed size chunks, so the render loops walk contiguous
+//columns and only touch the ones they need. Chunks are committed from a GameMemory block as the entity count grows
+//and never move, removing swaps the last entity into the hole to keep them dense. Ids stay valid across the swaps.
+struct RenderEntityChunk
+{
+    uint32 transformIndex[ENTITY_CHUNK_SIZE];
+    uint32 meshBufferIndex[ENTITY_CHUNK_SIZE];
+    uint32 materialIndex[ENTITY_CHUNK_SIZE];
+    EntityId entityId[ENTITY_CHUNK_SIZE];
+
+    void Move(uint32 to, const RenderEntityChunk* from, uint32 fromIndex)
+    {
+        transformIndex[to]  = from->transformIndex[fromIndex];
+        meshBufferIndex[to] = from->meshBufferIndex[fromIndex];
+        materialIndex[to]   = from->materialIndex[fromIndex];
+        entityId[to]        = from->entityId[fromIndex];
+    }
+};
+
+struct SkinnedRenderEntityChunk
+{
+    TransformHierarchy transformHierarchy[ENTITY_CHUNK_SIZE];
+    uint32 meshHandleIndex[ENTITY_CHUNK_SIZE];
+    uint32 materialIndex[ENTITY_CHUNK_SIZE];
+    EntityId entityId[ENTITY_CHUNK_SIZE];
+
+    void Move(uint32 to, const SkinnedRenderEntityChunk* from, uint32 fromIndex)
+    {
+        transformHierarchy[to] = from->transformHierarchy[fromIndex];
+        meshHandleIndex[to]    = from->meshHandleIndex[fromIndex];
+        materialIndex[to]      = from->materialIndex[fromIndex];
+        entityId[to]           = from->entityId[fromIndex];
+    }
+};
+
+template<typename Chunk>
+struct EntityStorage
+{
+    //the chunks follow each other in chunkBlock, chunk c is chunks[c]
+    MemoryBlock<Chunk>* chunkBlock;
+    Chunk* chunks;
+    //id -> dense index, free ids are chained through their slots with ENTITY_ID_FREE set
+    MemoryBlock<uint32>* idBlock;
+    uint32* sparse;
+    uint32 count;
+    uint32 chunkCount;
+    uint32 idCount;
+    uint32 freeIdHead;
+
+    //Everything that was in the blocks before is gone afterwards
+    void Init(MemoryBlock<Chunk>& entityChunkBlock, MemoryBlock<uint32>& entityIdBlock)
+    {
+        chunkBlock = &entityChunkBlock;
+        idBlock = &entityIdBlock;
+        chunkBlock->Reset();
+        idBlock->Reset();
+        chunks = chunkBlock->block;
+        sparse = idBlock->block;
+        count = 0;
+        chunkCount = 0;
+        idCount = 0;
+        freeIdHead = ENTITY_ID_FREE;
+    }
+
+    uint32& SparseSlot(EntityId id)
+    {
+        return sparse[id];
+    }
+
+    bool IsValid(EntityId id)
+    {
+        return id < idCount && !(SparseSlot(id) & ENTITY_ID_FREE);
+    }
+
+    //Adds an entity at the end of the dense range, the caller fills in the columns at chunk/index
+    bool Create(EntityId* id, Chunk** chunk, uint32* index)
+    {
+        if (count == chunkCount*ENTITY_CHUNK_SIZE)
+        {
+            ASSERT(chunkBlock->CanFit(1), __FILE__, __LINE__);
+            if (!chunkBlock->RequestFromBlock(1).valid) return false;
+            chunkCount++;
+        }
+
+        EntityId newId;
+        if (freeIdHead != ENTITY_ID_FREE)
+        {
+            newId = freeIdHead;
+            freeIdHead = SparseSlot(newId) & ~ENTITY_ID_FREE;
+        }
+        else
+        {
+            if (!idBlock->RequestFromBlock(1).valid) return false;
+            newId = idCount++;
+        }
+
+        uint32 dense = count++;
+        SparseSlot(newId) = dense;
+        *chunk = &chunks[dense / ENTITY_CHUNK_SIZE];
+        *index = dense % ENTITY_CHUNK_SIZE;
+        (*chunk)->entityId[*index] = newId;
+        *id = newId;
+        return true;
+    }
+
+    void Remove(EntityId id)
+    {
+        ASSERT(IsValid(id), __FILE__, __LINE__);
+        if (!IsValid(id)) return;
+
+        uint32 dense = SparseSlot(id);
+        uint32 last = --count;
+        if (dense != last)
+        {
+            Chunk* lastChunk = &chunks[last / ENTITY_CHUNK_SIZE];
+            uint32 lastIndex = last % ENTITY_CHUNK_SIZE;
+            chunks[dense / ENTITY_CHUNK_SIZE].Move(dense % ENTITY_CHUNK_SIZE, lastChunk, lastIndex);
+            SparseSlot(lastChunk->entityId[lastIndex]) = dense;
+        }
+
+        SparseSlot(id) = freeIdHead | ENTITY_ID_FREE;
+        freeIdHead = id;
+    }
+
+    Chunk* Lookup(EntityId id, uint32* index)
+    {
+        if (!IsValid(id)) return NULL;
+        uint32 dense = SparseSlot(id);
+        *index = dense % ENTITY_CHUNK_SIZE;
+        return &chunks[dense / ENTITY_CHUNK_SIZE];
+    }
+
+    //Number of live entities in chunk c, every chunk but the last one in use is full
+    uint32 CountInChunk(uint32 c)
+    {
+        uint32 start = c*ENTITY_CHUNK_SIZE;
+        return count <= start ? 0 : glm::min(count - start, ENTITY_CHUNK_SIZE);
+    }
+
+    uint32 ChunksInUse()
+    {
+        return (count + ENTITY_CHUNK_SIZE - 1) / ENTITY_CHUNK_SIZE;
+    }
+};
+
+const uint32 MEMORY_BLOCK_COUNT = 20;
 struct GameMemory
 {
     uint64 totalAllocation;
-    void* memory;
 
-    MemoryBlock<Vertex> meshVertexBlock;
-    MemoryBlock<uint16> meshIndexBlock;
-    MemoryBlock<Vertex> geometryMeshVertexBlock;
-    MemoryBlock<uint16> geometryMeshIndexBlock;
+    MemoryRangeBlock<Vertex> meshVertexBlock;
+    MemoryRangeBlock<uint16> meshIndexBlock;
+    MemoryRangeBlock<uint32> nodeOcclusionBlock;
+    //the geometry buffer's staging sets first, then the streaming slots'
+    MemoryBlock<Vertex> geometryMeshVertexBlocks[GEO_STAGING_MESHES];
+    MemoryBlock<uint32> geometryMeshIndexBlocks[GEO_STAGING_MESHES];
     MemoryBlock<SkinnedVertex> skinnedMeshVertexBlock;
     MemoryBlock<uint16> skinnedMeshIndexBlock;
     MemoryBlock<GeometryNode> levelNodeBlock;
-    MemoryBlock<NodeCell> levelCellBlock;
-    MemoryBlock<Transform> transforms;
+    MemoryBlock<LevelChunk> levelChunkBlock;
+    ConcurrentMemoryPool<LevelChunkCells> levelChunkCellPool;
+    MappedFile levelFile; //backs levelData.nodes for binary levels instead of levelNodeBlock
+    MemoryBlock<GeometryChunk> geometryChunkBlock;
+    MemoryPool<Transform> transforms;
     MemoryBlock<TransformHierarchyNode> transformHierarchyNodes;
-    MemoryBlock<Material> materials;
-    MemoryBlock<MeshBufferHandle> meshBufferHandles;
+    MemoryPool<Material> materials;
+    MemoryPool<MeshBufferHandle> meshBufferHandles;
+    MemoryBlock<RenderEntityChunk> renderEntityChunks;
+    MemoryBlock<uint32> renderEntityIds;
+    MemoryBlock<SkinnedRenderEntityChunk> skinnedRenderEntityChunks;
+    MemoryBlock<uint32> skinnedRenderEntityIds;
+    ScratchArena scratch;
 
     void Allocate()
     {
-        meshVertexBlock.itemCapacity = MESH_BLOCK_MAX_VERTS;
-        meshIndexBlock.itemCapacity  = MESH_BLOCK_MAX_INDEX;
-        geometryMeshVertexBlock.itemCapacity = GEO_BLOCK_MAX_VERTS;
-        geometryMeshIndexBlock.itemCapacity  = GEO_BLOCK_MAX_INDEX;
-        skinnedMeshVertexBlock.itemCapacity = MAX_SKINNED_VERTS;
-        skinnedMeshIndexBlock.itemCapacity = MAX_SKINNED_INDEX;
-        levelNodeBlock.itemCapacity  = MAX_LEVEL_NODES;
-        levelCellBlock.itemCapacity  = MAX_LEVEL_CELLS;
-        transforms.itemCapacity = MAX_TRANSFORMS;
-        transformHierarchyNodes.itemCapacity = MAX_TRANSFORM_HIERARCHY_NODES;
-        materials.itemCapacity = MAX_MATERIALS;
-        meshBufferHandles.itemCapacity = MAX_SOURCE_MESHES;
-
-        uint64 vertSize      = MESH_BLOCK_MAX_VERTS * sizeof(Vertex);
-        uint64 indexSize     = MESH_BLOCK_MAX_INDEX * sizeof(uint16);
-        uint64 geoVertSize   = GEO_BLOCK_MAX_VERTS * sizeof(Vertex);
-        uint64 geoIndexSize  = GEO_BLOCK_MAX_INDEX * sizeof(uint16);
-        uint64 skinVertSize  = MAX_SKINNED_VERTS * sizeof(SkinnedVertex);
-        uint64 skinIndexSize = MAX_SKINNED_INDEX * sizeof(uint16);
-        uint64 levelNodeSize = MAX_LEVEL_NODES * sizeof(GeometryNode);
-        uint64 levelCellSize = MAX_LEVEL_CELLS * sizeof(NodeCell);
-        uint64 transformSize = MAX_TRANSFORMS * sizeof(Transform);
-        uint64 transformHierarchyNodeSize = MAX_TRANSFORM_HIERARCHY_NODES * sizeof(TransformHierarchyNode);
-        uint64 materialSize = MAX_MATERIALS * sizeof(Material);
-        uint64 meshBufferHandleSize = MAX_SOURCE_MESHES * sizeof(MeshBufferHandle);
-        totalAllocation = vertSize + indexSize + geoVertSize +
-                geoIndexSize + skinVertSize + skinIndexSize + levelNodeSize +
-                levelCellSize + transformSize + transformHierarchyNodeSize +
-                materialSize + meshBufferHandleSize;
-
-        memory = SDL_malloc(totalAllocation);
-        byte* curByte = (byte*)memory;
-        meshVertexBlock.block = (Vertex*)curByte;
-        curByte += vertSize;
-        meshIndexBlock.block = (uint16*)curByte;
-        curByte += indexSize;
-        geometryMeshVertexBlock.block = (Vertex*)curByte;
-        curByte += geoVertSize;
-        geometryMeshIndexBlock.block = (uint16*)curByte;
-        curByte += geoIndexSize;
-        skinnedMeshVertexBlock.block = (SkinnedVertex*)curByte;
-        curByte += skinVertSize;
-        skinnedMeshIndexBlock.block = (uint16*)curByte;
-        curByte += skinIndexSize;
-        levelNodeBlock.block = (GeometryNode*)curByte;
-        curByte += levelNodeSize;
-        levelCellBlock.block = (NodeCell*)curByte;
-        curByte += levelCellSize;
-        transforms.block = (Transform*)curByte;
-        curByte += transformSize;
-        transformHierarchyNodes.block = (TransformHierarchyNode*)curByte;
-        curByte += transformHierarchyNodeSize;
-        materials.block = (Material*)curByte;
-        curByte += materialSize;
-        meshBufferHandles.block = (MeshBufferHandle*)curByte;
-        curByte += meshBufferHandleSize;
-    }
-};
-
-const uint32 MAX_RENDER_ENTITIES = 1000;
-const uint32 MAX_SKINNED_RENDER_ENTITIES = 100;
+        bool hugePages = MESH_BLOCKS_USE_HUGE_PAGES;
+
+        totalAllocation = 0;
+        levelFile = {};
+        totalAllocation += meshVertexBlock.Reserve(MESH_BLOCK_MAX_VERTS, hugePages);
+        totalAllocation += meshIndexBlock.Reserve(MESH_BLOCK_MAX_INDEX, hugePages);
+        totalAllocation += nodeOcclusionBlock.Reserve(MAX_NODE_OCCLUSION_MASKS);
+        for (uint32 i = 0; i < GEO_STAGING_MESHES; i++)
+        {
+            totalAllocation += geometryMeshVertexBlocks[i].Reserve(GEO_MESH_MAX_VERTS, hugePages);
+            totalAllocation += geometryMeshIndexBlocks[i].Reserve(GEO_MESH_MAX_INDEX, hugePages);
+        }
+        totalAllocation += skinnedMeshVertexBlock.Reserve(MAX_SKINNED_VERTS, hugePages);
+        totalAllocation += skinnedMeshIndexBlock.Reserve(MAX_SKINNED_INDEX, hugePages);
+        totalAllocation += levelNodeBlock.Reserve(MAX_LEVEL_NODES);
+        totalAllocation += levelChunkBlock.Reserve(MAX_LEVEL_CHUNKS);
+        totalAllocation += levelChunkCellPool.Reserve(MAX_LEVEL_CHUNKS);
+        totalAllocation += geometryChunkBlock.Reserve(MAX_GEOMETRY_CHUNKS);
+        totalAllocation += transforms.Reserve(MAX_TRANSFORMS);
+        totalAllocation += transformHierarchyNodes.Reserve(MAX_TRANSFORM_HIERARCHY_NODES);
+        totalAllocation += materials.Reserve(MAX_MATERIALS);
+        totalAllocation += meshBufferHandles.Reserve(MAX_SOURCE_MESHES);
+        totalAllocation += renderEntityChunks.Reserve(MAX_ENTITY_CHUNKS);
+        totalAllocation += renderEntityIds.Reserve(MAX_ENTITIES);
+        totalAllocation += skinnedRenderEntityChunks.Reserve(MAX_ENTITY_CHUNKS);
+        totalAllocation += skinnedRenderEntityIds.Reserve(MAX_ENTITIES);
+        totalAllocation += scratch.memory.Reserve(SCRATCH_ARENA_SIZE);
+    }
+
+    ScratchArena& ThreadScratch()
+    {
+        return ThreadScratchArena != NULL ? *ThreadScratchArena : scratch;
+    }
+
+    uint32 GatherStats(MemoryBlockStats* stats)
+    {
+        uint32 count = 0;
+        stats[count++] = meshVertexBlock.Stats("meshVertexBlock");
+        stats[count++] = meshIndexBlock.Stats("meshIndexBlock");
+        stats[count++] = nodeOcclusionBlock.Stats("nodeOcclusionBlock");
+        stats[count++] = CombinedStats(geometryMeshVertexBlocks, GEO_STAGING_MESHES, "geometryMeshVertexBlocks");
+        stats[count++] = CombinedStats(geometryMeshIndexBlocks, GEO_STAGING_MESHES, "geometryMeshIndexBlocks");
+        stats[count++] = skinnedMeshVertexBlock.Stats("skinnedMeshVertexBlock");
+        stats[count++] = skinnedMeshIndexBlock.Stats("skinnedMeshIndexBlock");
+        stats[count++] = levelNodeBlock.Stats("levelNodeBlock");
+        stats[count++] = levelChunkBlock.Stats("levelChunkBlock");
+        stats[count++] = levelChunkCellPool.Stats("levelChunkCellPool");
+        stats[count++] = geometryChunkBlock.Stats("geometryChunkBlock");
+        stats[count++] = transforms.Stats("transforms");
+        stats[count++] = transformHierarchyNodes.Stats("transformHierarchyNodes");
+        stats[count++] = materials.Stats("materials");
+        stats[count++] = meshBufferHandles.Stats("meshBufferHandles");
+        stats[count++] = renderEntityChunks.Stats("renderEntityChunks");
+        stats[count++] = renderEntityIds.Stats("renderEntityIds");
+        stats[count++] = skinnedRenderEntityChunks.Stats("skinnedRenderEntityChunks");
+        stats[count++] = skinnedRenderEntityIds.Stats("skinnedRenderEntityIds");
+        stats[count++] = scratch.memory.Stats("scratch");
+        ASSERT((count <= MEMORY_BLOCK_COUNT), __FILE__, __LINE__);
+        return count;
+    }
+
+    uint64 CommittedBytes()
+    {
+        MemoryBlockStats stats[MEMORY_BLOCK_COUNT];
+        uint32 count = GatherStats(stats);
+
+        uint64 committed = 0;
+        for (uint32 i = 0; i < count; i++)
+            committed += stats[i].committedBytes;
+        return committed;
+    }
+};
+
 struct EntityManager
 {
-    RenderEntity renderEntities[MAX_RENDER_ENTITIES];
-    SkinnedRenderEntity skinnedRenderEntities[MAX_SKINNED_RENDER_ENTITIES];
+    EntityStorage<RenderEntityChunk> renderEntities;
+    EntityStorage<SkinnedRenderEntityChunk> skinnedRenderEntities;
 
     uint32 playerEntity;
     uint32 cameraEntity;
 
-    uint32 renderEntityCount;
-    uint32 skinndedRenderEntityCount;
+    //Also empties out the entity blocks, so it's how the entities get dropped on a reload too
+    void Init(GameMemory& memory)
+    {
+        renderEntities.Init(memory.renderEntityChunks, memory.renderEntityIds);
+        skinnedRenderEntities.Init(memory.skinnedRenderEntityChunks, memory.skinnedRenderEntityIds);
+    }
+
+    EntityId CreateRenderEntity(uint32 transformIndex, uint32 meshBufferIndex, uint32 materialIndex)
+    {
+        EntityId id = 0;
+        RenderEntityChunk* chunk;
+        uint32 index;
+        bool created = renderEntities.Create(&id, &chunk, &index);
+        ASSERT(created, __FILE__, __LINE__);
+        if (!created) return id;
+
+        chunk->transformIndex[index] = transformIndex;
+        chunk->meshBufferIndex[index] = meshBufferIndex;
+        chunk->materialIndex[index] = materialIndex;
+        return id;
+    }
+
+    EntityId CreateSkinnedRenderEntity(const TransformHierarchy& hierarchy, uint32 meshHandleIndex, uint32 materialIndex)
+    {
+        EntityId id = 0;
+        SkinnedRenderEntityChunk* chunk;
+        uint32 index;
+        bool created = skinnedRenderEntities.Create(&id, &chunk, &index);
+        ASSERT(created, __FILE__, __LINE__);
+        if (!created) return id;
+
+        chunk->transformHierarchy[index] = hierarchy;
+        chunk->meshHandleIndex[index] = meshHandleIndex;
+        chunk->materialIndex[index] = materialIndex;
+        return id;
+    }
 
-    EntityManager()
+    void DestroyRenderEntity(EntityId id)
     {
-         renderEntityCount = 0;
-         skinndedRenderEntityCount = 0;
+        renderEntities.Remove(id);
     }
 
-    RenderEntity* CreateRenderEntity(uint32 transformIndex, uint32 meshBufferIndex, uint32 materialIndex)
+    void DestroySkinnedRenderEntity(EntityId id)
     {
-        ASSERT(renderEntityCount+1 < MAX_RENDER_ENTITIES, __FILE__, __LINE__);
-        RenderEntity* value = &renderEntities[renderEntityCount];
-        value->transformIndex = transformIndex;
-        value->meshBufferIndex = meshBufferIndex;
-        value->materialIndex = materialIndex;
-        renderEntityCount++;
-        return value;
+        skinnedRenderEntities.Remove(id);
     }
 };
@@ -393,38 +393,54 @@ RayIntersection SphereCollisionCheck(vec3f position, vec3f velocity,const Level&
 
 	RayIntersection result = { false, 1.0, {0,1,0} };
 	RayIntersection test;
+	//only the occupied cells get walked: the summary bits give the chunks with anything in them and each chunk's
+	//rows give the occupied cells, both are stepped through a set bit at a time
+	uint64 chunkRange = BitRange(startZ/LEVEL_CHUNK_WIDTH, endZ/LEVEL_CHUNK_WIDTH);
 	for (uint32 y = startY; y <= endY; y++)
-	for (uint32 x = startX; x <= endX; x++)
-	for (uint32 z = startZ; z <= endZ; z++)
+	for (uint32 chunkX = startX/LEVEL_CHUNK_WIDTH; chunkX <= endX/LEVEL_CHUNK_WIDTH; chunkX++)
+	for (uint64 chunks = level.occupiedChunks[y][chunkX] & chunkRange; chunks != 0; chunks &= chunks-1)
 	{
-		NodeCell& cell = level.cells[LinearIndex(x,y,z,level.width)];
-		for(byte q = 0; q < 4; q++)
+		uint32 chunkZ = CountTrailingZeros(chunks);
+		const LevelChunk& chunk = level.chunks[LevelChunkIndex(chunkX, y, chunkZ, level.chunksPerRow)];
+
+		uint32 chunkEndX = glm::min(endX, chunkX*LEVEL_CHUNK_WIDTH + LEVEL_CHUNK_WIDTH-1);
+		uint32 chunkStartZ = glm::max(startZ, chunkZ*LEVEL_CHUNK_WIDTH);
+		uint32 chunkEndZ = glm::min(endZ, chunkZ*LEVEL_CHUNK_WIDTH + LEVEL_CHUNK_WIDTH-1);
+		uint32 rowRange = (uint32)BitRange(chunkStartZ % LEVEL_CHUNK_WIDTH, chunkEndZ % LEVEL_CHUNK_WIDTH);
+		for (uint32 x = glm::max(startX, chunkX*LEVEL_CHUNK_WIDTH); x <= chunkEndX; x++)
+		for (uint32 row = chunk.occupied[x % LEVEL_CHUNK_WIDTH] & rowRange; row != 0; row &= row-1)
 		{
-			if (cell.types[q] == 0 || cell.shapes[q] == 0) continue;
-
-			uint32 colIndex = GetColliderTableIndex(cell.shapes[q],q);
-
-			// test = RayBoxIntersection(velocity, position,
-			// 			COLLIDER_BOX_TABLE[colIndex], cell.position,
-			// 			COLLIDER_ROTATION_TABLE[colIndex],
-            //             COLLIDER_INVERSE_ROTATION_TABLE[colIndex]);
-             test = SphereBoxIntersection(velocity, position, radius,
-			 			COLLIDER_BOX_TABLE[colIndex], cell.position,
-			 			COLLIDER_ROTATION_TABLE[colIndex],
-                         COLLIDER_INVERSE_ROTATION_TABLE[colIndex]);
-			//test.fraction *= magnitude;
-			if (test.hit && test.fraction < result.fraction)
-                //&& glm::dot(test.normal,travelDirection) < 0 )
+			uint32 z = chunkZ*LEVEL_CHUNK_WIDTH + CountTrailingZeros(row);
+			const NodeCell& cell = GetLevelChunkCell(chunk, x, z);
+			vec3f cellPosition = vec3f(x,y,z)*CELL_SIZE;
+			for(byte q = 0; q < 4; q++)
 			{
-				result = test;
+				if (CellType(cell, q) == 0 || CellShape(cell, q) == 0) continue;
+
+				uint32 colIndex = GetColliderTableIndex(CellShape(cell, q),q);
+
+				// test = RayBoxIntersection(velocity, position,
+				// 			COLLIDER_BOX_TABLE[colIndex], cellPosition,
+				// 			COLLIDER_ROTATION_TABLE[colIndex],
+	            //             COLLIDER_INVERSE_ROTATION_TABLE[colIndex]);
+	             test = SphereBoxIntersection(velocity, position, radius,
+				 			COLLIDER_BOX_TABLE[colIndex], cellPosition,
+				 			COLLIDER_ROTATION_TABLE[colIndex],
+	                         COLLIDER_INVERSE_ROTATION_TABLE[colIndex]);
+				//test.fraction *= magnitude;
+				if (test.hit && test.fraction < result.fraction)
+	                //&& glm::dot(test.normal,travelDirection) < 0 )
+				{
+					result = test;
 #ifdef DEBUG
-                if (showCollisionBounds)
-                {
-    				Debug.LineBuffer.AddBox(COLLIDER_BOX_TABLE[colIndex],
-    								cell.position+vec3f(0.0,0.1,0.0),
-    								COLLIDER_ROTATION_TABLE[colIndex],{1,0,0});
-                }
+	                if (showCollisionBounds)
+	                {
+	    				Debug.LineBuffer.AddBox(COLLIDER_BOX_TABLE[colIndex],
+	    								cellPosition+vec3f(0.0,0.1,0.0),
+	    								COLLIDER_ROTATION_TABLE[colIndex],{1,0,0});
+	                }
 #endif
+				}
 			}
 		}
 	}
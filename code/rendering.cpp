@@ -1,6 +1,11 @@
 #include "glm/glm.hpp"
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/packing.hpp>
 #include "glew/GL/glew.h"
+#include <emmintrin.h>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
 
 #include "types.h"
 #include "level.h"
@@ -17,6 +22,8 @@ MeshBufferHandle UploadMeshToGPU(void* vertexData, void* triangleData, uint32 ve
 {
 	MeshBufferHandle buffer;
 	buffer.indexCount = indexCount;
+	buffer.indexType = GL_UNSIGNED_SHORT;
+	buffer.vertexSize = sizeof(Vertex);
 
 	glGenBuffers(1, &(buffer.vboID));
 	glBindBuffer(GL_ARRAY_BUFFER, buffer.vboID);
@@ -33,6 +40,8 @@ MeshBufferHandle CreateEmptyMeshBuffer()
 {
 	MeshBufferHandle buffer;
 	buffer.indexCount = 0;
+	buffer.indexType = GL_UNSIGNED_SHORT;
+	buffer.vertexSize = sizeof(Vertex);
 
 	glGenBuffers(1, &(buffer.vboID));
 	glBindBuffer(GL_ARRAY_BUFFER, buffer.vboID);
@@ -45,12 +54,15 @@ MeshBufferHandle CreateEmptyMeshBuffer()
 	return buffer;
 }
 
-uint32 UploadMeshToGPU(const Mesh& mesh, GameMemory& memory)
+//The handle's index is what render entities keep, ReleaseMeshBuffer takes the whole handle back
+PoolHandle UploadMeshToGPU(const Mesh& mesh, GameMemory& memory)
 {
 	ASSERT(memory.meshBufferHandles.CanFit(1), __FILE__, __LINE__);
 	auto request = memory.meshBufferHandles.RequestFromBlock(1);
 	MeshBufferHandle* buffer = request.memory;
 	buffer->indexCount = mesh.indexCount;
+	buffer->indexType = GL_UNSIGNED_SHORT;
+	buffer->vertexSize = sizeof(Vertex);
 
 	glGenBuffers(1, &(buffer->vboID));
 	glBindBuffer(GL_ARRAY_BUFFER, buffer->vboID);
@@ -60,7 +72,19 @@ uint32 UploadMeshToGPU(const Mesh& mesh, GameMemory& memory)
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer->iboID);
 	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint16) * mesh.indexCount, reinterpret_cast<const void*>(mesh.indices), GL_DYNAMIC_DRAW);
 
-	return request.index;
+	PoolHandle handle = { request.index, request.generation };
+	return handle;
+}
+
+void ReleaseMeshBuffer(PoolHandle handle, GameMemory& memory)
+{
+	MeshBufferHandle* buffer = memory.meshBufferHandles.Get(handle);
+	ASSERT((buffer != NULL), __FILE__, __LINE__);
+	if (buffer == NULL) return;
+
+	glDeleteBuffers(1, &(buffer->vboID));
+	glDeleteBuffers(1, &(buffer->iboID));
+	memory.meshBufferHandles.Release(handle);
 }
 
 QuadBuffer CreateQuadBufferInHeap(uint32 quadCapacity)
@@ -75,8 +99,12 @@ QuadBuffer CreateQuadBufferInHeap(uint32 quadCapacity)
 	buffer.mesh.indices = (uint16*)SDL_malloc(quadCapacity*6*sizeof(uint16));
 
 	buffer.handle.indexCount = 0;
-	glGenBuffers(1, &(buffer.handle.vboID));
-	glGenBuffers(1, &(buffer.handle.iboID));
+	buffer.handle.indexType = GL_UNSIGNED_SHORT;
+	buffer.handle.vertexSize = sizeof(Vertex);
+	buffer.handle.vboID = 0; //set by UploadQuadBuffer
+	buffer.handle.iboID = 0;
+	buffer.vertexOffset = 0;
+	buffer.indexOffset = 0;
 
 	return buffer;
 }
@@ -97,31 +125,36 @@ QuadBuffer CreateQuadBufferInGameMemory(uint32 quadCapacity, GameMemory& memory)
 	buffer.mesh.indices = indexRequest.memory;
 
 	buffer.handle.indexCount = 0;
-	glGenBuffers(1, &(buffer.handle.vboID));
-	glGenBuffers(1, &(buffer.handle.iboID));
+	buffer.handle.indexType = GL_UNSIGNED_SHORT;
+	buffer.handle.vertexSize = sizeof(Vertex);
+	buffer.handle.vboID = 0; //set by UploadQuadBuffer
+	buffer.handle.iboID = 0;
+	buffer.vertexOffset = 0;
+	buffer.indexOffset = 0;
 
 	return buffer;
 }
 
 void DrawCall(const MeshBufferHandle& buffer)
 {
-	glBindVertexBuffer(0, buffer.vboID, 0, sizeof(Vertex));
+	glBindVertexBuffer(0, buffer.vboID, 0, buffer.vertexSize);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer.iboID);
-	glDrawElements(GL_TRIANGLES, buffer.indexCount, GL_UNSIGNED_SHORT, NULL);
+	glDrawElements(GL_TRIANGLES, buffer.indexCount, buffer.indexType, NULL);
 }
 
-void BindTexture(const Texture2D &texture, uint32 slot = 0)
+//Just indexCount of the buffer's indices starting from firstIndex
+void DrawCall(const MeshBufferHandle& buffer, uint32 firstIndex, uint32 indexCount)
 {
-	glActiveTexture(GL_TEXTURE0+slot);
-	glBindTexture(GL_TEXTURE_2D, texture.glID);
+	uint64 indexSize = buffer.indexType == GL_UNSIGNED_INT ? sizeof(uint32) : sizeof(uint16);
+	glBindVertexBuffer(0, buffer.vboID, 0, buffer.vertexSize);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer.iboID);
+	glDrawElements(GL_TRIANGLES, indexCount, buffer.indexType, (const void*)(firstIndex*indexSize));
 }
 
-inline void SetShaderModelMatrix(uint32 objectBufferID, const mat4f& data)
+void BindTexture(const Texture2D &texture, uint32 slot = 0)
 {
-	glBindBuffer(GL_UNIFORM_BUFFER, objectBufferID);
-	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(mat4f), glm::value_ptr(data));
-	mat4f inverse = glm::transpose(glm::inverse(data));
-	glBufferSubData(GL_UNIFORM_BUFFER, sizeof(mat4f), sizeof(mat4f), glm::value_ptr(inverse));
+	glActiveTexture(GL_TEXTURE0+slot);
+	glBindTexture(GL_TEXTURE_2D, texture.glID);
 }
 
 inline void SetUniformBufferData(uint32 uniformBufferID, uint32 size, const void* data)
@@ -141,16 +174,146 @@ uint32 CreateUniformBuffer(uint32 size, uint32 bindingIndex)
 	return id;
 }
 
-inline void ApplyVertexAttribute(uint32 index, uint32 offset, uint32 numFloats)
+//alignment is what writes start on a multiple of, GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT if it holds uniform blocks
+StreamBuffer CreateStreamBuffer(uint32 regionSize, uint32 alignment)
+{
+	StreamBuffer buffer = {};
+	buffer.regionSize = regionSize;
+	buffer.alignment = alignment;
+	GLsizeiptr size = (GLsizeiptr)regionSize*STREAM_BUFFER_REGIONS;
+
+	glGenBuffers(1, &(buffer.glID));
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer.glID);
+	if (GLEW_ARB_buffer_storage)
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_COPY_WRITE_BUFFER, size, NULL, flags);
+		buffer.mapped = (byte*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size, flags);
+		if (buffer.mapped == NULL)
+		{
+			//storage from glBufferStorage can't be respecified, start over with a plain buffer
+			LOG_WARN("Could not map a stream buffer, writing it with glBufferSubData instead\n");
+			glDeleteBuffers(1, &(buffer.glID));
+			glGenBuffers(1, &(buffer.glID));
+			glBindBuffer(GL_COPY_WRITE_BUFFER, buffer.glID);
+		}
+	}
+	if (buffer.mapped == NULL)
+		glBufferData(GL_COPY_WRITE_BUFFER, size, NULL, GL_STREAM_DRAW);
+
+	return buffer;
+}
+
+void WaitForStreamRegion(StreamBuffer& buffer, uint32 region)
+{
+	GLsync fence = buffer.fences[region];
+	if (fence == NULL) return;
+
+	while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {}
+	for (uint32 i = 0; i < STREAM_BUFFER_REGIONS; i++)
+	{
+		if (buffer.fences[i] == fence)
+			buffer.fences[i] = NULL;
+	}
+	glDeleteSync(fence);
+}
+
+//Moves writing on to the next region, fencing what was written this frame first when that's the end of the frame
+//or when the frame has gone all the way around and has to wait on its own draws before reusing a region
+void AdvanceStreamBuffer(StreamBuffer& buffer, bool endOfFrame)
+{
+	uint32 next = (buffer.region + 1) % STREAM_BUFFER_REGIONS;
+	if (endOfFrame || next == buffer.frameRegion)
+	{
+		if (buffer.mapped != NULL)
+		{
+			GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			for (uint32 r = buffer.frameRegion;; r = (r + 1) % STREAM_BUFFER_REGIONS)
+			{
+				buffer.fences[r] = fence;
+				if (r == buffer.region) break;
+			}
+		}
+		buffer.frameRegion = next;
+	}
+	buffer.region = next;
+	buffer.used = 0;
+	WaitForStreamRegion(buffer, next);
+}
+
+inline void EndStreamBufferFrame(StreamBuffer& buffer)
+{
+	AdvanceStreamBuffer(buffer, true);
+}
+
+//Returns where in the buffer size bytes were set aside, moving on to the next region when they don't fit in this one
+uint32 ReserveStreamBuffer(StreamBuffer& buffer, uint32 size)
+{
+	ASSERT((size <= buffer.regionSize), __FILE__, __LINE__);
+	uint32 start = (buffer.used + buffer.alignment - 1) / buffer.alignment * buffer.alignment;
+	if (start + size > buffer.regionSize)
+	{
+		AdvanceStreamBuffer(buffer, false);
+		start = 0;
+	}
+	buffer.used = start + size;
+	return buffer.region*buffer.regionSize + start;
+}
+
+inline void FillStreamBuffer(StreamBuffer& buffer, uint32 offset, const void* data, uint32 size)
+{
+	if (buffer.mapped != NULL)
+	{
+		memcpy(buffer.mapped + offset, data, size);
+		return;
+	}
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer.glID);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, offset, size, data);
+}
+
+inline uint32 WriteStreamBuffer(StreamBuffer& buffer, const void* data, uint32 size)
+{
+	uint32 offset = ReserveStreamBuffer(buffer, size);
+	FillStreamBuffer(buffer, offset, data, size);
+	return offset;
+}
+
+//Writes a uniform block into the stream buffer and binds it to bindingIndex for the draws after
+inline void SetStreamUniformData(StreamBuffer& stream, uint32 bindingIndex, const void* data, uint32 size)
+{
+	uint32 offset = WriteStreamBuffer(stream, data, size);
+	glBindBufferRange(GL_UNIFORM_BUFFER, bindingIndex, stream.glID, offset, size);
+}
+
+inline void SetShaderModelMatrix(StreamBuffer& stream, const mat4f& data)
+{
+	ObjectData object;
+	object.model = data;
+	object.inverse = glm::transpose(glm::inverse(data));
+	SetStreamUniformData(stream, OBJECT_BUFFER_BINDING, &object, sizeof(ObjectData));
+}
+
+inline void ApplyVertexAttribute(uint32 index, uint32 offset, uint32 componentCount, GLenum type = GL_FLOAT,
+	GLboolean normalized = GL_FALSE)
 {
 	glEnableVertexAttribArray(index);
-	glVertexAttribFormat(index, numFloats, GL_FLOAT, GL_FALSE, offset);
+	glVertexAttribFormat(index, componentCount, type, normalized, offset);
 	glVertexAttribBinding(index, 0);
 }
 
-void SetShader(const Material& material, const ShaderAssetTable& shaderTable)
+//The vertex array layout for PackedVertex, PACKED_ORIGIN_ATTRIBUTE is left off so it reads the value set per draw
+inline void ApplyPackedVertexAttributes()
+{
+	ApplyVertexAttribute(0, offsetof(PackedVertex, position), 3, GL_SHORT);
+	ApplyVertexAttribute(1, offsetof(PackedVertex, normal)  , 2, GL_SHORT, GL_TRUE);
+	ApplyVertexAttribute(2, offsetof(PackedVertex, uv0)     , 2, GL_HALF_FLOAT);
+	ApplyVertexAttribute(3, offsetof(PackedVertex, color)   , 4, GL_UNSIGNED_BYTE, GL_TRUE);
+}
+
+void SetShader(const Material& material, const ShaderAssetTable& shaderTable, bool packedVertices = false)
 {
-	uint32 shader = shaderTable.compiledShaders[material.shaderType];
+	uint32 shader = packedVertices ? shaderTable.compiledPackedShaders[material.shaderType] :
+		shaderTable.compiledShaders[material.shaderType];
 	glUseProgram(shader);
 
 	//TODO(Cameron): figure out a better way of keeping these locations, will probably have an
@@ -165,123 +328,902 @@ void SetShader(const Material& material, const ShaderAssetTable& shaderTable)
 
 
 
-template <uint32 N>
-void UpdateGeometryBuffer(const Level& level, NodeSetPalette<N>& nodeSets, GeometryBuffer& geometryBuffer)
+//Deletes the GL buffers of every chunk, the chunk array itself goes with the geometry chunk block
+void ReleaseGeometryChunk(GeometryChunk& chunk)
 {
-	int levelWidth = level.width;
-	int levelHeight = level.height;
+	for (int i = 0; i < MAX_NODE_TYPES; i++)
+	{
+		MeshBufferHandle& handle = chunk.handles[i];
+		if (handle.vboID == 0) continue;
+		glDeleteBuffers(1, &handle.vboID);
+		glDeleteBuffers(1, &handle.iboID);
+		handle = MeshBufferHandle();
+		chunk.coarseIndexStart[i] = 0;
+	}
+	chunk.hasCoarse = false;
+	chunk.coarse = false;
+}
 
-	NodeCell* cell = &level.cells[0];
-	unsigned char type = 0;
-	unsigned char shape = 0;
-	unsigned char layer = 0;
-	vec3f up          = vec3f(0.0f, 1.0f, 0.0f);
-	vec3f cellPos     = {0.0,0.0,0.0};
-	mat4f identity    = glm::identity<mat4f>();
-	mat4f translation = glm::identity<mat4f>();
-	Vertex sourceVertex;
-	//Method 2 where we map directly to GPU buffers
-	/*glBindBuffer(GL_ARRAY_BUFFER, geometryBuffers.vboID);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometryBuffers.iboID);
-	Vertex* vertices = (Vertex*)glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-	uint16* indices = (uint16*)glMapBuffer(GL_ELEMENT_ARRAY_BUFFER, GL_WRITE_ONLY);*/
-	/*uint32 vertexCount = 0;
-	uint32 indexCount = 0;
-	uint32 meshIndexStart = 0;*/
+void ReleaseGeometryBuffer(GeometryBuffer& geometryBuffer)
+{
+	for (uint32 c = 0; c < geometryBuffer.chunkCount; c++)
+		ReleaseGeometryChunk(geometryBuffer.chunks[c]);
+
+	geometryBuffer.chunks = NULL;
+	geometryBuffer.chunkCount = 0;
+	geometryBuffer.chunksPerRow = 0;
+}
+
+//Empties a staging mesh and points it at its own pair of blocks, which hand back whatever earlier levels committed
+void SetupStagingMesh(GeometryMesh& mesh, MemoryBlock<Vertex>& vertexBlock, MemoryBlock<uint32>& indexBlock)
+{
+	vertexBlock.Reset();
+	indexBlock.Reset();
+	mesh.vertexBlock = &vertexBlock;
+	mesh.indexBlock = &indexBlock;
+	mesh.vertices = vertexBlock.block;
+	mesh.indices  = indexBlock.block;
+	mesh.vertexCount = 0;
+	mesh.indexCount  = 0;
+	mesh.indexType  = GL_UNSIGNED_SHORT;
+	mesh.vertexSize = sizeof(Vertex);
+	mesh.coarseIndexStart = 0;
+}
+
+//Makes room in a staging mesh for vertexCount more vertices and indexCount more indices. The blocks are sized for
+//the worst case, so this only commits the pages past what the biggest chunk so far needed and can only fail if
+//those can't be committed
+inline bool GrowGeometryMesh(GeometryMesh& mesh, uint32 vertexCount, uint32 indexCount)
+{
+	MemoryBlock<Vertex>& vertexBlock = *mesh.vertexBlock;
+	MemoryBlock<uint32>& indexBlock = *mesh.indexBlock;
+	uint32 vertexEnd = mesh.vertexCount + vertexCount;
+	uint32 indexEnd = mesh.indexCount + indexCount;
+	if (vertexEnd > vertexBlock.itemIndexIntoBlock &&
+		!vertexBlock.RequestFromBlock(vertexEnd - vertexBlock.itemIndexIntoBlock).valid)
+		return false;
+	if (indexEnd > indexBlock.itemIndexIntoBlock &&
+		!indexBlock.RequestFromBlock(indexEnd - indexBlock.itemIndexIntoBlock).valid)
+		return false;
+	return true;
+}
+
+//Sets up a chunk for every LEVEL_CHUNK_WIDTH square of columns and gives each node type a staging mesh, a set of
+//those for every thread that meshes. Every type gets one since edits can bring in types the level didn't start
+//with. Everything is reset first so this can be called again whenever a level is (re)loaded
+void SetupGeometryBuffer(const Level& level, GeometryBuffer& geometryBuffer, GameMemory& memory, const JobSystem& jobs)
+{
+	ReleaseGeometryBuffer(geometryBuffer);
+	memory.geometryChunkBlock.Reset();
 
+	geometryBuffer.stagingSetCount = glm::min(jobs.workerCount + 1, GEO_MESH_STAGING_SETS);
+	for (uint32 s = 0; s < geometryBuffer.stagingSetCount; s++)
 	for (int i = 0; i < MAX_NODE_TYPES; i++)
 	{
-		geometryBuffer.meshes[i].vertexCount = 0;
-		geometryBuffer.meshes[i].indexCount = 0;
+		SetupStagingMesh(geometryBuffer.meshes[s][i], memory.geometryMeshVertexBlocks[s*MAX_NODE_TYPES + i],
+			memory.geometryMeshIndexBlocks[s*MAX_NODE_TYPES + i]);
 	}
 
+	uint32 chunksPerRow = (level.width + LEVEL_CHUNK_WIDTH-1) / LEVEL_CHUNK_WIDTH;
+	uint32 chunkCount = chunksPerRow*chunksPerRow;
+	auto chunkRequest = memory.geometryChunkBlock.RequestFromBlock(chunkCount);
+	ASSERT(chunkRequest.valid, __FILE__, __LINE__);
+	if (!chunkRequest.valid) return;
 
-	for (int y = 0; y < levelHeight; y++)
-	for (int x = 0; x < levelWidth; x++)
-	for (int z = 0; z < levelWidth; z++)
+	geometryBuffer.chunks = chunkRequest.memory;
+	geometryBuffer.chunksPerRow = chunksPerRow;
+	geometryBuffer.chunkCount = chunkCount;
+	for (uint32 c = 0; c < chunkCount; c++)
 	{
-		cellPos = vec3f(x*CELL_SIZE,y*CELL_SIZE,z*CELL_SIZE);
-		for (int i = 0; i < 4; i++)
+		GeometryChunk& chunk = geometryBuffer.chunks[c];
+		for (int i = 0; i < MAX_NODE_TYPES; i++)
 		{
-			type  = cell->types[i];
-			shape = cell->shapes[i];
-			layer = cell->layers[i];
+			chunk.handles[i] = MeshBufferHandle();
+			chunk.coarseIndexStart[i] = 0;
+		}
+		chunk.hasCoarse = false;
+		chunk.coarse = false;
+		chunk.dirty = true;
+	}
+}
+
+void MarkGeometryDirty(GeometryBuffer& geometryBuffer, uint32 cellX, uint32 cellZ)
+{
+	uint32 chunkX = cellX / LEVEL_CHUNK_WIDTH;
+	uint32 chunkZ = cellZ / LEVEL_CHUNK_WIDTH;
+	if (chunkX >= geometryBuffer.chunksPerRow || chunkZ >= geometryBuffer.chunksPerRow) return;
+
+	geometryBuffer.chunks[chunkX*geometryBuffer.chunksPerRow + chunkZ].dirty = true;
+}
+
+//Packs 32 bit indices down to 16 bit over the top of themselves, the write never gets ahead of the read
+inline void NarrowGeometryIndices(uint32* indices, uint32 indexCount)
+{
+	uint16* narrow = (uint16*)indices;
+	for (uint32 i = 0; i < indexCount; i++)
+		narrow[i] = (uint16)indices[i];
+}
+
+//The unit sphere folded onto the square |x|+|y| <= 1, the -z half goes out over the corners. Takes xyz and gives
+//the encoding in xy. Done with masks rather than branches since which half a normal is in is a coin flip
+inline __m128 OctahedralEncode(__m128 normal)
+{
+	const __m128 signBits = _mm_set1_ps(-0.0f);
+	const __m128 zero = _mm_setzero_ps();
+
+	__m128 magnitude = _mm_andnot_ps(signBits, normal);
+	__m128 length = _mm_add_ps(_mm_add_ps(
+		_mm_shuffle_ps(magnitude, magnitude, _MM_SHUFFLE(0, 0, 0, 0)),
+		_mm_shuffle_ps(magnitude, magnitude, _MM_SHUFFLE(1, 1, 1, 1))),
+		_mm_shuffle_ps(magnitude, magnitude, _MM_SHUFFLE(2, 2, 2, 2)));
+	__m128 projected = _mm_and_ps(_mm_div_ps(normal, length), _mm_cmpgt_ps(length, zero));
+
+	__m128 swapped = _mm_shuffle_ps(projected, projected, _MM_SHUFFLE(3, 2, 0, 1));
+	__m128 folded = _mm_or_ps(_mm_sub_ps(_mm_set1_ps(1.0f), _mm_andnot_ps(signBits, swapped)),
+		_mm_and_ps(signBits, projected));
+	__m128 below = _mm_cmplt_ps(_mm_shuffle_ps(normal, normal, _MM_SHUFFLE(2, 2, 2, 2)), zero);
+	return _mm_or_ps(_mm_and_ps(below, folded), _mm_andnot_ps(below, projected));
+}
 
-			if (type == EMPTY || shape == 0) continue;
+static_assert(sizeof(PackedVertex) == 20, "PackedVertex is laid out for ApplyPackedVertexAttributes");
+//in cells, which are a unit wide
+static_assert((LEVEL_CHUNK_WIDTH + 2)*PACKED_POSITION_SCALE < 32767.0f &&
+	(MAX_LEVEL_HEIGHT + 2)*PACKED_POSITION_SCALE < 32767.0f, "a chunk's pieces have to fit in PackedVertex positions");
 
-			if (type > nodeSets.count)
+//Float to half rounding to nearest even, the usual bit trick version. Out of range goes to infinity
+inline uint16 FloatToHalf(float value)
+{
+	uint32 bits;
+	memcpy(&bits, &value, sizeof(bits));
+	uint32 sign = (bits >> 16) & 0x8000;
+	bits &= 0x7fffffff;
+
+	uint32 half;
+	if (bits >= (143u << 23)) //2^16, past the largest half or inf/nan
+		half = bits > (255u << 23) ? 0x7e00 : 0x7c00;
+	else if (bits < (113u << 23)) //2^-14, a half denormal or zero
+	{
+		const uint32 denormalMagic = ((127 - 15) + (23 - 10) + 1) << 23;
+		float magic;
+		memcpy(&magic, &denormalMagic, sizeof(magic));
+		float shifted;
+		memcpy(&shifted, &bits, sizeof(shifted));
+		shifted += magic;
+		memcpy(&half, &shifted, sizeof(half));
+		half -= denormalMagic;
+	}
+	else
+	{
+		uint32 odd = (bits >> 13) & 1;
+		bits += ((uint32)(15 - 127) << 23) + 0xfff + odd;
+		half = bits >> 13;
+	}
+	return (uint16)(half | sign);
+}
+
+//Packs vertices into PackedVertex over the top of themselves like NarrowGeometryIndices, positions relative to
+//origin. Done once a chunk is built, the mesher itself only deals in Vertex. A vertex is fully read before its
+//packed copy is written and the packed one never reaches past it, so going forward is safe
+inline void PackGeometryVertices(GeometryMesh& mesh, vec3f origin)
+{
+	const __m128 offset = _mm_setr_ps(origin.x, origin.y, origin.z, 0.0f);
+	const __m128 positionScale = _mm_setr_ps(PACKED_POSITION_SCALE, PACKED_POSITION_SCALE, PACKED_POSITION_SCALE, 0.0f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 snormScale = _mm_set1_ps(32767.0f);
+	const __m128 unormScale = _mm_set1_ps(255.0f);
+
+	const float* in = (const float*)mesh.vertices;
+	byte* out = (byte*)mesh.vertices;
+	for (uint32 v = 0; v < mesh.vertexCount; v++, in += 12, out += sizeof(PackedVertex))
+	{
+		//the converts round to nearest and the packs saturate, so the rounding and clamping come for free
+		__m128i position = _mm_cvtps_epi32(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(in), offset), positionScale));
+		position = _mm_packs_epi32(position, position);
+
+		__m128 normalFloat = OctahedralEncode(_mm_loadu_ps(in + 3));
+		normalFloat = _mm_max_ps(_mm_min_ps(normalFloat, one), _mm_sub_ps(_mm_setzero_ps(), one));
+		__m128i normal = _mm_cvtps_epi32(_mm_mul_ps(normalFloat, snormScale));
+		normal = _mm_packs_epi32(normal, normal);
+
+		uint32 uv0 = (uint32)FloatToHalf(in[6]) | ((uint32)FloatToHalf(in[7]) << 16);
+
+		__m128 colorFloat = _mm_max_ps(_mm_min_ps(_mm_loadu_ps(in + 8), one), _mm_setzero_ps());
+		__m128i color = _mm_cvtps_epi32(_mm_mul_ps(colorFloat, unormScale));
+		color = _mm_packs_epi32(color, color);
+		color = _mm_packus_epi16(color, color);
+
+		//position[3] and the zero padding from w
+		_mm_storel_epi64((__m128i*)out, position);
+		uint32 packedNormal = (uint32)_mm_cvtsi128_si32(normal);
+		uint32 packedColor = (uint32)_mm_cvtsi128_si32(color);
+		memcpy(out + offsetof(PackedVertex, normal), &packedNormal, sizeof(uint32));
+		memcpy(out + offsetof(PackedVertex, uv0), &uv0, sizeof(uint32));
+		memcpy(out + offsetof(PackedVertex, color), &packedColor, sizeof(uint32));
+	}
+	mesh.vertexSize = sizeof(PackedVertex);
+}
+
+static_assert(sizeof(Vertex) == 12*sizeof(float), "TranslateVertices expects a vertex to be 12 floats, position first");
+
+//Copies count vertices from src to dst moved by offset, only the position changes. -0 is added to everything else
+//since that leaves any float exactly as it was. With AVX it goes two vertices at a time, which is three full
+//registers, otherwise one vertex is three SSE registers
+inline void TranslateVertices(Vertex* dst, const Vertex* src, uint32 count, vec3f offset)
+{
+	const float* in = (const float*)src;
+	float* out = (float*)dst;
+	uint32 v = 0;
+#ifdef __AVX__
+	const __m256 first  = _mm256_setr_ps(offset.x, offset.y, offset.z, -0.0f, -0.0f, -0.0f, -0.0f, -0.0f);
+	const __m256 second = _mm256_setr_ps(-0.0f, -0.0f, -0.0f, -0.0f, offset.x, offset.y, offset.z, -0.0f);
+	for (; v + 2 <= count; v += 2, in += 24, out += 24)
+	{
+		_mm256_storeu_ps(out,      _mm256_add_ps(_mm256_loadu_ps(in), first));
+		_mm256_storeu_ps(out + 8,  _mm256_add_ps(_mm256_loadu_ps(in + 8), second));
+		_mm256_storeu_ps(out + 16, _mm256_loadu_ps(in + 16));
+	}
+#endif
+	const __m128 position = _mm_setr_ps(offset.x, offset.y, offset.z, -0.0f);
+	for (; v < count; v++, in += 12, out += 12)
+	{
+		_mm_storeu_ps(out,     _mm_add_ps(_mm_loadu_ps(in), position));
+		_mm_storeu_ps(out + 4, _mm_loadu_ps(in + 4));
+		_mm_storeu_ps(out + 8, _mm_loadu_ps(in + 8));
+	}
+}
+
+//dst[i] = base + src[i], widening the piece's 16 bit indices eight at a time
+inline void RebaseIndices(uint32* dst, const uint16* src, uint32 count, uint32 base)
+{
+	const __m128i add = _mm_set1_epi32((int)base);
+	const __m128i zero = _mm_setzero_si128();
+	uint32 i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i indices = _mm_loadu_si128((const __m128i*)(src + i));
+		_mm_storeu_si128((__m128i*)(dst + i),     _mm_add_epi32(_mm_unpacklo_epi16(indices, zero), add));
+		_mm_storeu_si128((__m128i*)(dst + i + 4), _mm_add_epi32(_mm_unpackhi_epi16(indices, zero), add));
+	}
+	for (; i < count; i++)
+		dst[i] = base + src[i];
+}
+
+//Rows of the cells that can hide faces for every layer of a column, laid out like LevelChunk::occupied. That's cells
+//with all four corners filled and solid cells all the way down, the pieces have no undersides so anything over open
+//space can be seen into from below
+void FindSolidCells(const LevelChunk* column, uint32 columnStride, uint32 height, uint16 solid[][LEVEL_CHUNK_WIDTH])
+{
+	for (uint32 y = 0; y < height; y++)
+	{
+		const LevelChunk& levelChunk = column[y*columnStride];
+		for (uint32 x = 0; x < LEVEL_CHUNK_WIDTH; x++)
+		{
+			uint16 rowSolid = 0;
+			uint16 below = y > 0 ? solid[y-1][x] : 0xFFFF;
+			for (uint32 row = levelChunk.occupied[x] & below; row != 0; row &= row-1)
 			{
-				LOG_WARN("Unsupported node type found in Level! (type: %d)\n",type);
-				type = 1;
+				uint32 z = CountTrailingZeros(row);
+				if (LevelCellIsSolid(GetLevelChunkCell(levelChunk, x, z)))
+					rowSolid |= (uint16)(1u << z);
 			}
+			solid[y][x] = rowSolid;
+		}
+	}
+}
 
-			Mesh* srcMesh = nodeSets.GetNodePiece(type,shape,layer);
-			Mesh* dstMesh = &(geometryBuffer.meshes[type-1]);
+//The solid cells around local cell x,y,z as occlusion mask bits (see NodeShape::occlusion). Only the column's own
+//cells count and everything past it is open, so a chunk's geometry never depends on its neighbours'
+inline uint32 SolidNeighbourhood(const uint16 solid[][LEVEL_CHUNK_WIDTH], uint32 height, uint32 x, uint32 y, uint32 z)
+{
+	uint32 bits = 0;
+	for (uint32 dy = 0; dy < 3; dy++)
+	for (uint32 dx = 0; dx < 3; dx++)
+	{
+		uint32 layer = y + dy - 1;
+		uint32 row = x + dx - 1;
+		if (layer >= height || row >= LEVEL_CHUNK_WIDTH) continue;
 
-			ASSERT((srcMesh != NULL), __FILE__, __LINE__);
-			if (srcMesh == NULL) continue;
-			ASSERT((dstMesh->vertices != NULL), __FILE__, __LINE__);
+		//shifted up one so z-1 of the first cell is bit 0 rather than off the bottom
+		uint32 rowSolid = (uint32)solid[layer][row] << 1;
+		bits |= ((rowSolid >> z) & 7) << (dy*9 + dx*3);
+	}
+	return bits;
+}
+
+//Rebased indices of the piece's triangles that aren't hidden by the solid cells around it, returns how many were written
+inline uint32 AppendVisibleTriangles(uint32* dst, const uint16* src, const uint32* occlusion, uint32 triangleCount,
+	uint32 solidCells, uint32 base)
+{
+	uint32 written = 0;
+	for (uint32 t = 0; t < triangleCount; t++)
+	{
+		if ((occlusion[t] & ~solidCells) == 0) continue;
+		dst[written + 0] = base + src[t*3 + 0];
+		dst[written + 1] = base + src[t*3 + 1];
+		dst[written + 2] = base + src[t*3 + 2];
+		written += 3;
+	}
+	return written;
+}
+
+//One quad over spanX+1 by spanZ+1 cells made from the set's F_T, cellPos is the lowest cell. The corners on the
+//positive side are moved out to the far cell and their uvs carried on by the set's per cell uv change
+inline void AppendMergedTop(GeometryMesh& mesh, const NodeSet& nodeSet, const Mesh& top, vec3f cellPos,
+	uint32 spanX, uint32 spanZ)
+{
+	uint32 base = mesh.vertexCount;
+	for (uint32 v = 0; v < top.vertexCount; v++)
+	{
+		Vertex vertex = top.vertices[v];
+		float stepX = vertex.position.x > 0.0f ? (float)spanX : 0.0f;
+		float stepZ = vertex.position.z > 0.0f ? (float)spanZ : 0.0f;
+		vertex.position += cellPos + vec3f(stepX*CELL_SIZE, 0.0f, stepZ*CELL_SIZE);
+		vertex.uv0 += nodeSet.topUVPerX*stepX + nodeSet.topUVPerZ*stepZ;
+		mesh.vertices[base + v] = vertex;
+	}
+	RebaseIndices(mesh.indices + mesh.indexCount, top.indices, top.indexCount, base);
+	mesh.vertexCount += top.vertexCount;
+	mesh.indexCount += top.indexCount;
+}
+
+//One side of a coarse column box: a quad on the face of the cell at cellPos that faces normal, from bottom to top.
+//style gives it its uv and colour. Wound the same way as the node pieces so it faces normal
+inline void AppendCoarseSide(GeometryMesh& mesh, const Vertex& style, vec3f cellPos, vec3f normal, float bottom, float top)
+{
+	vec3f across = vec3f(normal.z, 0.0f, -normal.x)*CELL_HALF;
+	vec3f face = cellPos + normal*CELL_HALF;
+	uint32 base = mesh.vertexCount;
+	mesh.vertices[base + 0] = Vertex(vec3f(face.x - across.x, bottom, face.z - across.z), normal, style.uv0, style.color);
+	mesh.vertices[base + 1] = Vertex(vec3f(face.x + across.x, bottom, face.z + across.z), normal, style.uv0, style.color);
+	mesh.vertices[base + 2] = Vertex(vec3f(face.x - across.x, top, face.z - across.z), normal, style.uv0, style.color);
+	mesh.vertices[base + 3] = Vertex(vec3f(face.x + across.x, top, face.z + across.z), normal, style.uv0, style.color);
+	mesh.vertexCount += 4;
+
+	uint32* indices = mesh.indices + mesh.indexCount;
+	indices[0] = base + 0; indices[1] = base + 1; indices[2] = base + 2;
+	indices[3] = base + 2; indices[4] = base + 1; indices[5] = base + 3;
+	mesh.indexCount += 6;
+}
+
+//A flat quad facing up at height top over spanX+1 by spanZ+1 cells, cellPos is the lowest cell. style gives it its
+//uv and colour like AppendCoarseSide
+inline void AppendCoarseTop(GeometryMesh& mesh, const Vertex& style, vec3f cellPos, uint32 spanX, uint32 spanZ,
+	float top)
+{
+	vec3f up = vec3f(0.0f, 1.0f, 0.0f);
+	float x0 = cellPos.x - CELL_HALF;
+	float z0 = cellPos.z - CELL_HALF;
+	float x1 = cellPos.x + spanX*CELL_SIZE + CELL_HALF;
+	float z1 = cellPos.z + spanZ*CELL_SIZE + CELL_HALF;
+	uint32 base = mesh.vertexCount;
+	mesh.vertices[base + 0] = Vertex(vec3f(x0, top, z0), up, style.uv0, style.color);
+	mesh.vertices[base + 1] = Vertex(vec3f(x0, top, z1), up, style.uv0, style.color);
+	mesh.vertices[base + 2] = Vertex(vec3f(x1, top, z0), up, style.uv0, style.color);
+	mesh.vertices[base + 3] = Vertex(vec3f(x1, top, z1), up, style.uv0, style.color);
+	mesh.vertexCount += 4;
+
+	uint32* indices = mesh.indices + mesh.indexCount;
+	indices[0] = base + 0; indices[1] = base + 1; indices[2] = base + 2;
+	indices[3] = base + 2; indices[4] = base + 1; indices[5] = base + 3;
+	mesh.indexCount += 6;
+}
 
-			for (uint32 v = 0; v < srcMesh->indexCount; v++)
+//The chunk's stand-in for when it's far away (see UpdateGeometryLevelOfDetail). Every column of cells becomes one
+//box from its lowest cell to the top of its highest, in the node type of that top cell. Where the full detail mesh
+//would merge that top cell's F_T (see BuildGeometryChunk) the top is the set's F_T lifted up, any other top is flat
+//at the highest point of the cell's pieces. Tops of the same kind and height are merged into rectangles. The sides
+//only go down as far as the column next to them except on the edge of the chunk, where they go all the way down so
+//nothing shows through next to a neighbour drawn in full. Like the full detail geometry only the column's own cells
+//are read.
+//It goes on the end of meshes and coarseIndexStart is where it starts. If a type's room for it can't be committed
+//none of them get one and the chunk is always drawn in full
+template <uint32 N>
+void BuildCoarseGeometry(const LevelChunk* column, uint32 columnStride, uint32 levelHeight, NodeSetPalette<N>& nodeSets,
+	GeometryMesh* meshes, uint32 chunkX, uint32 chunkZ)
+{
+	for (int i = 0; i < MAX_NODE_TYPES; i++)
+		meshes[i].coarseIndexStart = meshes[i].indexCount;
+
+	//the top and bottom layer of each column, the type its top is drawn as (EMPTY if it has no cells) and how far
+	//above its top cell's position the pieces in that cell reach. mergeable is the columns whose top cell is a full
+	//cell with a mergeable F_T
+	byte topType[LEVEL_CHUNK_WIDTH][LEVEL_CHUNK_WIDTH] = {{0}};
+	byte topLayer[LEVEL_CHUNK_WIDTH][LEVEL_CHUNK_WIDTH];
+	byte bottomLayer[LEVEL_CHUNK_WIDTH][LEVEL_CHUNK_WIDTH];
+	float pieceTop[LEVEL_CHUNK_WIDTH][LEVEL_CHUNK_WIDTH];
+	uint16 columns[LEVEL_CHUNK_WIDTH] = {0};
+	uint16 mergeable[LEVEL_CHUNK_WIDTH] = {0};
+	for (uint32 y = 0; y < levelHeight; y++)
+	{
+		const LevelChunk& levelChunk = column[y*columnStride];
+		for (uint32 x = 0; x < LEVEL_CHUNK_WIDTH; x++)
+		for (uint32 row = levelChunk.occupied[x]; row != 0; row &= row-1)
+		{
+			uint32 z = CountTrailingZeros(row);
+			const NodeCell& cell = GetLevelChunkCell(levelChunk, x, z);
+			byte type = EMPTY;
+			float top = 0.0f;
+			for (int i = 0; i < 4; i++)
 			{
-				dstMesh->indices[dstMesh->indexCount] = dstMesh->vertexCount + (srcMesh->indices[v]);
-				dstMesh->indexCount++;
+				byte pieceType = CellType(cell, i);
+				if (pieceType == EMPTY || CellShape(cell, i) == 0) continue;
+				if (pieceType > nodeSets.count) pieceType = 1;
+				float height = nodeSets.GetNodeShape(pieceType, CellShape(cell, i), CellLayer(cell, i))->top;
+				top = type == EMPTY ? height : glm::max(top, height);
+				if (type == EMPTY) type = pieceType;
 			}
-
-			for (uint32 v = 0; v < srcMesh->vertexCount; v++)
+			if (type == EMPTY)
 			{
-				sourceVertex = srcMesh->vertices[v];
+				type = 1;
+				top = nodeSets.GetNodeShape(1, 1, 2)->top;
+			}
+
+			//the same test the full detail mesh merges tops with
+			byte fullType = CellType(cell, 0);
+			bool full = fullType != EMPTY && fullType <= nodeSets.count && CellShape(cell, 0) == 1 &&
+				CellLayer(cell, 0) == 2 && nodeSets.sets[fullType-1].mergeableTop && CellShape(cell, 1) == 0 &&
+				CellShape(cell, 2) == 0 && CellShape(cell, 3) == 0;
+
+			if (!(columns[x] & (1u << z)))
+				bottomLayer[x][z] = (byte)y;
+			columns[x] |= (uint16)(1u << z);
+			if (full) mergeable[x] |= (uint16)(1u << z);
+			else mergeable[x] &= (uint16)~(1u << z);
+			topType[x][z] = type;
+			topLayer[x][z] = (byte)y;
+			pieceTop[x][z] = top;
+		}
+	}
+
+	//a box is its top and at most four sides of four vertices each
+	uint32 boxCount[MAX_NODE_TYPES] = {0};
+	for (uint32 x = 0; x < LEVEL_CHUNK_WIDTH; x++)
+	for (uint32 z = 0; z < LEVEL_CHUNK_WIDTH; z++)
+	{
+		if (topType[x][z] != EMPTY)
+			boxCount[topType[x][z]-1]++;
+	}
+	for (uint32 t = 0; t < nodeSets.count; t++)
+	{
+		//merged tops are the F_T, the rest a quad
+		const Mesh& top = nodeSets.GetNodeShape((unsigned char)(t+1), 1, 2)->mesh;
+		uint32 topVertices = glm::max(top.vertexCount, 4u);
+		uint32 topIndices = glm::max(top.indexCount, 6u);
+		if (!GrowGeometryMesh(meshes[t], boxCount[t]*(topVertices + 16), boxCount[t]*(topIndices + 24)))
+		{
+			LOG_ERROR("Failed to commit the coarse mesh of geometry chunk %u,%u, it will always be drawn in full\n",
+				chunkX, chunkZ);
+			return;
+		}
+	}
+
+	//how far above a cell's position the top of a full cell of each type is, and what the sides and unmerged tops
+	//look like
+	float topHeight[N];
+	Vertex style[N];
+	for (uint32 t = 0; t < N && t < nodeSets.count; t++)
+	{
+		const Mesh& top = nodeSets.GetNodeShape((unsigned char)(t+1), 1, 2)->mesh;
+		topHeight[t] = top.vertexCount > 0 ? top.vertices[0].position.y : CELL_HALF;
+		style[t] = top.vertexCount > 0 ? top.vertices[0] :
+			Vertex(vec3f(0.0f), vec3f(0.0f, 1.0f, 0.0f), vec2f(0.0f), vec4f(1.0f));
+	}
+
+	uint32 xStart = chunkX * LEVEL_CHUNK_WIDTH;
+	uint32 zStart = chunkZ * LEVEL_CHUNK_WIDTH;
+	//where each column's box ends, the F_T tops sit where the full cell's F_T does
+	float boxTop[LEVEL_CHUNK_WIDTH][LEVEL_CHUNK_WIDTH];
+	for (uint32 x = 0; x < LEVEL_CHUNK_WIDTH; x++)
+	for (uint32 z = 0; z < LEVEL_CHUNK_WIDTH; z++)
+	{
+		if (topType[x][z] == EMPTY) continue;
+		bool merges = (mergeable[x] >> z) & 1;
+		boxTop[x][z] = topLayer[x][z]*CELL_SIZE + (merges ? topHeight[topType[x][z]-1] : pieceTop[x][z]);
+	}
+
+	uint16 remaining[LEVEL_CHUNK_WIDTH];
+	SDL_memcpy(remaining, columns, sizeof(columns));
+	for (uint32 x0 = 0; x0 < LEVEL_CHUNK_WIDTH; x0++)
+	while (remaining[x0] != 0)
+	{
+		//the run of z from the first column left in this row with the same top, then as many rows on as match it
+		uint32 z0 = CountTrailingZeros(remaining[x0]);
+		byte type = topType[x0][z0];
+		float height = boxTop[x0][z0];
+		uint16 kind = (mergeable[x0] >> z0) & 1 ? 0xFFFF : 0;
+		uint32 z1 = z0;
+		while (z1 + 1 < LEVEL_CHUNK_WIDTH && (remaining[x0] & (1u << (z1 + 1))) &&
+			((mergeable[x0] ^ kind) & (1u << (z1 + 1))) == 0 && topType[x0][z1 + 1] == type &&
+			boxTop[x0][z1 + 1] == height)
+			z1++;
+		uint16 run = (uint16)BitRange(z0, z1);
+
+		uint32 x1 = x0;
+		for (bool matches = true; matches && x1 + 1 < LEVEL_CHUNK_WIDTH; )
+		{
+			matches = (remaining[x1 + 1] & run) == run && ((mergeable[x1 + 1] ^ kind) & run) == 0;
+			for (uint32 z = z0; z <= z1 && matches; z++)
+				matches = topType[x1 + 1][z] == type && boxTop[x1 + 1][z] == height;
+			if (matches) x1++;
+		}
+
+		for (uint32 x = x0; x <= x1; x++)
+			remaining[x] &= ~run;
+		vec3f cellPos = vec3f((xStart + x0)*CELL_SIZE, topLayer[x0][z0]*CELL_SIZE, (zStart + z0)*CELL_SIZE);
+		if (kind)
+			AppendMergedTop(meshes[type-1], nodeSets.sets[type-1], nodeSets.GetNodeShape(type, 1, 2)->mesh,
+				cellPos, x1 - x0, z1 - z0);
+		else
+			AppendCoarseTop(meshes[type-1], style[type-1], cellPos, x1 - x0, z1 - z0, height);
+	}
+
+	const int sideX[4] = {1, -1, 0, 0};
+	const int sideZ[4] = {0, 0, 1, -1};
+	for (uint32 x = 0; x < LEVEL_CHUNK_WIDTH; x++)
+	for (uint32 z = 0; z < LEVEL_CHUNK_WIDTH; z++)
+	{
+		byte type = topType[x][z];
+		if (type == EMPTY) continue;
+
+		float top = boxTop[x][z];
+		float columnBottom = bottomLayer[x][z]*CELL_SIZE + topHeight[type-1] - CELL_SIZE;
+		vec3f cellPos = vec3f((xStart + x)*CELL_SIZE, 0.0f, (zStart + z)*CELL_SIZE);
+		for (uint32 s = 0; s < 4; s++)
+		{
+			//off the edge of the chunk or next to an empty column counts as open all the way down
+			uint32 nx = x + sideX[s];
+			uint32 nz = z + sideZ[s];
+			float bottom = columnBottom;
+			if (nx < LEVEL_CHUNK_WIDTH && nz < LEVEL_CHUNK_WIDTH && topType[nx][nz] != EMPTY)
+				bottom = glm::max(columnBottom, boxTop[nx][nz]);
+			if (bottom >= top) continue;
+
+			AppendCoarseSide(meshes[type-1], style[type-1], cellPos, vec3f((float)sideX[s], 0.0f, (float)sideZ[s]),
+				bottom, top);
+		}
+	}
+}
+
+//Builds the geometry of one chunk into meshes, one per node type. column is the chunk's level chunk for y = 0 and
+//the one for layer y is y*columnStride further on, so columns that aren't in level.chunks yet can be built too.
+//Only reads the level and node sets, so it can run off the main thread.
+//Triangles with solid cells right in front of them are left out, and the flat tops of full cells are merged into
+//rectangles where the node set allows it (see PrepareNodeSetOcclusion)
+template <uint32 N>
+void BuildGeometryChunk(const Level& level, const LevelChunk* column, uint32 columnStride, NodeSetPalette<N>& nodeSets,
+	GeometryMesh* meshes, uint32 chunkX, uint32 chunkZ, bool packVertices)
+{
+	uint32 levelWidth = level.width;
+	uint32 levelHeight = level.height;
+	uint32 xStart = chunkX * LEVEL_CHUNK_WIDTH;
+	uint32 zStart = chunkZ * LEVEL_CHUNK_WIDTH;
+	uint32 xEnd = glm::min(xStart + LEVEL_CHUNK_WIDTH, levelWidth);
+
+	unsigned char type = 0;
+	unsigned char shape = 0;
+	unsigned char layer = 0;
+	vec3f cellPos     = {0.0,0.0,0.0};
 
-				sourceVertex.position = ROTATION_TABLE[i] * sourceVertex.position;
-				sourceVertex.position += cellPos;
+	for (int i = 0; i < MAX_NODE_TYPES; i++)
+	{
+		meshes[i].vertexCount = 0;
+		meshes[i].indexCount = 0;
+		meshes[i].indexType = GL_UNSIGNED_SHORT;
+		meshes[i].vertexSize = sizeof(Vertex);
+		meshes[i].coarseIndexStart = 0;
+	}
+
+	bool anyMergeable = false;
+	for (uint32 t = 0; t < nodeSets.count; t++)
+		anyMergeable |= nodeSets.sets[t].mergeableTop;
 
-				sourceVertex.normal   = ROTATION_TABLE[i] * sourceVertex.normal;
+	uint16 solid[MAX_LEVEL_HEIGHT][LEVEL_CHUNK_WIDTH];
+	FindSolidCells(column, columnStride, levelHeight, solid);
 
-				dstMesh->vertices[dstMesh->vertexCount] = sourceVertex;
+	//geometry chunks are the same squares as the level chunks, so each layer is one level chunk
+	for (uint32 y = 0; y < levelHeight; y++)
+	{
+		const LevelChunk& levelChunk = column[y*columnStride];
+		if (LevelChunkIsEmpty(levelChunk)) continue;
+
+		//full cells showing their whole top, per type, then covered by as few rectangles as it takes. Their cells
+		//are skipped below
+		uint16 merged[LEVEL_CHUNK_WIDTH] = {0};
+		if (anyMergeable)
+		{
+			uint16 tops[N][LEVEL_CHUNK_WIDTH] = {{0}};
+			for (uint32 x = xStart; x < xEnd; x++)
+			for (uint32 row = levelChunk.occupied[x - xStart]; row != 0; row &= row-1)
+			{
+				uint32 z = CountTrailingZeros(row);
+				const NodeCell& cell = GetLevelChunkCell(levelChunk, x, z);
+				type = CellType(cell, 0);
+				if (type == EMPTY || type > nodeSets.count || CellShape(cell, 0) != 1 || CellLayer(cell, 0) != 2 ||
+					!nodeSets.sets[type-1].mergeableTop)
+					continue;
+				if (CellShape(cell, 1) != 0 || CellShape(cell, 2) != 0 || CellShape(cell, 3) != 0) continue;
+
+				const NodeShape* top = nodeSets.GetNodeShape(type, 1, 2);
+				uint32 solidCells = SolidNeighbourhood(solid, levelHeight, x - xStart, y, z);
+				uint32 triangleCount = top->mesh.indexCount/3;
+				bool hidden = false;
+				for (uint32 t = 0; t < triangleCount; t++)
+					hidden |= (top->occlusion[t] & ~solidCells) == 0;
+				if (!hidden)
+					tops[type-1][x - xStart] |= (uint16)(1u << z);
+			}
 
-				dstMesh->vertexCount++;
+			for (uint32 t = 0; t < N; t++)
+			{
+				const Mesh& top = nodeSets.GetNodeShape((unsigned char)(t+1), 1, 2)->mesh;
+				GeometryMesh& dstMesh = meshes[t];
+				for (uint32 x0 = 0; x0 < LEVEL_CHUNK_WIDTH; x0++)
+				while (tops[t][x0] != 0)
+				{
+					//the first run of z in this row, then as many rows on as have all of that run too
+					uint32 z0 = CountTrailingZeros(tops[t][x0]);
+					uint32 runLength = CountTrailingZeros(~((uint32)tops[t][x0] >> z0));
+					uint16 run = (uint16)BitRange(z0, z0 + runLength - 1);
+					uint32 x1 = x0;
+					while (x1 + 1 < LEVEL_CHUNK_WIDTH && (tops[t][x1 + 1] & run) == run)
+						x1++;
+
+					if (!GrowGeometryMesh(dstMesh, top.vertexCount, top.indexCount))
+					{
+						//leaves the cells to go through one at a time, which reports the failure
+						tops[t][x0] &= ~run;
+						continue;
+					}
+
+					for (uint32 x = x0; x <= x1; x++)
+					{
+						tops[t][x] &= ~run;
+						merged[x] |= run;
+					}
+					AppendMergedTop(dstMesh, nodeSets.sets[t], top,
+						vec3f((xStart + x0)*CELL_SIZE, y*CELL_SIZE, (zStart + z0)*CELL_SIZE), x1 - x0, runLength - 1);
+				}
 			}
 		}
 
-		cell++;
+		//only the occupied cells of each row, lowest z first
+		for (uint32 x = xStart; x < xEnd; x++)
+		for (uint32 row = levelChunk.occupied[x - xStart] & ~merged[x - xStart]; row != 0; row &= row-1)
+		{
+			uint32 z = zStart + CountTrailingZeros(row);
+			const NodeCell* cell = &GetLevelChunkCell(levelChunk, x, z);
+			cellPos = vec3f(x*CELL_SIZE,y*CELL_SIZE,z*CELL_SIZE);
+			uint32 solidCells = SolidNeighbourhood(solid, levelHeight, x - xStart, y, z - zStart);
+			for (int i = 0; i < 4; i++)
+			{
+				type  = CellType(*cell, i);
+				shape = CellShape(*cell, i);
+				layer = CellLayer(*cell, i);
+
+				if (type == EMPTY || shape == 0) continue;
+
+				if (type > nodeSets.count)
+				{
+					LOG_WARN("Unsupported node type found in Level! (type: %d)\n",type);
+					type = 1;
+				}
+
+				NodeShape* piece = nodeSets.GetNodeShape(type,shape,layer);
+				Mesh* srcMesh = &piece->mesh;
+				GeometryMesh* dstMesh = &(meshes[type-1]);
+
+				ASSERT((srcMesh != NULL), __FILE__, __LINE__);
+				if (srcMesh == NULL) continue;
+				ASSERT((dstMesh->vertices != NULL), __FILE__, __LINE__);
+
+				if (!GrowGeometryMesh(*dstMesh, srcMesh->vertexCount, srcMesh->indexCount))
+				{
+					LOG_ERROR("Failed to commit memory for geometry chunk %u,%u (node type %d)\n", chunkX, chunkZ, type);
+					continue;
+				}
+
+				//each triangle is only checked when the cells all of them need are solid
+				uint32 indexCount = srcMesh->indexCount;
+				if ((piece->sharedOcclusion[i] & ~solidCells) != 0)
+					RebaseIndices(dstMesh->indices + dstMesh->indexCount, srcMesh->indices, indexCount, dstMesh->vertexCount);
+				else
+					indexCount = AppendVisibleTriangles(dstMesh->indices + dstMesh->indexCount, srcMesh->indices,
+						piece->occlusion + i*(srcMesh->indexCount/3), srcMesh->indexCount/3, solidCells, dstMesh->vertexCount);
+				if (indexCount == 0) continue;
+				dstMesh->indexCount += indexCount;
+
+				//the node set has the piece turned for quadrant i already
+				TranslateVertices(dstMesh->vertices + dstMesh->vertexCount, nodeSets.GetNodePieceVertices(type, srcMesh, i),
+					srcMesh->vertexCount, cellPos);
+				dstMesh->vertexCount += srcMesh->vertexCount;
+			}
+		}
 	}
 
+	BuildCoarseGeometry(column, columnStride, levelHeight, nodeSets, meshes, chunkX, chunkZ);
+
+	//narrowed and packed here rather than at upload so it happens on whichever thread built the chunk
 	for (int i = 0; i < MAX_NODE_TYPES; i++)
 	{
-		if (level.nodeTypeGeometyBufferMap[i] < 0) continue;
+		if (meshes[i].vertexCount > 0xFFFF)
+			meshes[i].indexType = GL_UNSIGNED_INT;
+		else
+			NarrowGeometryIndices(meshes[i].indices, meshes[i].indexCount);
 
-		MeshBufferHandle* handle = &(geometryBuffer.handles[i]);
-		Mesh* mesh = &(geometryBuffer.meshes[i]);
+		if (packVertices)
+			PackGeometryVertices(meshes[i], vec3f(xStart*CELL_SIZE, 0.0f, zStart*CELL_SIZE));
+	}
+}
+
+//Uploads meshes built by BuildGeometryChunk to the chunk's buffers, returns how many bytes that was
+uint64 UploadGeometryChunk(GeometryChunk& chunk, GeometryMesh* meshes)
+{
+	uint64 uploadedBytes = 0;
+	chunk.hasCoarse = false;
+	for (int i = 0; i < MAX_NODE_TYPES; i++)
+	{
+		MeshBufferHandle* handle = &(chunk.handles[i]);
+		GeometryMesh* mesh = &(meshes[i]);
+		chunk.coarseIndexStart[i] = mesh->coarseIndexStart;
+		chunk.hasCoarse |= mesh->coarseIndexStart < mesh->indexCount;
+		if (mesh->indexCount == 0 && handle->vboID == 0) continue;
+
+		if (handle->vboID == 0)
+			*handle = CreateEmptyMeshBuffer();
 		handle->indexCount = mesh->indexCount;
+		handle->indexType = mesh->indexType;
+		handle->vertexSize = mesh->vertexSize;
+		uint32 indexSize = mesh->indexType == GL_UNSIGNED_INT ? sizeof(uint32) : sizeof(uint16);
 
 		glBindBuffer(GL_ARRAY_BUFFER, handle->vboID);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * mesh->vertexCount, (const void*)(mesh->vertices), GL_DYNAMIC_DRAW);
+		glBufferData(GL_ARRAY_BUFFER, (uint64)mesh->vertexSize * mesh->vertexCount, (const void*)(mesh->vertices), GL_DYNAMIC_DRAW);
 
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, handle->iboID);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint16) * mesh->indexCount, (const void*)(mesh->indices), GL_DYNAMIC_DRAW);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, (uint64)indexSize * mesh->indexCount, (const void*)(mesh->indices), GL_DYNAMIC_DRAW);
+		uploadedBytes += (uint64)mesh->vertexSize * mesh->vertexCount + (uint64)indexSize * mesh->indexCount;
 	}
+	chunk.coarse &= chunk.hasCoarse;
+	chunk.dirty = false;
+	return uploadedBytes;
+}
 
-	/*geometryBuffers.indexCount = indexCount;
+//Builds the geometry of one of the level's chunks into meshes, a column with nothing in it just empties them
+template <uint32 N>
+void BuildLevelGeometryChunk(const Level& level, NodeSetPalette<N>& nodeSets, uint32 chunksPerRow, uint32 chunkIndex,
+	GeometryMesh* meshes, bool packVertices)
+{
+	uint32 chunkX = chunkIndex / chunksPerRow;
+	uint32 chunkZ = chunkIndex % chunksPerRow;
+	if (level.occupiedColumns[chunkX] & (1ull << chunkZ))
+	{
+		BuildGeometryChunk(level, &level.chunks[LevelChunkIndex(chunkX, 0, chunkZ, level.chunksPerRow)],
+			level.chunksPerRow*level.chunksPerRow, nodeSets, meshes, chunkX, chunkZ, packVertices);
+		return;
+	}
 
-	glUnmapBuffer(GL_ARRAY_BUFFER);
-	glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);*/
+	for (int i = 0; i < MAX_NODE_TYPES; i++)
+	{
+		meshes[i].vertexCount = 0;
+		meshes[i].indexCount = 0;
+		meshes[i].indexType = GL_UNSIGNED_SHORT;
+		meshes[i].vertexSize = sizeof(Vertex);
+		meshes[i].coarseIndexStart = 0;
+	}
+}
+
+template <uint32 N>
+struct GeometryChunkJobData
+{
+	const Level* level;
+	NodeSetPalette<N>* nodeSets;
+	GeometryBuffer* geometryBuffer;
+	const uint32* chunkIndices; //job i builds chunkIndices[i] into whichever staging set it was given
+};
+
+template <uint32 N>
+void BuildLevelGeometryChunkJob(void* data, uint32 jobIndex, uint32 slot)
+{
+	GeometryChunkJobData<N>* job = (GeometryChunkJobData<N>*)data;
+	BuildLevelGeometryChunk(*job->level, *job->nodeSets, job->geometryBuffer->chunksPerRow,
+		job->chunkIndices[jobIndex], job->geometryBuffer->meshes[slot], job->geometryBuffer->packedVertices);
+}
+
+//Re-meshes only the chunks that were marked dirty, returns how many that was. The chunks are staged jobs with a
+//staging set each: the workers keep building into whichever sets are free while the main thread uploads the ones
+//that are done, so uploads overlap the meshing and chunks go up in the order they finish. Every chunk is built on
+//its own the same way whichever thread gets it, so what ends up on the GPU doesn't depend on the number of threads
+template <uint32 N>
+uint32 UpdateDirtyGeometryChunks(const Level& level, NodeSetPalette<N>& nodeSets, GeometryBuffer& geometryBuffer,
+	JobSystem& jobs)
+{
+	uint32 dirty[MAX_GEOMETRY_CHUNKS];
+	uint32 dirtyCount = 0;
+	for (uint32 c = 0; c < geometryBuffer.chunkCount; c++)
+	{
+		if (geometryBuffer.chunks[c].dirty)
+			dirty[dirtyCount++] = c;
+	}
+	if (dirtyCount == 0) return 0;
+
+	GeometryChunkJobData<N> job;
+	job.level = &level;
+	job.nodeSets = &nodeSets;
+	job.geometryBuffer = &geometryBuffer;
+	job.chunkIndices = dirty;
+
+	StagedJobBatch staged;
+	BeginStagedJobs(jobs, staged, dirtyCount, geometryBuffer.stagingSetCount, BuildLevelGeometryChunkJob<N>, &job);
+	uint32 jobIndex, slot;
+	while (NextStagedJob(jobs, staged, &jobIndex, &slot))
+		UploadGeometryChunk(geometryBuffer.chunks[dirty[jobIndex]], geometryBuffer.meshes[slot]);
+	return dirtyCount;
+}
+
+//Picks which of its meshes each chunk is drawn with from how big it comes out on screen. pixelScale is how many
+//pixels something one unit across covers one unit in front of the camera, the projection's y scale times half the
+//viewport height. A chunk's size is its width over the distance to the nearest point of it, so the camera being
+//inside a chunk always has it in full
+void UpdateGeometryLevelOfDetail(GeometryBuffer& geometryBuffer, const Level& level, vec3f cameraPosition,
+	float pixelScale)
+{
+	float chunkSize = LEVEL_CHUNK_WIDTH*CELL_SIZE;
+	float chunkHeight = level.height*CELL_SIZE;
+	for (uint32 c = 0; c < geometryBuffer.chunkCount; c++)
+	{
+		GeometryChunk& chunk = geometryBuffer.chunks[c];
+		if (!chunk.hasCoarse || geometryBuffer.lodPixels <= 0.0f)
+		{
+			chunk.coarse = false;
+			continue;
+		}
+
+		//cells are centred on their positions so the chunk starts half a cell back
+		vec3f boundsMin = vec3f((c / geometryBuffer.chunksPerRow)*chunkSize - CELL_HALF, -CELL_SIZE,
+			(c % geometryBuffer.chunksPerRow)*chunkSize - CELL_HALF);
+		vec3f boundsMax = boundsMin + vec3f(chunkSize, chunkHeight + 2.0f*CELL_SIZE, chunkSize);
+		float distance = glm::length(cameraPosition - glm::clamp(cameraPosition, boundsMin, boundsMax));
+
+		float pixels = chunkSize*pixelScale;
+		float threshold = geometryBuffer.lodPixels * (chunk.coarse ? GEO_LOD_HYSTERESIS : 1.0f);
+		chunk.coarse = pixels < threshold*distance;
+	}
+}
+
+void DrawGeometryType(const GeometryBuffer& geometryBuffer, uint32 type)
+{
+	for (uint32 c = 0; c < geometryBuffer.chunkCount; c++)
+	{
+		const GeometryChunk& chunk = geometryBuffer.chunks[c];
+		const MeshBufferHandle& handle = chunk.handles[type];
+		uint32 firstIndex = chunk.coarse ? chunk.coarseIndexStart[type] : 0;
+		uint32 indexCount = chunk.coarse ? handle.indexCount - firstIndex : chunk.coarseIndexStart[type];
+		if (indexCount == 0) continue;
+
+		if (handle.vertexSize == sizeof(PackedVertex))
+		{
+			float chunkSize = LEVEL_CHUNK_WIDTH*CELL_SIZE;
+			glVertexAttrib3f(PACKED_ORIGIN_ATTRIBUTE, (c / geometryBuffer.chunksPerRow)*chunkSize, 0.0f,
+				(c % geometryBuffer.chunksPerRow)*chunkSize);
+		}
+		DrawCall(handle, firstIndex, indexCount);
+	}
 }
 
 template<uint32 N>
-void RenderPass(uint32 objectUniformBuffer, const Level& level, const NodeSetPalette<N>& nodePalette, const ShaderAssetTable& shaderTable, const GeometryBuffer& geometryBuffer)
+void RenderPass(StreamBuffer& uniformStream, const Level& level, const NodeSetPalette<N>& nodePalette, const ShaderAssetTable& shaderTable, const GeometryBuffer& geometryBuffer)
 {
-	SetShaderModelMatrix(objectUniformBuffer, glm::identity<mat4f>());
+	SetShaderModelMatrix(uniformStream, glm::identity<mat4f>());
 	for (int i = 0; i < MAX_NODE_TYPES; i++)
 	{
 		if (level.nodeTypeGeometyBufferMap[i] < 0) continue;
 
 		SetShader(nodePalette.materials[i], shaderTable);
 
-		DrawCall(geometryBuffer.handles[i]);
+		DrawGeometryType(geometryBuffer, i);
 	}
 }
 
-void AddTextToQuadBuffer(std::string text, vec2f startPosition, float scale,
+void AddTextToQuadBuffer(const char* text, vec2f startPosition, float scale,
 						const UnicodeGlyphAtlas& fontAtlas,
  						float screenAspectRatio, QuadBuffer* buffer)
 {
@@ -291,8 +1233,9 @@ void AddTextToQuadBuffer(std::string text, vec2f startPosition, float scale,
 	Rect textRect;
 	vec2f position = startPosition;
 	float scaleX = scale/screenAspectRatio;
-	for (unsigned char c : text)
+	for (; *text != '\0'; text++)
 	{
+		unsigned char c = *text;
 		if (c == ' ')
 		{
 			position.x += fontAtlas.spaceWidth*scale;
@@ -322,13 +1265,25 @@ void AddTextToQuadBuffer(std::string text, vec2f startPosition, float scale,
 	}
 }
 
-void UploadQuadBuffer(const QuadBuffer& quadBufffer)
+//Writes this frame's quads into stream with the indices right after the vertices, see DrawQuadBuffer
+void UploadQuadBuffer(QuadBuffer& quadBufffer, StreamBuffer& stream)
 {
-	glBindBuffer(GL_ARRAY_BUFFER, quadBufffer.handle.vboID);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * quadBufffer.mesh.vertexCount,
-	 					(const void*)(quadBufffer.mesh.vertices), GL_DYNAMIC_DRAW);
+	uint32 vertexBytes = sizeof(Vertex) * quadBufffer.mesh.vertexCount;
+	uint32 indexBytes = sizeof(uint16) * quadBufffer.mesh.indexCount;
+	uint32 offset = ReserveStreamBuffer(stream, vertexBytes + indexBytes);
+	FillStreamBuffer(stream, offset, quadBufffer.mesh.vertices, vertexBytes);
+	FillStreamBuffer(stream, offset + vertexBytes, quadBufffer.mesh.indices, indexBytes);
+
+	quadBufffer.handle.vboID = stream.glID;
+	quadBufffer.handle.iboID = stream.glID;
+	quadBufffer.vertexOffset = offset;
+	quadBufffer.indexOffset = offset + vertexBytes;
+}
 
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, quadBufffer.handle.iboID);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint16) * quadBufffer.mesh.indexCount,
-	 					(const void*)(quadBufffer.mesh.indices), GL_DYNAMIC_DRAW);
+void DrawQuadBuffer(const QuadBuffer& quadBuffer)
+{
+	glBindVertexBuffer(0, quadBuffer.handle.vboID, quadBuffer.vertexOffset, sizeof(Vertex));
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, quadBuffer.handle.iboID);
+	glDrawElements(GL_TRIANGLES, quadBuffer.handle.indexCount, GL_UNSIGNED_SHORT,
+		(const void*)(uintptr_t)quadBuffer.indexOffset);
 }
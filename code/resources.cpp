@@ -103,12 +103,20 @@ uint32 CreateShader(const char* vertexSource, const char* fragmentSource)
 	return program;
 }
 
-uint32 LoadShader(const char* vertexShaderFilepath, const char* fragmentShaderFilepath)
+//vertexDefines (ie "#define PACKED_VERTEX\n") go in right after the vertex shader's #version line
+uint32 LoadShader(const char* vertexShaderFilepath, const char* fragmentShaderFilepath, const char* vertexDefines = NULL)
 {
 	void* vertexSource = LoadFile(vertexShaderFilepath);
 	void* fragmentSource = LoadFile(fragmentShaderFilepath);
 
-	uint32 shader = CreateShader((const char*)vertexSource, (const char*)fragmentSource);
+	std::string vertexText = (const char*)vertexSource;
+	if (vertexDefines != NULL)
+	{
+		size_t versionEnd = vertexText.find('\n');
+		vertexText.insert(versionEnd == std::string::npos ? vertexText.size() : versionEnd + 1, vertexDefines);
+	}
+
+	uint32 shader = CreateShader(vertexText.c_str(), (const char*)fragmentSource);
 
 	SDL_free(vertexSource);
 	SDL_free(fragmentSource);
@@ -141,7 +149,61 @@ struct MeshImportView
 	bool skinned;
 };
 
-using json = nlohmann::json;
+//nlohmann default constructs its allocators, so the arena the asset loaders parse into has to be set
+//per thread by a JsonArenaScope rather than handed to the allocator
+thread_local ScratchArena* JsonScratchArena = NULL;
+
+template<typename T>
+struct JsonArenaAllocator
+{
+    typedef T value_type;
+
+    JsonArenaAllocator() {}
+
+    template<typename U>
+    JsonArenaAllocator(const JsonArenaAllocator<U>& other) {}
+
+    T* allocate(size_t count)
+    {
+        ASSERT((JsonScratchArena != NULL), __FILE__, __LINE__);
+        return (T*)JsonScratchArena->Push(count*sizeof(T), alignof(T));
+    }
+
+    void deallocate(T* memory, size_t count) {}
+};
+
+template<typename T, typename U>
+bool operator==(const JsonArenaAllocator<T>& a, const JsonArenaAllocator<U>& b) { return true; }
+template<typename T, typename U>
+bool operator!=(const JsonArenaAllocator<T>& a, const JsonArenaAllocator<U>& b) { return false; }
+
+//Everything parsed while one of these is alive lands in the arena and is released in one go when it goes out
+//of scope, so declare it before the json it is meant to cover
+struct JsonArenaScope
+{
+    ScratchArena* arena;
+    ScratchArena* previousArena;
+    ScratchMarker marker;
+
+    JsonArenaScope(ScratchArena& scratch)
+    {
+        arena = &scratch;
+        previousArena = JsonScratchArena;
+        marker = scratch.GetMarker();
+        JsonScratchArena = arena;
+    }
+
+    ~JsonArenaScope()
+    {
+        JsonScratchArena = previousArena;
+        arena->PopToMarker(marker);
+    }
+};
+
+//NOTE: strings still use std::string, only ones longer than the small string buffer
+// (long node names mostly) end up on the heap
+using json = nlohmann::basic_json<std::map, std::vector, std::string, bool, std::int64_t,
+                                  std::uint64_t, double, JsonArenaAllocator>;
 BufferView GetBufferView(const json& jsonData, uint32 index)
 {
 	BufferView bv;
@@ -258,7 +320,7 @@ void FillSkinnedMeshBytes(const MeshImportView& view, byte* binaryData, byte* ve
 MeshImportView ExtractMeshImportView(const json& jsonData, uint32 meshIndex)
 {
 	//bool hasColors = !(jsonData["meshes"][0]["primitives"][0]["attributes"]["COLOR_0"].is_null());
-	json attributes = jsonData["meshes"][meshIndex]["primitives"][0]["attributes"];
+	const json& attributes = jsonData["meshes"][meshIndex]["primitives"][0]["attributes"];
 	bool hasColors = attributes.find("COLOR_0") != attributes.end();
 	bool skinned = attributes.find("JOINTS_0") != attributes.end();
 
@@ -360,9 +422,20 @@ SkinnedMesh ExtractSkinnedMesh(const MeshImportView& meshView, byte* bin, GameMe
 }
 
 
+void ReleaseMesh(Mesh& mesh, GameMemory& memory)
+{
+	if (mesh.vertices != NULL)
+		memory.meshVertexBlock.Release((uint32)(mesh.vertices - memory.meshVertexBlock.block), mesh.vertexCount);
+	if (mesh.indices != NULL)
+		memory.meshIndexBlock.Release((uint32)(mesh.indices - memory.meshIndexBlock.block), mesh.indexCount);
+
+	mesh = Mesh();
+}
+
 //TODO: refactor to allow multiple meshes per file
 Mesh LoadModel(const char* filepath, GameMemory& memory)
 {
+	JsonArenaScope jsonScope(memory.ThreadScratch());
 	void* file = LoadFile(filepath);
 	json jsonData = json::parse((char*)file);
 	byte* bin = (byte*)LoadFile(ExtractBinaryFilepath(filepath, jsonData).c_str());
@@ -474,6 +547,7 @@ struct QuaternionKeyframe
 
 ModelHierarchy LoadAnimatedModel(const char* filepath, GameMemory& memory)
 {
+	JsonArenaScope jsonScope(memory.ThreadScratch());
 	void* file = LoadFile(filepath);
 	json jsonData = json::parse((char*)file);
 	byte* bin = (byte*)LoadFile(ExtractBinaryFilepath(filepath, jsonData).c_str());
@@ -552,16 +626,23 @@ struct NodeSetImportData
 	uint32 layer;
 };
 
+//Geometry chunks only have room for every cell to be a piece this size, see GEO_MESH_MAX_VERTS
+inline bool NodePieceFits(const MeshImportView& view)
+{
+	return view.vertexCount <= NODE_PIECE_MAX_VERTS && view.indexCount <= NODE_PIECE_MAX_INDEX;
+}
+
 //TODO: Currently no error checking in place, assuming we're passing a valid node set import
 NodeSet LoadNodeSet(const char* filepath, GameMemory& memory)
 {
+	JsonArenaScope jsonScope(memory.ThreadScratch());
 	void* file = LoadFile(filepath);
 	json jsonData = json::parse((char*)file);
 	byte* bin = (byte*)LoadFile(ExtractBinaryFilepath(filepath, jsonData).c_str());
 
 	const uint32 meshCount = (uint32)jsonData["scenes"][0]["nodes"].size();
-	std::vector<MeshImportView> meshViews;
-	std::vector<NodeSetImportData> nodeSetImportData;
+	ScratchVector<MeshImportView> meshViews(&memory.ThreadScratch());
+	ScratchVector<NodeSetImportData> nodeSetImportData(&memory.ThreadScratch());
 	meshViews.reserve(meshCount);
 	nodeSetImportData.reserve(meshCount);
 
@@ -570,10 +651,19 @@ NodeSet LoadNodeSet(const char* filepath, GameMemory& memory)
 	for (uint32 i = 0; i < meshCount; i++)
 	{
 		meshViews.push_back(ExtractMeshImportView(jsonData, i));
-		totalVerts += meshViews[i].vertexCount;
-		totalIndices  += meshViews[i].indexCount;
-
-		std::string name = meshViews[i].name;
+		const std::string& name = meshViews[i].name;
+		if (NodePieceFits(meshViews[i]))
+		{
+			totalVerts += meshViews[i].vertexCount;
+			totalIndices  += meshViews[i].indexCount;
+		}
+		else
+		{
+			LOG_ERROR("Node set %s piece %s has %u vertices and %u indices, pieces can have at most %u and %u so it is left out\n",
+				filepath, name.c_str(), meshViews[i].vertexCount, meshViews[i].indexCount, NODE_PIECE_MAX_VERTS,
+				NODE_PIECE_MAX_INDEX);
+			ASSERT(false, __FILE__, __LINE__);
+		}
 		NodeSetImportData nsData = {0};
 
 		char nameConvBit = name[0];
@@ -616,22 +706,28 @@ NodeSet LoadNodeSet(const char* filepath, GameMemory& memory)
 		nodeSetImportData.push_back(nsData);
 	}
 
-	ASSERT(memory.meshVertexBlock.CanFit(totalVerts), __FILE__, __LINE__);
+	const uint32 rotationCount = sizeof(ROTATION_TABLE)/sizeof(ROTATION_TABLE[0]);
+	ASSERT(memory.meshVertexBlock.CanFit(totalVerts*rotationCount), __FILE__, __LINE__);
 	ASSERT(memory.meshIndexBlock.CanFit(totalIndices), __FILE__, __LINE__);
 
-	auto vertexRequest = memory.meshVertexBlock.RequestFromBlock(totalVerts);
+	auto vertexRequest = memory.meshVertexBlock.RequestFromBlock(totalVerts*rotationCount);
 	auto indexRequest = memory.meshIndexBlock.RequestFromBlock(totalIndices);
 	Vertex* vertices = vertexRequest.memory;
 	uint16* indices  = indexRequest.memory;
 
 	NodeSet nodeSet;
-	nodeSet.vertexCount = totalVerts;
+	nodeSet.vertices = vertices;
+	nodeSet.indices = indices;
+	nodeSet.vertexCount = totalVerts*rotationCount;
 	nodeSet.indexCount = totalIndices;
+	nodeSet.rotationStride = totalVerts;
 
 	for (uint32 i = 0; i < meshCount; i++)
 	{
 		NodeSetImportData& ns = nodeSetImportData[i];
 		MeshImportView& view = meshViews[i];
+		if (!NodePieceFits(view)) continue;
+
 		Mesh& mesh = nodeSet.shapeStacks[ns.type].layers[ns.layer].mesh;
 		mesh.vertexCount = view.vertexCount;
 		mesh.indexCount  = view.indexCount;
@@ -644,14 +740,548 @@ NodeSet LoadNodeSet(const char* filepath, GameMemory& memory)
 		indices += view.indexCount;
 	}
 
+	for (uint32 r = 1; r < rotationCount; r++)
+	for (uint32 v = 0; v < totalVerts; v++)
+	{
+		Vertex vertex = nodeSet.vertices[v];
+		vertex.position = ROTATION_TABLE[r] * vertex.position;
+		vertex.normal   = ROTATION_TABLE[r] * vertex.normal;
+		nodeSet.vertices[r*totalVerts + v] = vertex;
+	}
+
 	SDL_free(file);
 	SDL_free(bin);
 
 	return nodeSet;
 }
 
-LevelData LoadLevelData(const char* filepath, GameMemory& memory)
+//All the pieces of a node set come from one request so they go back as one range
+void ReleaseNodeSet(NodeSet& nodeSet, GameMemory& memory)
+{
+	if (nodeSet.vertices != NULL)
+		memory.meshVertexBlock.Release((uint32)(nodeSet.vertices - memory.meshVertexBlock.block), nodeSet.vertexCount);
+	if (nodeSet.indices != NULL)
+		memory.meshIndexBlock.Release((uint32)(nodeSet.indices - memory.meshIndexBlock.block), nodeSet.indexCount);
+	if (nodeSet.occlusion != NULL)
+		memory.nodeOcclusionBlock.Release((uint32)(nodeSet.occlusion - memory.nodeOcclusionBlock.block), nodeSet.occlusionCount);
+
+	nodeSet = NodeSet();
+}
+
+const float NODE_OCCLUSION_NUDGE = 0.01f; //how far in front of a triangle has to be solid
+const float NODE_OCCLUSION_SLACK = 0.001f; //a triangle only touching a cell's edge isn't in that cell
+
+//The cells a box of piece space overlaps as an occlusion mask, NODE_NEVER_OCCLUDED if it goes past the cells next
+//to the piece's own. Cells are CELL_SIZE wide centred on the piece's origin along x and z, along y the piece's own
+//cell starts at layerBottom
+inline uint32 NodeOcclusionMask(vec3f boxMin, vec3f boxMax, float layerBottom)
+{
+	int32 x0 = (int32)floorf(boxMin.x/CELL_SIZE + 0.5f + NODE_OCCLUSION_SLACK);
+	int32 x1 = (int32)floorf(boxMax.x/CELL_SIZE + 0.5f - NODE_OCCLUSION_SLACK);
+	int32 y0 = (int32)floorf((boxMin.y - layerBottom)/CELL_SIZE + NODE_OCCLUSION_SLACK);
+	int32 y1 = (int32)floorf((boxMax.y - layerBottom)/CELL_SIZE - NODE_OCCLUSION_SLACK);
+	int32 z0 = (int32)floorf(boxMin.z/CELL_SIZE + 0.5f + NODE_OCCLUSION_SLACK);
+	int32 z1 = (int32)floorf(boxMax.z/CELL_SIZE + 0.5f - NODE_OCCLUSION_SLACK);
+	if (x0 < -1 || y0 < -1 || z0 < -1 || x1 > 1 || y1 > 1 || z1 > 1) return NODE_NEVER_OCCLUDED;
+
+	uint32 mask = 0;
+	for (int32 y = y0; y <= y1; y++)
+	for (int32 x = x0; x <= x1; x++)
+	for (int32 z = z0; z <= z1; z++)
+		mask |= 1u << ((y+1)*9 + (x+1)*3 + (z+1));
+	return mask;
+}
+
+//F_T is a flat unit quad facing up and its uvs change by whole numbers from cell to cell, see NodeSet::mergeableTop.
+//Exported pieces are only that to within NODE_MERGE_TOLERANCE, uvs are usually pulled in a little from the edges
+const float NODE_MERGE_TOLERANCE = 0.001f;
+
+void FindMergeableTop(NodeSet& nodeSet)
 {
+	nodeSet.mergeableTop = false;
+	const Mesh& top = nodeSet.shapeStacks[0].layers[2].mesh;
+	if (top.vertexCount != 4 || top.indexCount != 6) return;
+
+	const Vertex* v = top.vertices;
+	const float half = 0.5f*CELL_SIZE;
+	for (uint32 i = 0; i < 4; i++)
+	{
+		if (glm::abs(glm::abs(v[i].position.x) - half) > NODE_MERGE_TOLERANCE ||
+			glm::abs(glm::abs(v[i].position.z) - half) > NODE_MERGE_TOLERANCE ||
+			glm::abs(v[i].position.y - v[0].position.y) > NODE_MERGE_TOLERANCE ||
+			glm::distance(v[i].normal, v[0].normal) > NODE_MERGE_TOLERANCE || v[i].color != v[0].color)
+			return;
+	}
+	if (v[0].normal.y < 1.0f - NODE_MERGE_TOLERANCE) return;
+
+	//the corners along x and along z from the first one give the uv change per cell
+	vec2f perX = vec2f(0.0f), perZ = vec2f(0.0f);
+	for (uint32 i = 1; i < 4; i++)
+	{
+		vec2f uvChange = v[i].uv0 - v[0].uv0;
+		if ((v[i].position.z > 0.0f) == (v[0].position.z > 0.0f)) perX = v[0].position.x > 0.0f ? -uvChange : uvChange;
+		if ((v[i].position.x > 0.0f) == (v[0].position.x > 0.0f)) perZ = v[0].position.z > 0.0f ? -uvChange : uvChange;
+	}
+	if (glm::any(glm::greaterThan(glm::abs(perX - glm::round(perX)), vec2f(NODE_MERGE_TOLERANCE))) ||
+		glm::any(glm::greaterThan(glm::abs(perZ - glm::round(perZ)), vec2f(NODE_MERGE_TOLERANCE))))
+		return;
+	perX = glm::round(perX);
+	perZ = glm::round(perZ);
+	for (uint32 i = 1; i < 4; i++)
+	{
+		float stepX = (v[i].position.x > 0.0f) == (v[0].position.x > 0.0f) ? 0.0f : (v[i].position.x > 0.0f ? 1.0f : -1.0f);
+		float stepZ = (v[i].position.z > 0.0f) == (v[0].position.z > 0.0f) ? 0.0f : (v[i].position.z > 0.0f ? 1.0f : -1.0f);
+		vec2f uv = v[0].uv0 + perX*stepX + perZ*stepZ;
+		if (glm::any(glm::greaterThan(glm::abs(uv - v[i].uv0), vec2f(NODE_MERGE_TOLERANCE*2.0f)))) return;
+	}
+
+	nodeSet.mergeableTop = true;
+	nodeSet.topUVPerX = perX;
+	nodeSet.topUVPerZ = perZ;
+}
+
+//Works out which piece triangles are hidden by the solid cells around them (see NodeShape::occlusion), which
+//sets can have their tops merged and how high each piece reaches. Needs every set loaded: a piece poking out of its cell could be the only thing
+//covering a neighbour's face, so solid cells are only trusted past the biggest overhang in the palette. Ramps are
+//left out of that since they lean over open cells rather than into solid ones
+template<uint32 N>
+void PrepareNodeSetOcclusion(NodeSetPalette<N>& palette, GameMemory& memory)
+{
+	const uint32 rotationCount = sizeof(ROTATION_TABLE)/sizeof(ROTATION_TABLE[0]);
+
+	//the top of F_T is the top of its layer
+	float layerBottom[N];
+	float overhang = 0.0f;
+	float overhangY = 0.0f;
+	for (uint32 s = 0; s < N; s++)
+	{
+		NodeSet& nodeSet = palette.sets[s];
+		const Mesh& top = nodeSet.shapeStacks[0].layers[2].mesh;
+		layerBottom[s] = top.vertexCount > 0 ? top.vertices[0].position.y - CELL_SIZE : -0.5f*CELL_SIZE;
+		FindMergeableTop(nodeSet);
+
+		for (uint32 shape = 0; shape < 5; shape++)
+		for (uint32 layer = 0; layer < 4; layer++)
+		{
+			NodeShape& piece = nodeSet.shapeStacks[shape].layers[layer];
+			piece.top = piece.mesh.vertexCount > 0 ? piece.mesh.vertices[0].position.y : 0.0f;
+			for (uint32 v = 1; v < piece.mesh.vertexCount; v++)
+				piece.top = glm::max(piece.top, piece.mesh.vertices[v].position.y);
+		}
+
+		for (uint32 shape = 0; shape < 5; shape++)
+		for (uint32 layer = 0; layer < 3; layer++)
+		{
+			const Mesh& mesh = nodeSet.shapeStacks[shape].layers[layer].mesh;
+			for (uint32 v = 0; v < mesh.vertexCount; v++)
+			{
+				vec3f p = mesh.vertices[v].position;
+				overhang  = glm::max(overhang, glm::max(glm::abs(p.x), glm::abs(p.z)) - 0.5f*CELL_SIZE);
+				overhangY = glm::max(overhangY, glm::max(p.y - (layerBottom[s] + CELL_SIZE), layerBottom[s] - p.y));
+			}
+		}
+	}
+	//sets that put their layers at different heights only fill part of each other's cells
+	float lowestLayer = layerBottom[0];
+	float highestLayer = layerBottom[0];
+	for (uint32 s = 1; s < N; s++)
+	{
+		lowestLayer = glm::min(lowestLayer, layerBottom[s]);
+		highestLayer = glm::max(highestLayer, layerBottom[s]);
+	}
+	overhangY += highestLayer - lowestLayer;
+	LOG_INFO("Node set overhang %f, %f vertically\n", overhang, overhangY);
+	const vec3f margin = vec3f(overhang, overhangY, overhang);
+
+	for (uint32 s = 0; s < N; s++)
+	{
+		NodeSet& nodeSet = palette.sets[s];
+		if (nodeSet.occlusion != NULL)
+			memory.nodeOcclusionBlock.Release((uint32)(nodeSet.occlusion - memory.nodeOcclusionBlock.block), nodeSet.occlusionCount);
+		nodeSet.occlusion = NULL;
+		nodeSet.occlusionCount = (nodeSet.indexCount/3)*rotationCount;
+		if (nodeSet.occlusionCount == 0) continue;
+
+		ASSERT(memory.nodeOcclusionBlock.CanFit(nodeSet.occlusionCount), __FILE__, __LINE__);
+		auto request = memory.nodeOcclusionBlock.RequestFromBlock(nodeSet.occlusionCount);
+		if (!request.valid)
+		{
+			nodeSet.occlusionCount = 0;
+			continue;
+		}
+		nodeSet.occlusion = request.memory;
+
+		uint32* masks = nodeSet.occlusion;
+		for (uint32 shape = 0; shape < 5; shape++)
+		for (uint32 layer = 0; layer < 4; layer++)
+		{
+			NodeShape& piece = nodeSet.shapeStacks[shape].layers[layer];
+			uint32 triangleCount = piece.mesh.indexCount/3;
+			piece.occlusion = masks;
+			for (uint32 r = 0; r < rotationCount; r++)
+			{
+				const Vertex* vertices = piece.mesh.vertices + r*nodeSet.rotationStride;
+				uint32 shared = ~0u;
+				for (uint32 t = 0; t < triangleCount; t++)
+				{
+					vec3f a = vertices[piece.mesh.indices[t*3 + 0]].position;
+					vec3f b = vertices[piece.mesh.indices[t*3 + 1]].position;
+					vec3f c = vertices[piece.mesh.indices[t*3 + 2]].position;
+					vec3f normal = glm::cross(b - a, c - a);
+					float area = glm::length(normal);
+
+					uint32 mask = NODE_NEVER_OCCLUDED;
+					if (area > 0.000001f)
+					{
+						vec3f nudge = normal*(NODE_OCCLUSION_NUDGE/area);
+						mask = NodeOcclusionMask(glm::min(glm::min(a, b), c) + nudge - margin,
+							glm::max(glm::max(a, b), c) + nudge + margin, layerBottom[s]);
+					}
+					masks[t] = mask;
+					shared &= mask;
+				}
+				piece.sharedOcclusion[r] = shared;
+				masks += triangleCount;
+			}
+		}
+	}
+}
+
+//Patches the piece meshes after GameMemory::meshVertexBlock/meshIndexBlock have been compacted
+void RelocateNodeSet(NodeSet& nodeSet, GameMemory& memory, const MemoryRangeMove* vertexMoves, uint32 vertexMoveCount,
+					 const MemoryRangeMove* indexMoves, uint32 indexMoveCount)
+{
+	RelocatePointer(nodeSet.vertices, memory.meshVertexBlock.block, vertexMoves, vertexMoveCount);
+	RelocatePointer(nodeSet.indices, memory.meshIndexBlock.block, indexMoves, indexMoveCount);
+	for (uint32 s = 0; s < 5; s++)
+	for (uint32 l = 0; l < 4; l++)
+	{
+		Mesh& mesh = nodeSet.shapeStacks[s].layers[l].mesh;
+		RelocatePointer(mesh.vertices, memory.meshVertexBlock.block, vertexMoves, vertexMoveCount);
+		RelocatePointer(mesh.indices, memory.meshIndexBlock.block, indexMoves, indexMoveCount);
+	}
+}
+
+//Slides the mesh blocks down over the ranges that have been released and patches the node sets to match. Any
+//other mesh still pointing into the blocks has to have been released before this
+template <uint32 N>
+void CompactMeshMemory(NodeSetPalette<N>& nodeSets, GameMemory& memory)
+{
+	MemoryRangeMove vertexMoves[MAX_FREE_RANGES];
+	MemoryRangeMove indexMoves[MAX_FREE_RANGES];
+	uint32 vertexMoveCount = memory.meshVertexBlock.Compact(vertexMoves);
+	uint32 indexMoveCount = memory.meshIndexBlock.Compact(indexMoves);
+	for (uint32 i = 0; i < N; i++)
+		RelocateNodeSet(nodeSets.sets[i], memory, vertexMoves, vertexMoveCount, indexMoves, indexMoveCount);
+}
+
+//Cheap 64 bit hash that only has to catch truncated or corrupted files. Four lanes so the multiplies don't wait on
+//each other, xor then multiply by an odd constant can't cancel out so any single changed word changes the result
+uint64 LevelChecksum(const void* data, uint64 size)
+{
+	const uint64 prime = 0x9E3779B97F4A7C15ull;
+	uint64 lanes[4] = { 1, 2, 3, 4 };
+	const byte* bytes = (const byte*)data;
+	uint64 blockCount = size / (4*sizeof(uint64));
+	for (uint64 b = 0; b < blockCount; b++, bytes += 4*sizeof(uint64))
+	{
+		for (uint32 l = 0; l < 4; l++)
+		{
+			uint64 word;
+			memcpy(&word, bytes + l*sizeof(uint64), sizeof(uint64));
+			lanes[l] = (lanes[l] ^ word) * prime;
+		}
+	}
+	for (uint64 i = blockCount*4*sizeof(uint64); i < size; i++, bytes++)
+		lanes[0] = (lanes[0] ^ *bytes) * prime;
+
+	uint64 hash = size;
+	for (uint32 l = 0; l < 4; l++)
+		hash = (hash ^ lanes[l]) * prime;
+	return hash ^ (hash >> 32);
+}
+
+bool HasFileExtension(const char* filepath, const char* extension)
+{
+	size_t pathLength = SDL_strlen(filepath);
+	size_t extensionLength = SDL_strlen(extension);
+	return pathLength >= extensionLength && SDL_strcmp(filepath + pathLength - extensionLength, extension) == 0;
+}
+
+inline uint32 LevelRecordSize(uint32 height)
+{
+	return LEVEL_CHUNK_CELLS*height*sizeof(GeometryNode);
+}
+
+inline bool SameNode(GeometryNode a, GeometryNode b)
+{
+	return a.type == b.type && a.slope == b.slope;
+}
+
+//Largest a compressed record can get, a raw record plus its header
+inline uint32 MaxCompressedLevelRecordSize(uint32 height)
+{
+	return sizeof(LevelRecordHeader) + LevelRecordSize(height);
+}
+
+//Writes whichever encoding comes out smallest into compressed, returns its size
+uint32 CompressLevelRecord(const GeometryNode* nodes, uint32 nodeCount, byte* compressed)
+{
+	GeometryNode palette[LEVEL_RECORD_MAX_PALETTE];
+	uint32 paletteCount = 0;
+	uint32 runCount = 0;
+	for (uint32 i = 0; i < nodeCount && paletteCount <= LEVEL_RECORD_MAX_PALETTE; i++)
+	{
+		runCount += i == 0 || !SameNode(nodes[i], nodes[i-1]) || (i % 256) == 0;
+		uint32 p = 0;
+		while (p < paletteCount && !SameNode(palette[p], nodes[i])) p++;
+		if (p == paletteCount && paletteCount++ < LEVEL_RECORD_MAX_PALETTE)
+			palette[p] = nodes[i];
+	}
+
+	LevelRecordHeader header = {};
+	byte* data = compressed + sizeof(LevelRecordHeader);
+	if (paletteCount > LEVEL_RECORD_MAX_PALETTE)
+	{
+		header.encoding = LevelRecordRaw;
+		SDL_memcpy(compressed, &header, sizeof(header));
+		SDL_memcpy(data, nodes, nodeCount*sizeof(GeometryNode));
+		return sizeof(header) + nodeCount*sizeof(GeometryNode);
+	}
+
+	//bit packed indices stay within a byte so they are 1, 2, 4 or 8 bits
+	uint32 bits = 0;
+	while ((1u << bits) < paletteCount) bits = bits ? bits*2 : 1;
+	header.paletteCount = (uint16)paletteCount;
+	header.bitsPerIndex = (byte)bits;
+	uint32 runLengthSize = runCount*2;
+	uint32 bitPackedSize = (nodeCount*bits + 7) / 8;
+	header.encoding = runLengthSize < bitPackedSize ? LevelRecordRunLength : LevelRecordBitPacked;
+
+	SDL_memcpy(compressed, &header, sizeof(header));
+	SDL_memcpy(data, palette, paletteCount*sizeof(GeometryNode));
+	data += paletteCount*sizeof(GeometryNode);
+	byte* indices = data;
+
+	uint32 p = 0;
+	if (header.encoding == LevelRecordRunLength)
+	{
+		for (uint32 i = 0; i < nodeCount; i++)
+		{
+			if (i > 0 && SameNode(nodes[i], nodes[i-1]) && (i % 256) != 0)
+			{
+				data[-1]++;
+				continue;
+			}
+			while (!SameNode(palette[p], nodes[i])) p = (p+1) % paletteCount;
+			*data++ = (byte)p;
+			*data++ = 0;
+		}
+	}
+	else
+	{
+		SDL_memset(data, 0, bitPackedSize);
+		for (uint32 i = 0; i < nodeCount && bits > 0; i++)
+		{
+			while (!SameNode(palette[p], nodes[i])) p = (p+1) % paletteCount;
+			uint32 bit = i*bits;
+			data[bit / 8] |= (byte)(p << (bit % 8));
+		}
+		data += bitPackedSize;
+	}
+
+	ASSERT(((uint32)(data - indices) == (header.encoding == LevelRecordRunLength ? runLengthSize : bitPackedSize)),
+		__FILE__, __LINE__);
+	return (uint32)(data - compressed);
+}
+
+//Checks every length against size as it goes, the checksum has already been checked but this is still file data
+bool DecompressLevelRecord(const byte* compressed, uint32 size, GeometryNode* nodes, uint32 nodeCount)
+{
+	LevelRecordHeader header;
+	if (size < sizeof(header)) return false;
+	SDL_memcpy(&header, compressed, sizeof(header));
+	const byte* data = compressed + sizeof(header);
+	const byte* end = compressed + size;
+
+	if (header.encoding == LevelRecordRaw)
+	{
+		if ((uint64)(end - data) != nodeCount*sizeof(GeometryNode)) return false;
+		SDL_memcpy(nodes, data, nodeCount*sizeof(GeometryNode));
+		return true;
+	}
+
+	GeometryNode palette[LEVEL_RECORD_MAX_PALETTE];
+	if (header.paletteCount == 0 || header.paletteCount > LEVEL_RECORD_MAX_PALETTE ||
+		(uint64)(end - data) < header.paletteCount*sizeof(GeometryNode)) return false;
+	SDL_memcpy(palette, data, header.paletteCount*sizeof(GeometryNode));
+	data += header.paletteCount*sizeof(GeometryNode);
+
+	if (header.encoding == LevelRecordRunLength)
+	{
+		uint32 i = 0;
+		for (; data + 1 < end; data += 2)
+		{
+			uint32 runLength = data[1] + 1u;
+			if (data[0] >= header.paletteCount || i + runLength > nodeCount) return false;
+			GeometryNode node = palette[data[0]];
+			for (uint32 r = 0; r < runLength; r++)
+				nodes[i++] = node;
+		}
+		return i == nodeCount && data == end;
+	}
+
+	uint32 bits = header.bitsPerIndex;
+	if (header.encoding != LevelRecordBitPacked || (bits != 0 && bits != 1 && bits != 2 && bits != 4 && bits != 8) ||
+		(uint64)(end - data) != (nodeCount*bits + 7) / 8) return false;
+
+	uint32 mask = (1u << bits) - 1;
+	for (uint32 i = 0; i < nodeCount; i++)
+	{
+		uint32 bit = i*bits;
+		uint32 p = bits ? (data[bit / 8] >> (bit % 8)) & mask : 0;
+		if (p >= header.paletteCount) return false;
+		nodes[i] = palette[p];
+	}
+	return true;
+}
+
+//Maps the file, no parsing. Version 1 points the level data straight at the payload. Version 2 only checks the record
+//list and hands back empty nodes in levelNodeBlock, the records are copied in with LoadLevelRecord as they are needed.
+//The mapping is copy on write so SetLevelNode can still edit version 1 nodes, it lives until UnloadLevel
+LevelData LoadLevelDataBinary(const char* filepath, GameMemory& memory)
+{
+	LevelData levelData = {};
+	PlatformUnmapFile(memory.levelFile);
+	if (!PlatformMapFile(filepath, &memory.levelFile))
+	{
+		LOG_ERROR("Failed to open level file %s\n", filepath);
+		ASSERT(false, __FILE__, __LINE__);
+		return levelData;
+	}
+
+	const LevelBinaryHeader* header = (const LevelBinaryHeader*)memory.levelFile.data;
+	uint64 fileSize = memory.levelFile.size;
+	bool valid = fileSize >= sizeof(LevelBinaryHeader) && header->magic == LEVEL_BINARY_MAGIC;
+	if (valid && header->version != 1 && header->version != LEVEL_BINARY_VERSION)
+	{
+		LOG_ERROR("Level file %s is version %u, expected %u\n", filepath, header->version, LEVEL_BINARY_VERSION);
+		valid = false;
+	}
+
+	bool chunked = valid && header->version >= 2;
+	bool compressed = valid && header->version >= 3;
+	uint64 totalSize = valid ? (uint64)header->width*header->width*header->height : 0;
+	uint32 recordsPerRow = valid ? (header->width + LEVEL_CHUNK_WIDTH-1) / LEVEL_CHUNK_WIDTH : 0;
+	uint64 checkedSize = chunked ? (uint64)recordsPerRow*recordsPerRow*sizeof(LevelChunkRecord) : totalSize*sizeof(GeometryNode);
+	valid = valid && header->width <= MAX_LEVEL_WIDTH && header->height <= MAX_LEVEL_HEIGHT &&
+		(chunked ? header->payloadSize >= checkedSize : header->payloadSize == checkedSize) &&
+		header->payloadOffset >= sizeof(LevelBinaryHeader) && header->payloadOffset + header->payloadSize <= fileSize;
+	const byte* payload = (const byte*)memory.levelFile.data + (valid ? header->payloadOffset : 0);
+	if (valid && LevelChecksum(payload, checkedSize) != header->checksum)
+	{
+		LOG_ERROR("Level file corrupted! Checksum does not match! %s\n", filepath);
+		valid = false;
+	}
+
+	if (!valid)
+	{
+		LOG_ERROR("Level file %s is not a valid binary level\n", filepath);
+		ASSERT(false, __FILE__, __LINE__);
+		PlatformUnmapFile(memory.levelFile);
+		return levelData;
+	}
+
+	levelData.width = header->width;
+	levelData.height = header->height;
+	levelData.totalSize = (uint32)totalSize;
+	SDL_memcpy(levelData.name, header->name, LEVEL_NAME_LENGTH);
+	levelData.name[LEVEL_NAME_LENGTH-1] = '\0';
+	if (chunked)
+	{
+		//fresh pages out of the block are zero, so records that haven't been read in are empty nodes
+		ASSERT(memory.levelNodeBlock.CanFit(levelData.totalSize), __FILE__, __LINE__);
+		levelData.nodes = memory.levelNodeBlock.RequestFromBlock(levelData.totalSize).memory;
+		levelData.records = (const LevelChunkRecord*)payload;
+		levelData.recordsCompressed = compressed;
+		levelData.recordFile = (const byte*)memory.levelFile.data;
+		levelData.recordFileSize = fileSize;
+		levelData.recordsPerRow = recordsPerRow;
+	}
+	else
+	{
+		levelData.nodes = (GeometryNode*)payload;
+	}
+	LOG_INFO("Level: %s has width of %d\n", levelData.name, levelData.width);
+
+	return levelData;
+}
+
+//Copies one chunk record out of the mapped file into its place in levelData.nodes, decompressing it first for
+//version 3 files. Only that record's pages get read from disk. Safe to call from any thread as long as two calls
+//never share a record
+bool LoadLevelRecord(LevelData& levelData, uint32 recordX, uint32 recordZ)
+{
+	ASSERT(levelData.records != NULL && recordX < levelData.recordsPerRow && recordZ < levelData.recordsPerRow,
+		__FILE__, __LINE__);
+	const LevelChunkRecord& record = levelData.records[recordX*levelData.recordsPerRow + recordZ];
+	uint32 nodeCount = LEVEL_CHUNK_CELLS*levelData.height;
+	bool sizeValid = levelData.recordsCompressed ?
+		record.size >= sizeof(LevelRecordHeader) && record.size <= MaxCompressedLevelRecordSize(levelData.height) :
+		record.size == LevelRecordSize(levelData.height);
+	if (!sizeValid || record.offset > levelData.recordFileSize ||
+		record.size > levelData.recordFileSize - record.offset)
+	{
+		LOG_ERROR("Level record %u,%u is out of bounds\n", recordX, recordZ);
+		return false;
+	}
+
+	const byte* data = levelData.recordFile + record.offset;
+	if (LevelChecksum(data, record.size) != record.checksum)
+	{
+		LOG_ERROR("Level record %u,%u corrupted! Checksum does not match!\n", recordX, recordZ);
+		return false;
+	}
+
+	GeometryNode decompressed[LEVEL_CHUNK_CELLS*MAX_LEVEL_HEIGHT];
+	const GeometryNode* nodes = (const GeometryNode*)data;
+	if (levelData.recordsCompressed)
+	{
+		if (!DecompressLevelRecord(data, record.size, decompressed, nodeCount))
+		{
+			LOG_ERROR("Level record %u,%u could not be decompressed\n", recordX, recordZ);
+			return false;
+		}
+		nodes = decompressed;
+	}
+
+	uint32 xStart = recordX*LEVEL_CHUNK_WIDTH;
+	uint32 zStart = recordZ*LEVEL_CHUNK_WIDTH;
+	uint32 xCount = std::min(LEVEL_CHUNK_WIDTH, levelData.width - xStart);
+	uint32 zCount = std::min(LEVEL_CHUNK_WIDTH, levelData.width - zStart);
+	for (uint32 y = 0; y < levelData.height; y++)
+	{
+		for (uint32 x = 0; x < xCount; x++)
+		{
+			SDL_memcpy(&levelData.nodes[LinearIndex(xStart + x, y, zStart, levelData.width)],
+				nodes + (y*LEVEL_CHUNK_WIDTH + x)*LEVEL_CHUNK_WIDTH, zCount*sizeof(GeometryNode));
+		}
+	}
+	return true;
+}
+
+bool LoadAllLevelRecords(LevelData& levelData)
+{
+	bool loaded = true;
+	for (uint32 x = 0; x < levelData.recordsPerRow; x++)
+		for (uint32 z = 0; z < levelData.recordsPerRow; z++)
+			loaded &= LoadLevelRecord(levelData, x, z);
+	return loaded;
+}
+
+LevelData LoadLevelDataJson(const char* filepath, GameMemory& memory)
+{
+	JsonArenaScope jsonScope(memory.ThreadScratch());
 	void* file = LoadFile(filepath);
 	json jsonData = json::parse((char*)file);
 
@@ -660,10 +1290,11 @@ LevelData LoadLevelData(const char* filepath, GameMemory& memory)
 	std::string name = jsonData["name"];
 	LOG_INFO("Level: %s has width of %d\n", name.c_str(), width);
 
-	std::vector<uint32> nodes = jsonData["nodes"];
-	std::vector<uint32> slopes = jsonData["slopes"];
+	//read straight out of the json arrays rather than converting them into intermediate vectors first
+	const json& nodes = jsonData["nodes"];
+	const json& slopes = jsonData["slopes"];
 
-	LevelData levelData;
+	LevelData levelData = {};
 	uint32 totalSize = width * width * height;
 
 	if (totalSize != nodes.size() || totalSize != slopes.size())
@@ -678,11 +1309,12 @@ LevelData LoadLevelData(const char* filepath, GameMemory& memory)
 	levelData.height = height;
 	levelData.totalSize = totalSize;
 	levelData.nodes = dataBlock;
+	SDL_strlcpy(levelData.name, name.c_str(), LEVEL_NAME_LENGTH);
 
 	for (uint32 index = 0; index < totalSize; index++)
 	{
-		dataBlock[index].type  = (byte)(nodes[index]);
-		dataBlock[index].slope = (byte)(slopes[index]);
+		dataBlock[index].type  = (byte)(nodes[index].get<uint32>());
+		dataBlock[index].slope = (byte)(slopes[index].get<uint32>());
 	}
 
 	SDL_free(file);
@@ -690,10 +1322,111 @@ LevelData LoadLevelData(const char* filepath, GameMemory& memory)
 	return levelData;
 }
 
+//.levelb files are mapped in place, anything else is treated as a .level json file
+LevelData LoadLevelData(const char* filepath, GameMemory& memory)
+{
+	if (HasFileExtension(filepath, ".levelb"))
+		return LoadLevelDataBinary(filepath, memory);
+	return LoadLevelDataJson(filepath, memory);
+}
+
+//Gathers the record at recordX, recordZ out of the dense nodes, see LevelChunkRecord
+void FillLevelRecord(const LevelData& levelData, uint32 recordX, uint32 recordZ, GeometryNode* record)
+{
+	SDL_memset(record, 0, LevelRecordSize(levelData.height));
+	uint32 xStart = recordX*LEVEL_CHUNK_WIDTH;
+	uint32 zStart = recordZ*LEVEL_CHUNK_WIDTH;
+	uint32 xCount = std::min(LEVEL_CHUNK_WIDTH, levelData.width - xStart);
+	uint32 zCount = std::min(LEVEL_CHUNK_WIDTH, levelData.width - zStart);
+	for (uint32 y = 0; y < levelData.height; y++)
+	{
+		for (uint32 x = 0; x < xCount; x++)
+		{
+			SDL_memcpy(record + (y*LEVEL_CHUNK_WIDTH + x)*LEVEL_CHUNK_WIDTH,
+				&levelData.nodes[LinearIndex(xStart + x, y, zStart, levelData.width)], zCount*sizeof(GeometryNode));
+		}
+	}
+}
+
+//Always writes the current version, so every node has to be in levelData (see LoadAllLevelRecords)
+bool WriteLevelDataBinary(const LevelData& levelData, const char* filepath)
+{
+	uint32 recordsPerRow = (levelData.width + LEVEL_CHUNK_WIDTH-1) / LEVEL_CHUNK_WIDTH;
+	uint32 recordCount = recordsPerRow*recordsPerRow;
+	uint32 nodeCount = LEVEL_CHUNK_CELLS*levelData.height;
+	uint64 tableSize = (uint64)recordCount*sizeof(LevelChunkRecord);
+
+	LevelBinaryHeader header = {};
+	header.magic = LEVEL_BINARY_MAGIC;
+	header.version = LEVEL_BINARY_VERSION;
+	header.width = levelData.width;
+	header.height = levelData.height;
+	header.payloadOffset = AlignUp(sizeof(LevelBinaryHeader), LEVEL_BINARY_PAYLOAD_ALIGNMENT);
+	uint64 firstRecordOffset = AlignUp(header.payloadOffset + tableSize, LEVEL_BINARY_PAYLOAD_ALIGNMENT);
+	SDL_memcpy(header.name, levelData.name, LEVEL_NAME_LENGTH);
+
+	//everything gets compressed up front so the list with the record sizes and checksums can go first
+	GeometryNode record[LEVEL_CHUNK_CELLS*MAX_LEVEL_HEIGHT];
+	LevelChunkRecord* records = (LevelChunkRecord*)SDL_calloc(recordCount ? recordCount : 1, sizeof(LevelChunkRecord));
+	byte* compressed = (byte*)SDL_malloc((uint64)(recordCount ? recordCount : 1)*MaxCompressedLevelRecordSize(levelData.height));
+	uint64 compressedSize = 0;
+	for (uint32 i = 0; i < recordCount; i++)
+	{
+		FillLevelRecord(levelData, i / recordsPerRow, i % recordsPerRow, record);
+		records[i].offset = firstRecordOffset + compressedSize;
+		records[i].size = CompressLevelRecord(record, nodeCount, compressed + compressedSize);
+		records[i].checksum = LevelChecksum(compressed + compressedSize, records[i].size);
+		compressedSize += records[i].size;
+	}
+	header.payloadSize = firstRecordOffset - header.payloadOffset + compressedSize;
+	header.checksum = LevelChecksum(records, tableSize);
+
+	SDL_RWops* file = SDL_RWFromFile(filepath, "wb");
+	if (file == NULL)
+	{
+		LOG_ERROR("Failed to open %s for writing: %s\n", filepath, SDL_GetError());
+		SDL_free(compressed);
+		SDL_free(records);
+		return false;
+	}
+
+	byte padding[LEVEL_BINARY_PAYLOAD_ALIGNMENT] = {};
+	uint64 paddingSize = header.payloadOffset - sizeof(header);
+	uint64 tablePaddingSize = firstRecordOffset - header.payloadOffset - tableSize;
+	bool written = SDL_RWwrite(file, &header, sizeof(header), 1) == 1 &&
+		(paddingSize == 0 || SDL_RWwrite(file, padding, paddingSize, 1) == 1) &&
+		(tableSize == 0 || SDL_RWwrite(file, records, tableSize, 1) == 1) &&
+		(tablePaddingSize == 0 || SDL_RWwrite(file, padding, tablePaddingSize, 1) == 1) &&
+		(compressedSize == 0 || SDL_RWwrite(file, compressed, compressedSize, 1) == 1);
+	SDL_RWclose(file);
+	SDL_free(compressed);
+	SDL_free(records);
+
+	if (!written) LOG_ERROR("Failed to write level file %s\n", filepath);
+	else LOG_INFO("Level nodes compressed from %llu to %llu bytes\n",
+		(unsigned long long)recordCount*LevelRecordSize(levelData.height), (unsigned long long)compressedSize);
+	return written;
+}
+
+//Converts a .level json file into a .levelb, the level blocks are handed back afterwards
+bool ConvertLevelToBinary(const char* sourceFilepath, const char* destFilepath, GameMemory& memory)
+{
+	LevelData levelData = LoadLevelData(sourceFilepath, memory);
+	bool converted = levelData.nodes != NULL && (levelData.records == NULL || LoadAllLevelRecords(levelData)) &&
+		WriteLevelDataBinary(levelData, destFilepath);
+	if (converted)
+		LOG_INFO("Converted %s to %s\n", sourceFilepath, destFilepath);
+
+	memory.levelNodeBlock.Reset();
+	PlatformUnmapFile(memory.levelFile);
+	return converted;
+}
+
 
 
 uint32 LoadMaterial(const char* filepath, GameMemory& memory)
 {
+	JsonArenaScope jsonScope(memory.ThreadScratch());
 	void* file = LoadFile(filepath);
 	json jsonData = json::parse((char*)file);
 
@@ -711,27 +1444,27 @@ uint32 LoadMaterial(const char* filepath, GameMemory& memory)
 
 
 
-UnicodeGlyphAtlas LoadFont(std::string fontName)
+UnicodeGlyphAtlas LoadFont(std::string fontName, GameMemory& memory)
 {
+	JsonArenaScope jsonScope(memory.ThreadScratch());
 	std::string filepath = "resources/fonts/" + fontName;
 	void* file = LoadFile((filepath+"_layout.json").c_str());
 	json jsonData = json::parse((char*)file);
 
-	auto glyphs = jsonData["glyphs"];
+	const json& glyphs = jsonData["glyphs"];
 
 	UnicodeGlyphAtlas glyphAtlas;
 	GlyphData* glyph;
 	uint32 size = (uint32)glyphs.size();
 	uint32 texSize = jsonData["atlas"]["width"];
 
-	auto it = glyphs[0];
-	glyphAtlas.spaceWidth = it["advance"];
+	glyphAtlas.spaceWidth = glyphs[0]["advance"];
 	glyphAtlas.lineHeight = jsonData["metrics"]["lineHeight"];
 
 	//NOTE: atm Im assuming 0 to be the space character in all cases, so start at 1
 	for (uint32 i = 1; i < size; i++)
 	{
-		it = glyphs[i];
+		const json& it = glyphs[i];
 		uint32 unicode = it["unicode"];
 		Rect atlasLoc = JsonParseRect(it["atlasBounds"]);
 		atlasLoc.bottom /= texSize;
@@ -0,0 +1,520 @@
+#include "memory.h"
+#include "log.h"
+#include "level.h"
+
+const uint32 LEVEL_STREAM_DEFAULT_RADIUS = 12; //in chunks, so 192 cells out from the player
+const uint32 LEVEL_STREAM_SPAWN_RADIUS = 2; //streamed in before the first frame
+const uint64 LEVEL_STREAM_MEMORY_BUDGET = 512ull*1024*1024; //cells plus uploaded geometry
+const float64 LEVEL_STREAM_FRAME_BUDGET = 0.0005; //seconds of main thread time per frame
+
+enum LevelColumnState : byte
+{
+	LevelColumnUnloaded,
+	LevelColumnRequested,
+	LevelColumnResident
+};
+
+enum LevelStreamSlotState : uint32
+{
+	LevelStreamSlotFree,
+	LevelStreamSlotLoading, //owned by the streaming thread
+	LevelStreamSlotReady    //handed back, waiting for the main thread to publish it
+};
+
+//A column on its way in. The streaming thread fills the chunks and meshes, the main thread copies the chunks into
+//the level and uploads the meshes
+struct LevelStreamSlot
+{
+	std::atomic<uint32> state;
+	uint32 chunkX;
+	uint32 chunkZ;
+	LevelChunk chunks[MAX_LEVEL_HEIGHT];
+	GeometryMesh meshes[MAX_NODE_TYPES];
+};
+
+//Keeps the chunk columns around a focus point resident and lets go of the rest. The level starts out with every
+//chunk empty (see CreateLevel). A single streaming thread reads the chunk records, generates the cells and builds
+//the meshes of requested columns. The main thread only copies finished columns in, uploads them and evicts, each
+//frame stops once LEVEL_STREAM_FRAME_BUDGET is used up.
+//NOTE: the streaming thread reads levelData.nodes while the main thread can edit them, LevelStreamingCanEdit only
+// lets through edits whose cells are all in resident columns, and a column that's in flight never reads the nodes
+// those cells are built from. Node sets must not be relocated while streaming is active
+struct LevelStreamer
+{
+	SDL_Thread* thread;
+	SDL_sem* requestsAvailable;
+	std::atomic<bool> running;
+	bool active;
+
+	//set by BeginLevelStreaming, only read by the streaming thread
+	LevelData* levelData;
+	const Level* level;
+	NodeSetPalette<MAX_NODE_TYPES>* nodeSets;
+	GameMemory* memory;
+	bool packVertices; //GeometryBuffer::packedVertices
+	LevelCache cache; //opened by SetupLevel, the streaming thread reads and writes the columns it builds
+
+	LevelStreamSlot slots[LEVEL_STREAM_SLOTS];
+	byte recordLoaded[MAX_GEOMETRY_CHUNKS]; //streaming thread only
+
+	//main thread only
+	byte columnState[MAX_GEOMETRY_CHUNKS];
+	uint32 columnBytes[MAX_GEOMETRY_CHUNKS];
+	uint64 residentBytes;
+	uint64 memoryBudget;
+	uint32 radius;
+	uint32 radiusLimit; //pulled in when the memory budget runs out so the edge doesn't keep thrashing
+	int32 focusX;
+	int32 focusZ;
+	uint32 residentCount;
+};
+
+//Copies in the records the column's cells are built from, cells sit on node corners so that's the records at and
+//just before the column along x and z
+void StreamLevelRecords(LevelStreamer& streamer, uint32 chunkX, uint32 chunkZ)
+{
+	LevelData& levelData = *streamer.levelData;
+	if (levelData.records == NULL) return;
+
+	for (uint32 x = chunkX > 0 ? chunkX-1 : 0; x <= chunkX; x++)
+	for (uint32 z = chunkZ > 0 ? chunkZ-1 : 0; z <= chunkZ; z++)
+	{
+		if (x >= levelData.recordsPerRow || z >= levelData.recordsPerRow) continue;
+		byte& loaded = streamer.recordLoaded[x*levelData.recordsPerRow + z];
+		if (loaded) continue;
+
+		//a record that fails its checksum stays empty, it isn't worth retrying every time it comes into range
+		LoadLevelRecord(levelData, x, z);
+		loaded = 1;
+	}
+}
+
+int LevelStreamerThreadProc(void* data)
+{
+	LevelStreamer* streamer = (LevelStreamer*)data;
+	for (;;)
+	{
+		SDL_SemWait(streamer->requestsAvailable);
+		if (!streamer->running) break;
+
+		for (uint32 s = 0; s < LEVEL_STREAM_SLOTS; s++)
+		{
+			LevelStreamSlot& slot = streamer->slots[s];
+			if (slot.state.load(std::memory_order_acquire) != LevelStreamSlotLoading) continue;
+
+			//the records are read in either way since edits need the nodes, even in columns the cache has
+			uint32 typeMask = 0;
+			StreamLevelRecords(*streamer, slot.chunkX, slot.chunkZ);
+			if (!LoadLevelColumn(streamer->cache, *streamer->levelData, *streamer->level, *streamer->nodeSets,
+				*streamer->memory, slot.chunkX, slot.chunkZ, slot.chunks, 1, slot.meshes, streamer->packVertices, &typeMask))
+				WriteLevelCacheColumn(streamer->cache, slot.chunks, 1, slot.meshes, slot.chunkX, slot.chunkZ, typeMask);
+			slot.state.store(LevelStreamSlotReady, std::memory_order_release);
+		}
+	}
+
+	return 0;
+}
+
+//Without the thread SetupLevel loads every column up front on the job system instead
+void StartLevelStreamer(LevelStreamer& streamer, bool threaded = true)
+{
+	streamer.thread = NULL;
+	streamer.requestsAvailable = NULL;
+	streamer.active = false;
+	streamer.running = true;
+	streamer.cache.columns = NULL; //closed, see OpenLevelCache
+	streamer.cache.written = NULL;
+	for (uint32 s = 0; s < LEVEL_STREAM_SLOTS; s++)
+		streamer.slots[s].state = LevelStreamSlotFree;
+	if (!threaded) return;
+
+	streamer.requestsAvailable = SDL_CreateSemaphore(0);
+	if (streamer.requestsAvailable == NULL)
+	{
+		LOG_ERROR("Failed to create the level streaming semaphore: %s\n", SDL_GetError());
+		return;
+	}
+
+	streamer.thread = SDL_CreateThread(LevelStreamerThreadProc, "LevelStreamer", &streamer);
+	if (streamer.thread == NULL)
+		LOG_ERROR("Failed to create the level streaming thread: %s\n", SDL_GetError());
+}
+
+//Waits for the streaming thread to finish whatever it's working on and drops everything that hasn't been
+//published. Columns already in the level are left alone, they go with UnloadLevel and SetupGeometryBuffer. The
+//level cache gets written out here since nothing is building columns anymore
+void EndLevelStreaming(LevelStreamer& streamer)
+{
+	if (!streamer.active)
+	{
+		CloseLevelCache(streamer.cache);
+		return;
+	}
+
+	for (uint32 s = 0; s < LEVEL_STREAM_SLOTS; s++)
+	{
+		LevelStreamSlot& slot = streamer.slots[s];
+		while (slot.state.load(std::memory_order_acquire) == LevelStreamSlotLoading)
+			SDL_Delay(1);
+
+		if (slot.state.load(std::memory_order_relaxed) == LevelStreamSlotReady)
+		{
+			for (uint32 y = 0; y < streamer.level->height; y++)
+			{
+				if (slot.chunks[y].cells == NULL) continue;
+				streamer.memory->levelChunkCellPool.Release(streamer.memory->levelChunkCellPool.HandleAt(slot.chunks[y].cellSlot));
+			}
+		}
+		slot.state.store(LevelStreamSlotFree, std::memory_order_relaxed);
+	}
+	streamer.active = false;
+	CloseLevelCache(streamer.cache);
+}
+
+void StopLevelStreamer(LevelStreamer& streamer)
+{
+	EndLevelStreaming(streamer);
+	streamer.running = false;
+	if (streamer.thread != NULL)
+	{
+		SDL_SemPost(streamer.requestsAvailable);
+		SDL_WaitThread(streamer.thread, NULL);
+		streamer.thread = NULL;
+	}
+	if (streamer.requestsAvailable) SDL_DestroySemaphore(streamer.requestsAvailable);
+	streamer.requestsAvailable = NULL;
+}
+
+//Call after CreateLevel and SetupGeometryBuffer, each slot gets its own staging meshes out of the geometry blocks
+void BeginLevelStreaming(LevelStreamer& streamer, const Level& level, LevelData& levelData,
+	NodeSetPalette<MAX_NODE_TYPES>& nodeSets, GeometryBuffer& geometryBuffer, GameMemory& memory,
+	uint32 radius = LEVEL_STREAM_DEFAULT_RADIUS, uint64 memoryBudget = LEVEL_STREAM_MEMORY_BUDGET)
+{
+	EndLevelStreaming(streamer);
+
+	streamer.levelData = &levelData;
+	streamer.level = &level;
+	streamer.nodeSets = &nodeSets;
+	streamer.memory = &memory;
+	streamer.packVertices = geometryBuffer.packedVertices;
+	streamer.radius = radius;
+	streamer.radiusLimit = radius;
+	streamer.memoryBudget = memoryBudget;
+	streamer.residentBytes = 0;
+	streamer.residentCount = 0;
+	streamer.focusX = -1;
+	streamer.focusZ = -1;
+	SDL_memset(streamer.recordLoaded, 0, sizeof(streamer.recordLoaded));
+	SDL_memset(streamer.columnState, LevelColumnUnloaded, sizeof(streamer.columnState));
+	SDL_memset(streamer.columnBytes, 0, sizeof(streamer.columnBytes));
+
+	for (uint32 s = 0; s < LEVEL_STREAM_SLOTS; s++)
+	{
+		for (int i = 0; i < MAX_NODE_TYPES; i++)
+		{
+			uint32 block = (GEO_MESH_STAGING_SETS + s)*MAX_NODE_TYPES + i;
+			SetupStagingMesh(streamer.slots[s].meshes[i], memory.geometryMeshVertexBlocks[block],
+				memory.geometryMeshIndexBlocks[block]);
+		}
+	}
+
+	//every chunk starts out empty, nothing is dirty until a column has actually been streamed in
+	for (uint32 c = 0; c < geometryBuffer.chunkCount; c++)
+		geometryBuffer.chunks[c].dirty = false;
+
+	streamer.active = streamer.thread != NULL;
+}
+
+inline uint32 LevelColumnDistance(const LevelStreamer& streamer, uint32 chunkX, uint32 chunkZ)
+{
+	return (uint32)glm::max(glm::abs((int32)chunkX - streamer.focusX), glm::abs((int32)chunkZ - streamer.focusZ));
+}
+
+inline bool LevelColumnIsResident(const LevelStreamer& streamer, const Level& level, uint32 chunkX, uint32 chunkZ)
+{
+	return !streamer.active || (chunkX < level.chunksPerRow && chunkZ < level.chunksPerRow &&
+		streamer.columnState[chunkX*level.chunksPerRow + chunkZ] == LevelColumnResident);
+}
+
+//Node x,z is a corner of cells x..x+1, z..z+1, SetLevelNode only has everything it needs if all of them are resident
+bool LevelStreamingCanEdit(const LevelStreamer& streamer, const Level& level, uint32 x, uint32 z)
+{
+	for (uint32 cx = x / LEVEL_CHUNK_WIDTH; cx <= (x+1) / LEVEL_CHUNK_WIDTH; cx++)
+	for (uint32 cz = z / LEVEL_CHUNK_WIDTH; cz <= (z+1) / LEVEL_CHUNK_WIDTH; cz++)
+		if (!LevelColumnIsResident(streamer, level, cx, cz)) return false;
+	return true;
+}
+
+void EvictLevelColumn(LevelStreamer& streamer, Level& level, GeometryBuffer& geometryBuffer, GameMemory& memory,
+	uint32 column)
+{
+	uint32 chunkX = column / level.chunksPerRow;
+	uint32 chunkZ = column % level.chunksPerRow;
+	ReleaseLevelChunkColumn(level, memory, chunkX, chunkZ);
+	ReleaseGeometryChunk(geometryBuffer.chunks[column]);
+	geometryBuffer.chunks[column].dirty = false;
+
+	streamer.residentBytes -= streamer.columnBytes[column];
+	streamer.residentCount--;
+	streamer.columnBytes[column] = 0;
+	streamer.columnState[column] = LevelColumnUnloaded;
+}
+
+//Moves a finished slot into the level: cells into the chunk directory and meshes up to the GPU
+void PublishLevelStreamSlot(LevelStreamer& streamer, LevelStreamSlot& slot, Level& level,
+	GeometryBuffer& geometryBuffer, GameMemory& memory)
+{
+	uint32 column = slot.chunkX*level.chunksPerRow + slot.chunkZ;
+	uint64 cellBytes = 0;
+	for (uint32 y = 0; y < level.height; y++)
+		cellBytes += slot.chunks[y].cells != NULL ? sizeof(LevelChunkCells) : 0;
+
+	//dropped if the focus moved away while it was in flight
+	if (LevelColumnDistance(streamer, slot.chunkX, slot.chunkZ) > streamer.radiusLimit+1)
+	{
+		for (uint32 y = 0; y < level.height; y++)
+		{
+			if (slot.chunks[y].cells == NULL) continue;
+			memory.levelChunkCellPool.Release(memory.levelChunkCellPool.HandleAt(slot.chunks[y].cellSlot));
+		}
+		streamer.columnState[column] = LevelColumnUnloaded;
+		slot.state.store(LevelStreamSlotFree, std::memory_order_relaxed);
+		return;
+	}
+
+	//anything that got written into the empty chunks in the meantime is stale
+	ReleaseLevelChunkColumn(level, memory, slot.chunkX, slot.chunkZ);
+	for (uint32 y = 0; y < level.height; y++)
+	{
+		level.chunks[LevelChunkIndex(slot.chunkX, y, slot.chunkZ, level.chunksPerRow)] = slot.chunks[y];
+		UpdateLevelChunkSummary(level, slot.chunkX, y, slot.chunkZ);
+	}
+	uint64 geometryBytes = UploadGeometryChunk(geometryBuffer.chunks[column], slot.meshes);
+	slot.state.store(LevelStreamSlotFree, std::memory_order_relaxed);
+
+	streamer.columnBytes[column] = (uint32)(cellBytes + geometryBytes);
+	streamer.residentBytes += streamer.columnBytes[column];
+	streamer.residentCount++;
+	streamer.columnState[column] = LevelColumnResident;
+}
+
+//Hands the next missing column nearest the focus to a free slot, returns false once there is nothing left to ask
+//for or no slot to ask with
+bool RequestLevelColumn(LevelStreamer& streamer, const Level& level)
+{
+	LevelStreamSlot* slot = NULL;
+	for (uint32 s = 0; s < LEVEL_STREAM_SLOTS && slot == NULL; s++)
+		if (streamer.slots[s].state.load(std::memory_order_acquire) == LevelStreamSlotFree) slot = &streamer.slots[s];
+	if (slot == NULL) return false;
+
+	int32 chunksPerRow = (int32)level.chunksPerRow;
+	int32 radius = (int32)glm::min(streamer.radius, streamer.radiusLimit);
+	for (int32 ring = 0; ring <= radius; ring++)
+	for (int32 x = streamer.focusX - ring; x <= streamer.focusX + ring; x++)
+	{
+		if (x < 0 || x >= chunksPerRow) continue;
+		//only the edge of the ring, the inside was covered by the smaller rings
+		bool edgeRow = x == streamer.focusX - ring || x == streamer.focusX + ring;
+		for (int32 z = streamer.focusZ - ring; z <= streamer.focusZ + ring; z += edgeRow ? 1 : 2*glm::max(ring, 1))
+		{
+			if (z < 0 || z >= chunksPerRow) continue;
+			byte& state = streamer.columnState[x*chunksPerRow + z];
+			if (state != LevelColumnUnloaded) continue;
+
+			state = LevelColumnRequested;
+			slot->chunkX = (uint32)x;
+			slot->chunkZ = (uint32)z;
+			slot->state.store(LevelStreamSlotLoading, std::memory_order_release);
+			SDL_SemPost(streamer.requestsAvailable);
+			return true;
+		}
+	}
+	return false;
+}
+
+//Called once a frame from the main thread. Publishes finished columns, evicts the ones that drifted out of range
+//or don't fit the memory budget and requests the nearest missing ones. Returns true while there is still
+//something in flight or left to request
+bool UpdateLevelStreaming(LevelStreamer& streamer, Level& level, GeometryBuffer& geometryBuffer, GameMemory& memory,
+	vec3f focus, float64 timeBudget = LEVEL_STREAM_FRAME_BUDGET)
+{
+	if (!streamer.active) return false;
+
+	Timer timer;
+	timer.Mark();
+	int32 chunksPerRow = (int32)level.chunksPerRow;
+	int32 focusX = glm::clamp((int32)glm::floor(focus.x / CELL_SIZE) / (int32)LEVEL_CHUNK_WIDTH, 0, chunksPerRow-1);
+	int32 focusZ = glm::clamp((int32)glm::floor(focus.z / CELL_SIZE) / (int32)LEVEL_CHUNK_WIDTH, 0, chunksPerRow-1);
+	streamer.focusX = focusX;
+	streamer.focusZ = focusZ;
+
+	//the radius only goes back out a ring at a time once the next ring looks like it fits, otherwise every step
+	//would stream a ring in just to evict it again
+	if (streamer.radiusLimit < streamer.radius && streamer.residentCount > 0)
+	{
+		uint64 averageBytes = streamer.residentBytes / streamer.residentCount;
+		if (streamer.residentBytes + averageBytes*8*(streamer.radiusLimit+1) <= streamer.memoryBudget)
+			streamer.radiusLimit++;
+	}
+
+	//always publish at least one column so a tight budget can't stall streaming altogether
+	bool busy = false;
+	uint32 published = 0;
+	for (uint32 s = 0; s < LEVEL_STREAM_SLOTS; s++)
+	{
+		LevelStreamSlot& slot = streamer.slots[s];
+		if (slot.state.load(std::memory_order_acquire) != LevelStreamSlotReady) continue;
+		if (published > 0 && timer.ElapsedTime().count() > timeBudget) { busy = true; continue; }
+		PublishLevelStreamSlot(streamer, slot, level, geometryBuffer, memory);
+		published++;
+	}
+
+	//one column of hysteresis so walking back and forth over a chunk edge doesn't reload anything
+	uint32 columnCount = level.chunksPerRow*level.chunksPerRow;
+	for (uint32 c = 0; c < columnCount; c++)
+	{
+		if (streamer.columnState[c] != LevelColumnResident) continue;
+		if (LevelColumnDistance(streamer, c / level.chunksPerRow, c % level.chunksPerRow) <= streamer.radius+1) continue;
+		EvictLevelColumn(streamer, level, geometryBuffer, memory, c);
+	}
+
+	while (streamer.residentBytes > streamer.memoryBudget)
+	{
+		uint32 farthest = 0;
+		uint32 farthestDistance = 0;
+		for (uint32 c = 0; c < columnCount; c++)
+		{
+			if (streamer.columnState[c] != LevelColumnResident) continue;
+			uint32 distance = LevelColumnDistance(streamer, c / level.chunksPerRow, c % level.chunksPerRow);
+			if (distance >= farthestDistance) { farthest = c; farthestDistance = distance; }
+		}
+		if (farthestDistance == 0) break;
+
+		EvictLevelColumn(streamer, level, geometryBuffer, memory, farthest);
+		if (farthestDistance-1 < glm::min(streamer.radius, streamer.radiusLimit))
+		{
+			streamer.radiusLimit = farthestDistance-1;
+			LOG_WARN("Level streaming memory budget reached, streaming radius pulled in to %u chunks\n",
+				streamer.radiusLimit);
+		}
+	}
+
+	while (streamer.residentBytes < streamer.memoryBudget && RequestLevelColumn(streamer, level))
+		busy = true;
+
+	for (uint32 s = 0; s < LEVEL_STREAM_SLOTS; s++)
+		busy |= streamer.slots[s].state.load(std::memory_order_relaxed) != LevelStreamSlotFree;
+	return busy;
+}
+
+//Blocks until every column within radius of focus is resident, for before the first frame
+void StreamLevelAround(LevelStreamer& streamer, Level& level, GeometryBuffer& geometryBuffer, GameMemory& memory,
+	vec3f focus, uint32 radius = LEVEL_STREAM_SPAWN_RADIUS)
+{
+	uint32 streamRadius = streamer.radius;
+	streamer.radius = glm::min(radius, streamRadius);
+	while (UpdateLevelStreaming(streamer, level, geometryBuffer, memory, focus, 1.0))
+		SDL_Delay(0);
+	streamer.radius = streamRadius;
+}
+
+template <uint32 N>
+struct LevelColumnJobData
+{
+	const LevelCache* cache;
+	const LevelData* levelData;
+	const Level* level;
+	NodeSetPalette<N>* nodeSets;
+	GameMemory* memory;
+	GeometryBuffer* geometryBuffer;
+	//job i loads column i into the staging set it was given, these are per staging set
+	bool cached[GEO_MESH_STAGING_SETS];
+	uint32 typeMasks[GEO_MESH_STAGING_SETS];
+};
+
+template <uint32 N>
+void LoadLevelColumnJob(void* data, uint32 jobIndex, uint32 slot)
+{
+	LevelColumnJobData<N>* job = (LevelColumnJobData<N>*)data;
+	uint32 chunksPerRow = job->level->chunksPerRow;
+	uint32 chunkX = jobIndex / chunksPerRow;
+	uint32 chunkZ = jobIndex % chunksPerRow;
+	job->cached[slot] = LoadLevelColumn(*job->cache, *job->levelData, *job->level, *job->nodeSets, *job->memory,
+		chunkX, chunkZ, &job->level->chunks[LevelChunkIndex(chunkX, 0, chunkZ, chunksPerRow)], chunksPerRow*chunksPerRow,
+		job->geometryBuffer->meshes[slot], job->geometryBuffer->packedVertices, &job->typeMasks[slot]);
+}
+
+//Loads every column up front for when there's no streaming thread. Like UpdateDirtyGeometryChunks the columns are
+//staged jobs, the workers load columns into free staging sets while the main thread uploads the finished ones and
+//writes whatever had to be built into the cache. All the records have to be read in first
+template <uint32 N>
+void LoadAllLevelColumns(Level& level, const LevelData& levelData, NodeSetPalette<N>& nodeSets,
+	GeometryBuffer& geometryBuffer, GameMemory& memory, JobSystem& jobs, LevelCache& cache)
+{
+	LevelColumnJobData<N> job;
+	job.cache = &cache;
+	job.levelData = &levelData;
+	job.level = &level;
+	job.nodeSets = &nodeSets;
+	job.memory = &memory;
+	job.geometryBuffer = &geometryBuffer;
+
+	Timer timer;
+	timer.Mark();
+	uint32 columnCount = level.chunksPerRow*level.chunksPerRow;
+	uint32 typeMask = 0;
+	uint32 cachedCount = 0;
+	StagedJobBatch staged;
+	BeginStagedJobs(jobs, staged, columnCount, geometryBuffer.stagingSetCount, LoadLevelColumnJob<N>, &job);
+	uint32 column, slot;
+	while (NextStagedJob(jobs, staged, &column, &slot))
+	{
+		uint32 chunkX = column / level.chunksPerRow;
+		uint32 chunkZ = column % level.chunksPerRow;
+		if (!job.cached[slot])
+			WriteLevelCacheColumn(cache, &level.chunks[LevelChunkIndex(chunkX, 0, chunkZ, level.chunksPerRow)],
+				level.chunksPerRow*level.chunksPerRow, geometryBuffer.meshes[slot], chunkX, chunkZ, job.typeMasks[slot]);
+		UploadGeometryChunk(geometryBuffer.chunks[column], geometryBuffer.meshes[slot]);
+		for (uint32 y = 0; y < level.height; y++)
+			UpdateLevelChunkSummary(level, chunkX, y, chunkZ);
+		typeMask |= job.typeMasks[slot];
+		cachedCount += job.cached[slot];
+	}
+
+	uint32 uniqueCount = 0;
+	for (uint32 i = 0; i < MAX_NODE_TYPES; i++)
+	{
+		bool used = (typeMask >> i) & 1;
+		level.nodeTypeGeometyBufferMap[i] = used ? uniqueCount : -1;
+		uniqueCount += used;
+	}
+	level.numUniqueNodeTypes = uniqueCount;
+	LOG_INFO("%u of %u level columns came out of the level cache\n", cachedCount, columnCount);
+	LOG_INFO("Loaded every level column in %f s with %u worker threads\n", timer.ElapsedTime().count(), jobs.workerCount);
+}
+
+//Gets a freshly loaded level ready to play. The cells and geometry around focus are streamed in before this returns
+//and the rest follows as UpdateLevelStreaming is called, without a streaming thread all of it is loaded up front.
+//Columns come out of the cache at cacheFilepath where they can and the ones that had to be built go into it, NULL
+//turns the cache off
+void SetupLevel(LevelStreamer& streamer, Level& level, LevelData& levelData, NodeSetPalette<MAX_NODE_TYPES>& nodeSets,
+	GeometryBuffer& geometryBuffer, GameMemory& memory, JobSystem& jobs, vec3f focus,
+	uint32 radius = LEVEL_STREAM_DEFAULT_RADIUS, const char* cacheFilepath = NULL)
+{
+	EndLevelStreaming(streamer);
+	level = CreateLevel(levelData, memory);
+	SetupGeometryBuffer(level, geometryBuffer, memory, jobs);
+	uint64 cacheKey = LevelCacheKey(levelData, nodeSets, geometryBuffer.packedVertices);
+	if (streamer.thread == NULL)
+	{
+		if (levelData.records != NULL) LoadAllLevelRecords(levelData);
+		OpenLevelCache(streamer.cache, cacheFilepath, cacheKey, level.chunksPerRow, level.height);
+		LoadAllLevelColumns(level, levelData, nodeSets, geometryBuffer, memory, jobs, streamer.cache);
+		CloseLevelCache(streamer.cache);
+		return;
+	}
+
+	BeginLevelStreaming(streamer, level, levelData, nodeSets, geometryBuffer, memory, radius);
+	OpenLevelCache(streamer.cache, cacheFilepath, cacheKey, level.chunksPerRow, level.height);
+	StreamLevelAround(streamer, level, geometryBuffer, memory, focus);
+}
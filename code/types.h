@@ -38,6 +38,14 @@ const float CELL_OFFB = glm::sqrt(CELL_DHB*CELL_DHB/2.0f);
 const byte EMPTY = 0;
 const uint32 MAX_LEVEL_WIDTH = 1000;
 const uint32 MAX_LEVEL_HEIGHT = 8;
+//level geometry chunks meshed at once by the job system, one set of staging meshes each. Only as many as there
+//are threads get committed, past this many threads the rest sit out meshing
+const uint32 GEO_MESH_STAGING_SETS = 8;
+//how many pixels across a level geometry chunk can get on screen and still be drawn with its coarse mesh
+const float GEO_LOD_DEFAULT_PIXELS = 64.0f;
+//a chunk drawn coarse has to come out this many times GeometryBuffer::lodPixels across before it goes back to full
+//detail, so one sitting right on the line doesn't flip every frame
+const float GEO_LOD_HYSTERESIS = 1.25f;
 
 
 const float RAD_90 = glm::radians(90.0f);
@@ -90,6 +98,21 @@ struct Vertex //48
 		: position(position), normal(normal), uv0(uv0), color(color) {}
 };
 
+//Optional smaller vertex for level geometry, see PackGeometryVertices. Positions are 1/PACKED_POSITION_SCALE of a
+//cell steps from the origin of the chunk they belong to, which the shader gets in PACKED_ORIGIN_ATTRIBUTE. Normals
+//are octahedral in two snorms, uvs half floats and color a byte per channel
+struct PackedVertex //20
+{
+	int16 position[3];
+	int16 padding;
+	int16 normal[2];
+	uint16 uv0[2];
+	byte color[4];
+};
+
+constexpr float PACKED_POSITION_SCALE = 1024.0f;
+const uint32 PACKED_ORIGIN_ATTRIBUTE = 4;
+
 struct SkinnedVertex
 {
 	vec3f position;
@@ -105,15 +128,46 @@ struct SkinnedVertex
 		 joints(joints), weights(weights) {}
 };
 
-struct NodeCell //24 bytes
+const byte CELL_SHAPE_MASK  = 0x07;
+const byte CELL_LAYER_SHIFT = 3;
+const byte CELL_LAYER_MASK  = 0x18;
+const byte CELL_SLOPE_SHIFT = 5;
+const byte CELL_SLOPE_MAX   = 7;
+
+//NOTE: no position, a cell's world position is just its x,y,z index times CELL_SIZE
+//Each quadrant gets its type and a byte with the shape in bits 0-2, the layer in bits 3-4 and the slope in bits 5-7.
+//Go through the accessors below instead of the raw bytes
+struct NodeCell //8 bytes
 {
 	byte types[4];
-	byte slopes[4];
-	byte shapes[4];
-	byte layers[4];
-	vec3f position;
+	byte quadrants[4];
 };
 
+inline byte CellType(const NodeCell& cell, uint32 quadrant)
+{
+	return cell.types[quadrant];
+}
+
+inline byte CellShape(const NodeCell& cell, uint32 quadrant)
+{
+	return cell.quadrants[quadrant] & CELL_SHAPE_MASK;
+}
+
+inline byte CellLayer(const NodeCell& cell, uint32 quadrant)
+{
+	return (cell.quadrants[quadrant] & CELL_LAYER_MASK) >> CELL_LAYER_SHIFT;
+}
+
+inline byte CellSlope(const NodeCell& cell, uint32 quadrant)
+{
+	return cell.quadrants[quadrant] >> CELL_SLOPE_SHIFT;
+}
+
+inline void SetCellLayer(NodeCell& cell, uint32 quadrant, byte layer)
+{
+	cell.quadrants[quadrant] = (cell.quadrants[quadrant] & ~CELL_LAYER_MASK) | (layer << CELL_LAYER_SHIFT);
+}
+
 struct GeometryNode
 {
 	byte type;
@@ -135,6 +189,24 @@ struct Mesh
 		indices = NULL;
 	}
 };
+//Staging for a chunk of level geometry. Indices are built 32 bit since a chunk can go past what 16 bit indices
+//reach, BuildGeometryChunk narrows them in place whenever the chunk fits
+template<typename T> struct MemoryBlock;
+
+struct GeometryMesh
+{
+	uint32 vertexCount;
+	uint32 indexCount;
+	Vertex* vertices;
+	uint32* indices;
+	uint32 indexType; //GL_UNSIGNED_SHORT once narrowed, otherwise GL_UNSIGNED_INT
+	uint32 vertexSize; //sizeof(Vertex), or sizeof(PackedVertex) once packed over the top of them
+	uint32 coarseIndexStart; //the indices from here on are the chunk's coarse mesh, see BuildCoarseGeometry
+	//the blocks vertices and indices point into, only ever grown through GrowGeometryMesh
+	MemoryBlock<Vertex>* vertexBlock;
+	MemoryBlock<uint32>* indexBlock;
+};
+
 struct SkinnedMesh
 {
 	uint32 vertexCount;
@@ -143,6 +215,13 @@ struct SkinnedMesh
 	uint16* indices;
 };
 
+//uniform block bindings, the layout(binding = N) in the shaders
+const uint32 CAMERA_BUFFER_BINDING      = 0;
+const uint32 OBJECT_BUFFER_BINDING      = 1;
+const uint32 ENVIRONMENT_BUFFER_BINDING = 2;
+const uint32 MAIN_LIGHT_BUFFER_BINDING  = 3;
+const uint32 POINT_LIGHT_BUFFER_BINDING = 4;
+
 struct CameraData
 {
 	mat4f cameraViewProjection;
@@ -160,13 +239,70 @@ struct MeshBufferHandle
 	uint32 vboID;
 	uint32 iboID;
 	uint32 indexCount;
+	uint32 indexType; //GL_UNSIGNED_SHORT, only level geometry chunks that go past 65535 vertices use GL_UNSIGNED_INT
+	uint32 vertexSize; //sizeof(Vertex), only level geometry chunks can be sizeof(PackedVertex)
+};
+
+const uint32 STREAM_BUFFER_REGIONS = 3;
+
+//For data that is rewritten every frame (uniforms, debug text and lines). One buffer split into regions that are
+//written in turn, with ARB_buffer_storage it stays persistently mapped and writes are a memcpy into it. Every
+//region written in a frame gets fenced at the end of it and a region is only waited on when the writes come back
+//around to it, which is normally STREAM_BUFFER_REGIONS frames later. Without buffer storage mapped is NULL and
+//writes go through glBufferSubData into the same regions
+struct StreamBuffer
+{
+	uint32 glID;
+	byte* mapped;
+	uint32 regionSize;
+	uint32 alignment;   //writes start on a multiple of this
+	uint32 region;      //being written
+	uint32 frameRegion; //first region written this frame
+	uint32 used;        //bytes of region written so far
+	GLsync fences[STREAM_BUFFER_REGIONS]; //regions written in the same frame share a fence
+};
+
+//Level cells are stored in LEVEL_CHUNK_WIDTH x LEVEL_CHUNK_WIDTH squares per layer and level geometry is meshed
+//in columns of those squares through every layer, so changing a node only has to re-mesh and re-upload the
+//chunks around it
+const uint32 LEVEL_CHUNK_WIDTH = 16;
+const uint32 LEVEL_CHUNK_CELLS = LEVEL_CHUNK_WIDTH*LEVEL_CHUNK_WIDTH;
+
+//In LevelCellOrder, see LevelChunkLocalIndex
+struct LevelChunkCells
+{
+	NodeCell cells[LEVEL_CHUNK_CELLS];
+};
+
+//Most of a level is open air or solid ground, so a chunk where every cell is the same only keeps that one cell
+//and cells stays NULL. Only chunks with something going on in them get their cells out of the pool
+struct LevelChunk
+{
+	NodeCell* cells;
+	uint32 cellSlot; //pool slot of cells
+	NodeCell uniformCell;
+	uint16 occupied[LEVEL_CHUNK_WIDTH]; //bit z of row x is set if cell x,z has anything to draw or collide with
+};
+
+struct GeometryChunk
+{
+	MeshBufferHandle handles[MAX_NODE_TYPES]; //vboID of 0 until the chunk has geometry of that type
+	//each handle's indices are the full detail geometry up to here and the coarse mesh after it
+	uint32 coarseIndexStart[MAX_NODE_TYPES];
+	bool hasCoarse; //false if the coarse meshes didn't fit, the chunk is then always drawn in full
+	bool coarse; //drawn with the coarse meshes this frame, see UpdateGeometryLevelOfDetail
+	bool dirty;
 };
 
 struct GeometryBuffer
 {
-	Mesh Block;
-	Mesh             meshes[MAX_NODE_TYPES];
-	MeshBufferHandle handles[MAX_NODE_TYPES];
+	GeometryMesh     meshes[GEO_MESH_STAGING_SETS][MAX_NODE_TYPES]; //staging, one set per chunk being meshed at once
+	uint32 stagingSetCount;
+	GeometryChunk*   chunks;
+	uint32 chunksPerRow;
+	uint32 chunkCount;
+	bool packedVertices; //chunks are uploaded as PackedVertex, set before SetupGeometryBuffer
+	float lodPixels; //chunks smaller than this on screen are drawn coarse, 0 always draws them in full
 };
 
 struct QuadBuffer
@@ -175,6 +311,8 @@ struct QuadBuffer
 	MeshBufferHandle handle;
 	uint32 count;
 	uint32 capacity;
+	uint32 vertexOffset; //where UploadQuadBuffer put the quads in the handle's buffers
+	uint32 indexOffset;
 
 	bool AddQuad(Rect position, Rect uv)
 	{
@@ -288,6 +426,7 @@ struct ShaderAssetTable
 {
 	ShaderAsset shaderAssetFilePaths[ShaderType::Count];
 	unsigned int compiledShaders[ShaderType::Count];
+	unsigned int compiledPackedShaders[ShaderType::Count]; //vertex shader built with PACKED_VERTEX defined, only with -packedvertices
 };
 
 struct GeometryNodeAssetTable
@@ -305,12 +444,26 @@ struct Texture2D
 };
 
 
+//Bit (dy+1)*9 + (dx+1)*3 + (dz+1) of an occlusion mask is the cell dx,dy,dz away from the piece's cell. A triangle
+//is hidden when every cell in its mask is solid, NODE_NEVER_OCCLUDED can't be set so those are always drawn
+const uint32 NODE_NEVER_OCCLUDED = 1u << 31;
+
 struct NodeShape
 {
 	//unsigned int variationCount;
 	Mesh mesh;
+	uint32* occlusion; //a mask per triangle per rotation, rotation r starts at r*indexCount/3
+	uint32 sharedOcclusion[4]; //per rotation, the cells every triangle needs solid, not met means draw it all
+	float top; //highest point above the cell's position, the same in every rotation
 
-	NodeShape() { mesh = Mesh(); }
+	NodeShape()
+	{
+		mesh = Mesh();
+		occlusion = NULL;
+		for (int r = 0; r < 4; r++)
+			sharedOcclusion[r] = NODE_NEVER_OCCLUDED;
+		top = 0.0f;
+	}
 };
 
 struct NodeStack
@@ -326,17 +479,40 @@ struct NodeStack
 	}
 };
 
+//Every piece's vertices are kept turned to each of the ROTATION_TABLE rotations so meshing only has to move them
+//into place. The rotated copies of the whole set follow each other rotationStride vertices apart, a piece's mesh
+//points into the unrotated first one
 struct NodeSet
 {
 	NodeStack shapeStacks[5];
 
-	unsigned int vertexCount;
+	Vertex* vertices;
+	uint16* indices;
+	unsigned int vertexCount; //every rotation
 	unsigned int indexCount;
+	unsigned int rotationStride;
+
+	//filled in by PrepareNodeSetOcclusion once the whole palette is loaded
+	uint32* occlusion;
+	uint32 occlusionCount;
+	//F_T is a flat unit quad whose uvs go up by whole numbers from one cell to the next, so a run of them can be
+	//drawn as one bigger quad and a repeating texture still lines up. topUVPerX/Z is the uv change per cell
+	bool mergeableTop;
+	vec2f topUVPerX;
+	vec2f topUVPerZ;
 
 	NodeSet()
 	{
+		vertices = NULL;
+		indices = NULL;
 		vertexCount = 0;
 		indexCount = 0;
+		rotationStride = 0;
+		occlusion = NULL;
+		occlusionCount = 0;
+		mergeableTop = false;
+		topUVPerX = vec2f(0.0f);
+		topUVPerZ = vec2f(0.0f);
 		shapeStacks[0] = NodeStack();
 		shapeStacks[1] = NodeStack();
 		shapeStacks[2] = NodeStack();
@@ -352,19 +528,138 @@ struct NodeSetPalette
 	uint32 materials[N];
 	unsigned int count = N;
 
-	Mesh* GetNodePiece(unsigned char type, unsigned char shape, unsigned char layer)
+	NodeShape* GetNodeShape(unsigned char type, unsigned char shape, unsigned char layer)
 	{
 		//int variationCount = slices[pieceType].pieces[layer].variationCount;
-		return &(sets[type-1].shapeStacks[shape-1].layers[layer].mesh); // + Random range between 0 and variation count
+		return &(sets[type-1].shapeStacks[shape-1].layers[layer]); // + Random range between 0 and variation count
+	}
+
+	Mesh* GetNodePiece(unsigned char type, unsigned char shape, unsigned char layer)
+	{
+		return &GetNodeShape(type, shape, layer)->mesh;
+	}
+
+	//piece's vertices turned by ROTATION_TABLE[rotation], piece has to come from GetNodePiece with the same type
+	const Vertex* GetNodePieceVertices(unsigned char type, const Mesh* piece, uint32 rotation)
+	{
+		return piece->vertices + rotation*sets[type-1].rotationStride;
 	}
 };
 
+const uint32 LEVEL_NAME_LENGTH = 64;
+
+const uint32 LEVEL_BINARY_MAGIC = 0x424C564C; //"LVLB"
+//1: the nodes in LinearIndex order, used in place out of the mapped file
+//2: the nodes split into chunk records that get read in as they are needed, see LevelChunkRecord
+//3: the same records compressed, see LevelRecordHeader
+const uint32 LEVEL_BINARY_VERSION = 3;
+const uint32 LEVEL_BINARY_PAYLOAD_ALIGNMENT = 64;
+
+//The nodes of one LEVEL_CHUNK_WIDTH square of node columns through every layer, y then x then z. Nodes past the
+//far edges of the level are 0
+struct LevelChunkRecord
+{
+	uint64 offset; //from the start of the file
+	uint32 size;
+	uint32 reserved;
+	uint64 checksum; //LevelChecksum of the record, checked as it's read
+};
+
+enum LevelRecordEncoding : byte
+{
+	LevelRecordRaw,       //the GeometryNodes as they are, for records with too many different nodes for a palette
+	LevelRecordRunLength, //palette index, run length-1 byte pairs
+	LevelRecordBitPacked  //bitsPerIndex bit palette indices, low bits first, 0 bits if the palette is a single node
+};
+
+const uint32 LEVEL_RECORD_MAX_PALETTE = 256;
+
+//Version 3 records start with this, then paletteCount GeometryNodes and then the record's nodes as indices into
+//the palette in the same y, x, z order as an uncompressed record. Levels are mostly long runs of the same node
+//so most records come down to a couple of palette entries and a handful of runs
+struct LevelRecordHeader
+{
+	byte encoding;
+	byte bitsPerIndex;
+	uint16 paletteCount;
+};
+
 struct LevelData
 {
 	unsigned int width;
 	unsigned int height;
 	unsigned int totalSize;
 	GeometryNode* nodes;
+	char name[LEVEL_NAME_LENGTH];
+
+	//only for version 2 and up, nodes then only holds the records that have been read in with LoadLevelRecord
+	const LevelChunkRecord* records;
+	bool recordsCompressed;
+	const byte* recordFile;
+	uint64 recordFileSize;
+	uint32 recordsPerRow;
+};
+
+//A .levelb file is this header and then the payload at payloadOffset. In version 1 that is width*width*height
+//GeometryNodes in LinearIndex order exactly like levelNodeBlock holds them. From version 2 on it is the
+//LevelChunkRecord list, x major, followed by the records themselves. Everything is little endian
+struct LevelBinaryHeader
+{
+	uint32 magic;
+	uint32 version;
+	uint32 width;
+	uint32 height;
+	uint64 payloadOffset;
+	uint64 payloadSize;
+	uint64 checksum; //LevelChecksum of the whole payload in version 1, of just the record list after that
+	char name[LEVEL_NAME_LENGTH];
+};
+
+const uint32 LEVEL_CACHE_MAGIC = 0x434C564C; //"LVLC"
+//bump whenever cell generation or meshing changes what they put out, caches from before then just get rebuilt
+const uint32 LEVEL_CACHE_VERSION = 3;
+const uint32 LEVEL_CACHE_ALIGNMENT = 16;
+const uint32 LEVEL_CACHE_PATH_LENGTH = 260;
+
+//A .cache file sits next to its level and keeps what each column of chunks came out as, so it can be put back
+//without generating or meshing it again. It is this header, the columns and then the LevelCacheColumn list at
+//columnOffset, chunksPerRow*chunksPerRow of them x major. The header goes in last so a file that never got
+//finished doesn't match anything. Everything is little endian
+struct LevelCacheHeader
+{
+	uint32 magic;
+	uint32 version;
+	uint64 key; //LevelCacheKey of the level and node sets it was built from
+	uint32 chunksPerRow;
+	uint32 height;
+	uint64 columnOffset;
+	uint64 checksum; //LevelChecksum of the column list
+};
+
+//A column is height LevelCacheChunks and MAX_NODE_TYPES LevelCacheMeshes, then the LevelChunkCells of each chunk
+//that has its own and the vertices and indices of each mesh. Every one of those starts on LEVEL_CACHE_ALIGNMENT
+struct LevelCacheColumn
+{
+	uint64 offset; //0 if the column isn't in the cache
+	uint32 size;
+	uint32 typeMask; //bit t is set if node type t+1 is in the column, nodeTypeGeometyBufferMap comes out of these
+	uint64 checksum; //see ChainLevelCacheChecksum
+};
+
+struct LevelCacheChunk
+{
+	NodeCell uniformCell;
+	uint16 occupied[LEVEL_CHUNK_WIDTH];
+	uint32 dense; //the chunk's LevelChunkCells follow
+};
+
+struct LevelCacheMesh
+{
+	uint32 vertexCount;
+	uint32 indexCount;
+	uint32 indexType;
+	uint32 vertexSize;
+	uint32 coarseIndexStart;
 };
 
 struct GlyphData
@@ -413,20 +708,6 @@ struct Entity
 	uint32 transformIndex;
 };
 
-struct RenderEntity
-{
-	uint32 transformIndex;
-	uint32 meshBufferIndex;
-	uint32 materialIndex;
-};
-
-struct SkinnedRenderEntity
-{
-	TransformHierarchy transformHierachy;
-	uint32 meshHandleIndex;
-	uint32 materialIndex;
-};
-
 struct ModelHierarchyNode
 {
 	Mesh mesh;
@@ -1,9 +1,15 @@
 #version 430 core
 
+#ifdef PACKED_VERTEX
+//PackedVertex (types.h), only the position matters here
+layout(location = 0) in vec3 packedPosition;
+layout(location = 4) in vec3 packedOrigin;
+#else
 layout(location = 0) in vec3 position;
 layout(location = 1) in vec3 normal;
 layout(location = 2) in vec2 texCoord0;
 layout(location = 3) in vec4 color;
+#endif
 
 uniform mat4 LightVP;
 
@@ -16,5 +22,8 @@ uniform ObjectBuffer
 
 void main()
 {
+#ifdef PACKED_VERTEX
+	vec3 position = packedOrigin + packedPosition / PACKED_POSITION_SCALE;
+#endif
 	gl_Position = LightVP * ModelMatrix * vec4(position,1.0);
 };
\ No newline at end of file
@@ -1,9 +1,27 @@
 #version 430 core
 
+#ifdef PACKED_VERTEX
+//PackedVertex (types.h), positions are steps of 1/PACKED_POSITION_SCALE from packedOrigin
+layout(location = 0) in vec3 packedPosition;
+layout(location = 1) in vec2 packedNormal;
+layout(location = 2) in vec2 texCoord0;
+layout(location = 3) in vec4 color;
+layout(location = 4) in vec3 packedOrigin;
+
+vec3 OctahedralDecode(vec2 encoded)
+{
+	vec3 n = vec3(encoded, 1.0 - abs(encoded.x) - abs(encoded.y));
+	float t = max(-n.z, 0.0);
+	n.x += n.x >= 0.0 ? -t : t;
+	n.y += n.y >= 0.0 ? -t : t;
+	return normalize(n);
+}
+#else
 layout(location = 0) in vec3 position;
 layout(location = 1) in vec3 normal;
 layout(location = 2) in vec2 texCoord0;
 layout(location = 3) in vec4 color;
+#endif
 
 out VertexData
 {
@@ -31,6 +49,10 @@ uniform ObjectBuffer
 
 void main()
 {
+#ifdef PACKED_VERTEX
+	vec3 position = packedOrigin + packedPosition / PACKED_POSITION_SCALE;
+	vec3 normal = OctahedralDecode(packedNormal);
+#endif
 	vec4 worldPosition = ModelMatrix * vec4(position,1.0f);
 
 	gl_Position = CameraVP * worldPosition;